@@ -15,11 +15,13 @@
 #include "common.h"
 #include "menu.h"
 #include "ffmpeg_commands.h"
+#include "sha256.h"
 
 #define SERVER_IP "127.0.0.1"
 #define BUFFER_SIZE 4096
 #define MAX_RETRIES 3
 #define UPLOAD_TIMEOUT 10
+#define UPLOAD_STRIPES 4    // Parallel connections asked for on large uploads
 #define RESPONSE_TIMEOUT 5
 #define JOB_RESULT_TIMEOUT 30 // New timeout for JOB_RESULT
 
@@ -29,11 +31,13 @@ struct sockaddr_in server_addr;
 int sockfd;
 int download_sockfd;
 pthread_t heartbeat_tid;
+int log_level = LOG_LEVEL_INFO;     // LOG_LEVEL=debug in the environment for more
 
 int upload_file(uint32_t job_id, const char *filename); // Updated declaration
 void download_file(uint32_t job_id, const char *filename);
 void send_heartbeat(void);
 void* heartbeat_thread(void *arg);
+void *send_stripe(void *arg);
 
 int init_udp_socket(const char *ip) {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -109,7 +113,7 @@ void* heartbeat_thread(void *arg) {
 
 uint32_t submit_job(const char *command, const char **files, int file_count) {
     if (!command || !files || file_count <= 0) {
-        fprintf(stderr, "[DEBUG] Invalid job parameters\n");
+        LOG_ERROR("Invalid job parameters");
         return 0;
     }
 
@@ -117,16 +121,16 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
     size_t cmd_len = strlen(command);
     
     if (cmd_len >= MAX_CMD_LEN) {
-        fprintf(stderr, "[DEBUG] Command too long (max %d chars)\n", MAX_CMD_LEN-1);
+        LOG_ERROR("Command too long (max %d chars)", MAX_CMD_LEN-1);
         return 0;
     }
 
-    printf("[DEBUG] Submitting job %u with command: %s\n", job_id, command);
+    LOG_INFO("Submitting job %u with command: %s", job_id, command);
 
     size_t req_size = sizeof(JobRequest) + cmd_len;
     uint8_t *buffer = malloc(req_size + 1);
     if (!buffer) {
-        perror("[DEBUG] malloc failed");
+        LOG_ERRNO("malloc failed");
         return 0;
     }
     memset(buffer, 0, req_size + 1);
@@ -142,7 +146,7 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
 
     if (sendto(sockfd, buffer, req_size, 0, 
               (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("[DEBUG] sendto failed");
+        LOG_ERRNO("sendto failed");
         free(buffer);
         return 0;
     }
@@ -153,12 +157,12 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
     struct timeval tv = { .tv_sec = RESPONSE_TIMEOUT, .tv_usec = 0 };
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    printf("[DEBUG] Waiting for JOB_ACK for job %u\n", job_id);
+    LOG_DEBUG("Waiting for JOB_ACK for job %u", job_id);
     ssize_t n = recvfrom(sockfd, resp_buffer, BUFFER_SIZE, 0, 
                         (struct sockaddr *)&server_addr, &addr_len);
 
     if (n < (ssize_t)sizeof(JobResponse)) {
-        fprintf(stderr, "[DEBUG] Invalid JOB_ACK received (size=%zd)\n", n);
+        LOG_ERROR("Invalid JOB_ACK received (size=%zd)", n);
         return 0;
     }
 
@@ -173,7 +177,7 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
     printf("Job %u: %s\n", resp->job_id, message);
 
     if (resp->status != STATUS_OK) {
-        fprintf(stderr, "[DEBUG] JOB_ACK status not OK (status=%d)\n", resp->status);
+        LOG_WARN("JOB_ACK status not OK (status=%d)", resp->status);
         return 0;
     }
 
@@ -181,30 +185,30 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
     int upload_success = 1;
     for (int i = 0; i < file_count; i++) {
         if (files[i]) {
-            printf("[DEBUG] Attempting to upload file %d/%d: %s\n", i+1, file_count, files[i]);
+            LOG_DEBUG("Attempting to upload file %d/%d: %s", i+1, file_count, files[i]);
             if (!upload_file(job_id, files[i])) {
-                fprintf(stderr, "[DEBUG] Upload failed for file %s\n", files[i]);
+                LOG_ERROR("Upload failed for file %s", files[i]);
                 upload_success = 0;
             }
         }
     }
 
     if (!upload_success) {
-        fprintf(stderr, "[DEBUG] One or more file uploads failed\n");
+        LOG_ERROR("One or more file uploads failed");
         return 0;
     }
 
     // Wait for JOB_RESULT with a timeout
     tv.tv_sec = JOB_RESULT_TIMEOUT;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    printf("[DEBUG] Waiting for JOB_RESULT for job %u\n", job_id);
+    LOG_DEBUG("Waiting for JOB_RESULT for job %u", job_id);
 
     while (1) {
         n = recvfrom(sockfd, resp_buffer, BUFFER_SIZE, 0, 
                     (struct sockaddr *)&server_addr, &addr_len);
         
         if (n < 0) {
-            fprintf(stderr, "[DEBUG] Timeout or error waiting for JOB_RESULT: %s\n", strerror(errno));
+            LOG_ERROR("Timeout or error waiting for JOB_RESULT: %s", strerror(errno));
             return 0;
         }
 
@@ -221,37 +225,120 @@ uint32_t submit_job(const char *command, const char **files, int file_count) {
             if (result->status == STATUS_OK) {
                 return job_id; // Return job_id only if job succeeded
             } else {
-                fprintf(stderr, "[DEBUG] Job %u failed: %s\n", result->job_id, message);
+                LOG_ERROR("Job %u failed: %s", result->job_id, message);
                 return 0;
             }
         }
     }
 }
 
+// One TCP connection carrying one byte range of a (possibly striped) upload
+typedef struct {
+    const char *filename;
+    struct sockaddr_in addr;
+    uint64_t token;
+    int stripe;
+    uint64_t start;
+    uint64_t len;
+    uint64_t sent;
+    size_t *total_sent;     // Shared across stripes, for the progress line
+    size_t file_size;
+} StripeUpload;
+
+void *send_stripe(void *arg) {
+    StripeUpload *s = arg;
+    struct timeval tv = { .tv_sec = UPLOAD_TIMEOUT, .tv_usec = 0 };
+
+    int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_sock < 0) {
+        LOG_ERRNO("TCP socket failed");
+        return NULL;
+    }
+    setsockopt(tcp_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(tcp_sock, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0) {
+        LOG_ERROR("TCP connect failed: %s", strerror(errno));
+        close(tcp_sock);
+        return NULL;
+    }
+
+    // Tell the server which upload, and which range of it, this connection carries
+    TransferHeader header = { .token = s->token, .stripe = s->stripe };
+    if (send(tcp_sock, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        LOG_ERROR("Failed to send upload token: %s", strerror(errno));
+        close(tcp_sock);
+        return NULL;
+    }
+
+    int file_fd = open(s->filename, O_RDONLY);
+    if (file_fd < 0) {
+        LOG_ERROR("Failed to open %s: %s", s->filename, strerror(errno));
+        close(tcp_sock);
+        return NULL;
+    }
+
+    uint8_t file_buffer[65536];
+    struct timeval start, current;
+    int progress_shown = 0;
+    gettimeofday(&start, NULL);
+
+    while (s->sent < s->len) {
+        size_t want = MIN(sizeof(file_buffer), (size_t)(s->len - s->sent));
+        ssize_t bytes_read = pread(file_fd, file_buffer, want, s->start + s->sent);
+        if (bytes_read <= 0) {
+            LOG_ERROR("Read error: %s", bytes_read < 0 ? strerror(errno) : "EOF");
+            break;
+        }
+        ssize_t bytes_sent = send(tcp_sock, file_buffer, bytes_read, 0);
+        if (bytes_sent <= 0) {
+            LOG_ERROR("Send error: %s", strerror(errno));
+            break;
+        }
+        s->sent += bytes_sent;
+        size_t total = __atomic_add_fetch(s->total_sent, bytes_sent, __ATOMIC_RELAXED);
+
+        // Stripe 0 reports progress for the whole file
+        gettimeofday(&current, NULL);
+        if (s->stripe == 0 && current.tv_sec - start.tv_sec >= 1 && LOG_ENABLED(LOG_LEVEL_INFO)) {
+            printf("\rUploaded: %zu/%zu bytes (%.1f%%)",
+                   total, s->file_size, (double)total/s->file_size*100);
+            fflush(stdout);
+            start = current;
+            progress_shown = 1;
+        }
+    }
+    if (progress_shown)
+        putchar('\n');     // Log lines start on a line of their own
+
+    close(file_fd);
+    close(tcp_sock);
+    return NULL;
+}
+
 int upload_file(uint32_t job_id, const char *filename) {
     if (!filename || strlen(filename) == 0) {
-        fprintf(stderr, "[DEBUG] Error: Invalid filename\n");
+        LOG_ERROR("Invalid filename");
         return 0;
     }
 
-    printf("[DEBUG] Uploading file: %s for job %u\n", filename, job_id);
+    LOG_INFO("Uploading file: %s for job %u", filename, job_id);
 
     struct stat st;
     if (stat(filename, &st) != 0) {
-        fprintf(stderr, "[DEBUG] Error: Cannot access file '%s' - %s\n", filename, strerror(errno));
+        LOG_ERROR("Cannot access file '%s' - %s", filename, strerror(errno));
         return 0;
     }
 
     size_t name_len = strlen(filename);
     if (name_len > MAX_FILENAME_LEN) {
-        fprintf(stderr, "[DEBUG] Error: Filename too long\n");
+        LOG_ERROR("Filename too long");
         return 0;
     }
 
     size_t req_size = sizeof(UploadRequest) + name_len;
     uint8_t *buffer = malloc(req_size);
     if (!buffer) {
-        perror("[DEBUG] Error: malloc failed");
+        LOG_ERRNO("malloc failed");
         return 0;
     }
 
@@ -262,18 +349,26 @@ int upload_file(uint32_t job_id, const char *filename) {
     req->job_id = job_id;
     req->file_size = st.st_size;
     req->name_len = name_len;
+    req->stripes = UPLOAD_STRIPES;
     memcpy(buffer + sizeof(UploadRequest), filename, name_len);
 
+    // With the content hash the server can skip the transfer if it already
+    // holds the same bytes; without it the upload just goes out as usual
+    int file_fd = open(filename, O_RDONLY);
+    req->has_hash = file_fd >= 0 && sha256_fd(file_fd, req->content_hash) == 0;
+    if (file_fd >= 0)
+        close(file_fd);
+
     struct timeval tv;
     tv.tv_sec = RESPONSE_TIMEOUT;
     tv.tv_usec = 0;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     for (int attempt = 0; attempt < MAX_RETRIES; attempt++) {
-        printf("[DEBUG] Sending UPLOAD_REQ for %s, attempt %d\n", filename, attempt+1);
+        LOG_DEBUG("Sending UPLOAD_REQ for %s, attempt %d", filename, attempt+1);
         if (sendto(sockfd, buffer, req_size, 0,
                   (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-            fprintf(stderr, "[DEBUG] Attempt %d: Send failed - %s\n", attempt+1, strerror(errno));
+            LOG_WARN("Attempt %d: Send failed - %s", attempt+1, strerror(errno));
             continue;
         }
 
@@ -283,118 +378,104 @@ int upload_file(uint32_t job_id, const char *filename) {
                             (struct sockaddr *)&server_addr, &addr_len);
 
         if (n < (ssize_t)sizeof(UploadResponse)) {
-            fprintf(stderr, "[DEBUG] Attempt %d: Invalid response size (%zd)\n", attempt+1, n);
+            LOG_WARN("Attempt %d: Invalid response size (%zd)", attempt+1, n);
             continue;
         }
 
         UploadResponse *resp = (UploadResponse *)resp_buffer;
+        if (resp->status == STATUS_ALREADY_PRESENT) {
+            LOG_INFO("Server already has the contents of %s, skipping transfer", filename);
+            free(buffer);
+            return 1;
+        }
         if (resp->status != STATUS_OK) {
             char *rejected_name = "unknown";
             if (resp->name_len > 0 && n >= (ssize_t)(sizeof(UploadResponse) + resp->name_len)) {
                 rejected_name = (char *)(resp_buffer + sizeof(UploadResponse));
                 rejected_name[resp->name_len] = '\0';
             }
-            fprintf(stderr, "[DEBUG] Upload rejected for: %s (Status: %d)\n", rejected_name, resp->status);
+            LOG_WARN("Upload rejected for: %s (Status: %d)", rejected_name, resp->status);
             free(buffer);
             return 0;
         }
 
         if (resp->tcp_port == 0) {
-            fprintf(stderr, "[DEBUG] Error: Server returned invalid port 0\n");
-            free(buffer);
-            return 0;
-        }
-
-        printf("[DEBUG] Server ready on port %d, starting transfer...\n", ntohs(resp->tcp_port));
-
-        int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (tcp_sock < 0) {
-            perror("[DEBUG] TCP socket failed");
-            free(buffer);
-            return 0;
-        }
-
-        tv.tv_sec = UPLOAD_TIMEOUT;
-        setsockopt(tcp_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-        struct sockaddr_in tcp_addr;
-        memcpy(&tcp_addr, &server_addr, sizeof(tcp_addr));
-        tcp_addr.sin_port = resp->tcp_port;
-
-        if (connect(tcp_sock, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
-            fprintf(stderr, "[DEBUG] TCP connect failed: %s\n", strerror(errno));
-            close(tcp_sock);
-            free(buffer);
-            return 0;
-        }
-
-        int file_fd = open(filename, O_RDONLY);
-        if (file_fd < 0) {
-            fprintf(stderr, "[DEBUG] Failed to open %s: %s\n", filename, strerror(errno));
-            close(tcp_sock);
+            LOG_ERROR("Server returned invalid port 0");
             free(buffer);
             return 0;
         }
 
-        uint8_t file_buffer[4096];
-        ssize_t bytes_read, bytes_sent;
-        size_t total_sent = 0;
-        struct timeval start, current;
-        gettimeofday(&start, NULL);
-
-        while ((bytes_read = read(file_fd, file_buffer, sizeof(file_buffer))) > 0) {
-            bytes_sent = send(tcp_sock, file_buffer, bytes_read, 0);
-            if (bytes_sent <= 0) {
-                fprintf(stderr, "[DEBUG] Send error: %s\n", strerror(errno));
+        LOG_DEBUG("Server ready on port %d, starting transfer...", ntohs(resp->tcp_port));
+
+        if (resp->offset > 0)
+            LOG_INFO("Server already has %lu bytes, resuming", (unsigned long)resp->offset);
+
+        // One connection per granted stripe, each sending its own range
+        int stripes = resp->stripes > 0 ? MIN(resp->stripes, UPLOAD_STRIPES) : 1;
+        StripeUpload uploads[UPLOAD_STRIPES];
+        pthread_t tids[UPLOAD_STRIPES];
+        size_t total_sent = resp->offset;
+        int complete = 1;
+
+        for (int i = 0; i < stripes; i++) {
+            StripeUpload *u = &uploads[i];
+            memset(u, 0, sizeof(*u));
+            u->filename = filename;
+            memcpy(&u->addr, &server_addr, sizeof(u->addr));
+            u->addr.sin_port = resp->tcp_port;
+            u->token = resp->token;
+            u->stripe = i;
+            upload_stripe_range(resp->offset, st.st_size, stripes, i, &u->start, &u->len);
+            u->total_sent = &total_sent;
+            u->file_size = st.st_size;
+            if (pthread_create(&tids[i], NULL, send_stripe, u) != 0) {
+                stripes = i;
+                complete = 0;
                 break;
             }
-            total_sent += bytes_sent;
-            
-            gettimeofday(&current, NULL);
-            if (current.tv_sec - start.tv_sec >= 1) {
-                printf("\r[DEBUG] Uploaded: %zu/%zu bytes (%.1f%%)", 
-                      total_sent, st.st_size, (double)total_sent/st.st_size*100);
-                fflush(stdout);
-                start = current;
-            }
+        }
+        for (int i = 0; i < stripes; i++) {
+            pthread_join(tids[i], NULL);
+            if (uploads[i].sent < uploads[i].len)
+                complete = 0;
         }
 
-        close(file_fd);
-        close(tcp_sock);
-        free(buffer);
-
-        if (bytes_read < 0) {
-            fprintf(stderr, "[DEBUG] Read error: %s\n", strerror(errno));
-            return 0;
+        if (!complete) {
+            // The server keeps the longest prefix it got; the next UPLOAD_REQ resumes there
+            LOG_WARN("Upload interrupted at %zu/%zu bytes, retrying",
+                    total_sent, (size_t)st.st_size);
+            req->message_id = next_message_id++;
+            continue;
         }
+        free(buffer);
 
-        printf("\n[DEBUG] Successfully uploaded %s (%zu bytes)\n", filename, total_sent);
+        LOG_INFO("Successfully uploaded %s (%zu bytes)", filename, total_sent);
         return 1; // Success
     }
 
-    fprintf(stderr, "[DEBUG] Upload failed after %d attempts\n", MAX_RETRIES);
+    LOG_ERROR("Upload failed after %d attempts", MAX_RETRIES);
     free(buffer);
     return 0;
 }
 
 void download_file(uint32_t job_id, const char *filename) {
     if (!filename || strlen(filename) == 0) {
-        fprintf(stderr, "[DEBUG] Error: Invalid filename for download\n");
+        LOG_ERROR("Invalid filename for download");
         return;
     }
 
-    printf("[DEBUG] Downloading file: %s for job %u\n", filename, job_id);
+    LOG_INFO("Downloading file: %s for job %u", filename, job_id);
 
     size_t name_len = strlen(filename);
     if (name_len > MAX_FILENAME_LEN) {
-        fprintf(stderr, "[DEBUG] Error: Download filename too long\n");
+        LOG_ERROR("Download filename too long");
         return;
     }
 
     size_t req_size = sizeof(DownloadRequest) + name_len;
     uint8_t *buffer = malloc(req_size);
     if (!buffer) {
-        perror("[DEBUG] Error: malloc failed");
+        LOG_ERRNO("malloc failed");
         return;
     }
 
@@ -408,7 +489,7 @@ void download_file(uint32_t job_id, const char *filename) {
     
     if (sendto(sockfd, buffer, req_size, 0, 
           (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("[DEBUG] sendto failed");
+        LOG_ERRNO("sendto failed");
         free(buffer);
         return;
     }
@@ -419,12 +500,12 @@ void download_file(uint32_t job_id, const char *filename) {
     struct timeval tv = { .tv_sec = RESPONSE_TIMEOUT, .tv_usec = 0 };
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    printf("[DEBUG] Waiting for DOWNLOAD_ACK for %s\n", filename);
+    LOG_DEBUG("Waiting for DOWNLOAD_ACK for %s", filename);
     ssize_t n = recvfrom(sockfd, resp_buffer, BUFFER_SIZE, 0, 
                         (struct sockaddr *)&server_addr, &addr_len);
     
     if (n < (ssize_t)sizeof(DownloadResponse)) {
-        fprintf(stderr, "[DEBUG] Invalid DOWNLOAD_ACK received\n");
+        LOG_ERROR("Invalid DOWNLOAD_ACK received");
         return;
     }
     
@@ -437,13 +518,13 @@ void download_file(uint32_t job_id, const char *filename) {
     }
     
     if (resp->status != STATUS_OK) {
-        printf("[DEBUG] Download rejected for file: %s (Status: %d)\n", file_name, resp->status);
+        LOG_WARN("Download rejected for file: %s (Status: %d)", file_name, resp->status);
         return;
     }
     
     int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (tcp_sock < 0) {
-        perror("[DEBUG] TCP socket creation failed");
+        LOG_ERRNO("TCP socket creation failed");
         return;
     }
     
@@ -451,16 +532,24 @@ void download_file(uint32_t job_id, const char *filename) {
     memcpy(&tcp_addr, &server_addr, sizeof(tcp_addr));
     tcp_addr.sin_port = htons(SERVER_PORT + 1);
     
-    printf("[DEBUG] Connecting to server for download on port %d\n", SERVER_PORT + 1);
+    LOG_DEBUG("Connecting to server for download on port %d", SERVER_PORT + 1);
     if (connect(tcp_sock, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
-        perror("[DEBUG] TCP connect failed");
+        LOG_ERRNO("TCP connect failed");
+        close(tcp_sock);
+        return;
+    }
+    
+    // Tell the server which download this connection belongs to
+    TransferHeader header = { .token = resp->token };
+    if (send(tcp_sock, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        LOG_ERRNO("Failed to send download token");
         close(tcp_sock);
         return;
     }
     
     int file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (file_fd < 0) {
-        perror("[DEBUG] open failed");
+        LOG_ERRNO("open failed");
         close(tcp_sock);
         return;
     }
@@ -473,7 +562,7 @@ void download_file(uint32_t job_id, const char *filename) {
            (bytes_received = recv(tcp_sock, file_buffer, 
                                 MIN((size_t)bytes_remaining, sizeof(file_buffer)), 0)) > 0) {
         if (write(file_fd, file_buffer, bytes_received) != bytes_received) {
-            perror("[DEBUG] write failed");
+            LOG_ERRNO("write failed");
             break;
         }
         bytes_remaining -= bytes_received;
@@ -482,9 +571,9 @@ void download_file(uint32_t job_id, const char *filename) {
     close(file_fd);
     close(tcp_sock);
     if (bytes_remaining == 0) {
-        printf("[DEBUG] Successfully downloaded file: %s (%zu bytes)\n", file_name, resp->file_size);
+        LOG_INFO("Successfully downloaded file: %s (%zu bytes)", file_name, resp->file_size);
     } else {
-        fprintf(stderr, "[DEBUG] Download incomplete: %s\n", file_name);
+        LOG_WARN("Download incomplete: %s", file_name);
     }
 }
 
@@ -536,6 +625,9 @@ void process_menu_choice(int choice) {
 
 int main(int argc, char **argv) {
     srand(time(NULL));
+    const char *level = getenv("LOG_LEVEL");
+    if (level && log_level_parse(level) >= 0)
+        __atomic_store_n(&log_level, log_level_parse(level), __ATOMIC_RELAXED);
     if (argc > 1) {
 	    sockfd = init_udp_socket(argv[1]);
 	    download_sockfd = init_udp_socket(argv[1]);
@@ -2,6 +2,14 @@
 #include "server.h"
 #include "job_handler.h"
 #include "log_queue.h"
+#include "log_sink.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "transfer_stats.h"
+#include "blob_store.h"
+#include "result_cache.h"
+#include "upload_handler.h"
+#include "fair_queue.h"
 
 #include <sys/socket.h>
 #include <ctype.h>
@@ -22,41 +30,23 @@
 
 #define ADMIN_SOCKET_PATH "/tmp/admin.sock"
 #define INACTIVITY_TIMEOUT_MS 60000  // 60 seconds inactivity timeout
+#define ADMIN_SESSIONS_MAX 4         // Concurrent admin consoles
 
 /* Extern data structures */
 extern LogQueue global_log_queue;
-extern ClientInfo* clients;
-extern PendingJob *pending_jobs;   // Pointer to your dynamic array of pending jobs
-extern size_t client_count;
-extern size_t job_count;      // Number of jobs in the queue
-extern pthread_mutex_t clients_mutex;
 extern pthread_mutex_t max_limits_mutex;
-extern pthread_mutex_t jobs_mutex;
 
 /* Helpers */
 
+// Only the format's address and the arguments are stored; the line is
+// rendered when someone reads it, so fmt must be a string literal.
 void log_append(const char *category, const char *fmt, ...) 
 {
-	char buf[LOG_ENTRY_MAX];
 	va_list args;
 
-	// Get current time string
-	time_t now = time(NULL);
-	struct tm tm_now;
-	localtime_r(&now, &tm_now);
-	char time_str[32];
-	strftime(time_str, sizeof(time_str), "[%Y-%m-%d %H:%M:%S]", &tm_now);
-
-	// Compose the full prefix: [CATEGORY] [TIME]
-	int prefix_len = snprintf(buf, sizeof(buf), "%s %s ", category, time_str);
-
-	// Append the formatted log message
 	va_start(args, fmt);
-	vsnprintf(buf + prefix_len, sizeof(buf) - prefix_len, fmt, args);
+	log_queue_push(&global_log_queue, category, fmt, args);
 	va_end(args);
-
-	// Push to log queue
-	log_queue_push(&global_log_queue, buf);
 }
 
 static void trim_whitespace(char *str) 
@@ -102,34 +92,37 @@ static int parse_client_id(const char *hex_str, uint8_t *out_id)
 
 /* Commands */
 
-static void list_clients(int fd) 
+static void print_client(const ClientInfo *client, void *ctx)
 {
-	pthread_mutex_lock(&clients_mutex);
+	int fd = *(int *)ctx;
+
+	char ip_str[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &(client->addr.sin_addr), ip_str, sizeof(ip_str));
+	int port = ntohs(client->addr.sin_port);
+
+	char id_str[33];
+	format_client_id_hex(client->client_id, id_str, sizeof(id_str));
+
+	char time_buf[64];
+	struct tm tm_info;
+	localtime_r(&client->last_heartbeat, &tm_info);
+	strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", &tm_info);
 
-	if (client_count == 0) {
+	dprintf(fd, "  ID: %s\t  IP: %s:%d\t  Last heartbeat: %s\t  Weight: %d\n\n",
+			id_str, ip_str, port, time_buf, fair_share_weight(client->client_id));
+}
+
+static void list_clients(int fd) 
+{
+	if (client_registry_count() == 0) {
 		dprintf(fd, "[No connected clients]\n");
-		pthread_mutex_unlock(&clients_mutex);
 		return;
 	}
 
 	dprintf(fd, "Connected clients:\n");
 
-	for (size_t i = 0; i < client_count; ++i) {
-		char ip_str[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &(clients[i].addr.sin_addr), ip_str, sizeof(ip_str));
-		int port = ntohs(clients[i].addr.sin_port);
-
-		char id_str[33];
-		format_client_id_hex(clients[i].client_id, id_str, sizeof(id_str));
-
-		char time_buf[64];
-		struct tm *tm_info = localtime(&clients[i].last_heartbeat);
-		strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
-
-		dprintf(fd, "  ID: %s\t  IP: %s:%d\t  Last heartbeat: %s\n\n",
-				id_str, ip_str, port, time_buf);
-	}
-	pthread_mutex_unlock(&clients_mutex);
+	// Walks every shard, locking one at a time
+	client_registry_foreach(print_client, &fd);
 }
 
 void set_max_uploads(int n) 
@@ -138,40 +131,71 @@ void set_max_uploads(int n)
 	pthread_mutex_lock(&max_limits_mutex);
 	max_uploads = n;
 	pthread_mutex_unlock(&max_limits_mutex);
+	upload_limit_changed();
 }
 
 static int kick_client_by_id(const uint8_t client_id[16]) 
 {
-	pthread_mutex_lock(&clients_mutex);
-
-	for (size_t i = 0; i < client_count; ++i) {
-		if (memcmp(clients[i].client_id, client_id, 16) == 0) {
-			// Optionally send a "kick" UDP message to client
-			const char *kick_msg = "You have been kicked by the admin.\n";
-			sendto(udp_sock, kick_msg, strlen(kick_msg), 0,
-					(struct sockaddr*)&clients[i].addr, sizeof(clients[i].addr));
-
-			// Remove client from array
-			memmove(&clients[i], &clients[i+1], (client_count - i - 1) * sizeof(ClientInfo));
-			client_count--;
-			clients = realloc(clients, client_count * sizeof(ClientInfo));
-
-			pthread_mutex_unlock(&clients_mutex);
-			return 1; // success
-		}
-	}
+	ClientInfo removed;
+
+	// Looks in whichever shard owns this client_id
+	if (!client_registry_remove(client_id, &removed))
+		return 0; // not found
 
-	pthread_mutex_unlock(&clients_mutex);
-	return 0; // not found
+	// Optionally send a "kick" UDP message to client
+	const char *kick_msg = "You have been kicked by the admin.\n";
+	sendto(udp_sock, kick_msg, strlen(kick_msg), 0,
+			(struct sockaddr*)&removed.addr, sizeof(removed.addr));
+	return 1; // success
 }
 
+// One job as show_processing_queue prints it
+typedef struct {
+	uint8_t client_id[16];
+	uint32_t job_id;
+	char command[MAX_CMD_LEN];
+	int files_received;
+	int file_count;
+	JobClass job_class;
+	uint64_t input_bytes;
+	time_t last_update;
+	JobState state;
+} QueueRow;
+
 void show_processing_queue(int client_fd) 
 {
-	pthread_mutex_lock(&jobs_mutex);
+	// Copy the rows under jobs_lock and send only after dropping it, so a
+	// stalled admin client can't hold up the job writers
+	pthread_rwlock_rdlock(&jobs_lock);
+	size_t count = job_count();
+	QueueRow *rows = malloc((count ? count : 1) * sizeof(QueueRow));
+	PendingJob *job;
+	size_t cursor = 0;
+	size_t n = 0;
+	while (rows && n < count && (job = next_job(&cursor))) {
+		QueueRow *row = &rows[n++];
+		memcpy(row->client_id, job->client_id, 16);
+		row->job_id = job->job_id;
+		memcpy(row->command, job->command, MAX_CMD_LEN);
+		row->file_count = job->file_count;
+		row->job_class = job->job_class;
+
+		pthread_mutex_lock(&job->lock);
+		row->files_received = job->files_received;
+		row->input_bytes = job->input_bytes;
+		row->last_update = job->last_update;
+		row->state = job->state;
+		pthread_mutex_unlock(&job->lock);
+	}
+	pthread_rwlock_unlock(&jobs_lock);
 
-	if (job_count == 0) {
-		send(client_fd, "[Queue is empty]\n", 23, 0);
-		pthread_mutex_unlock(&jobs_mutex);
+	if (!rows) {
+		LOG_ERRNO("Failed to allocate processing queue rows");
+		return;
+	}
+	if (n == 0) {
+		send(client_fd, "[Queue is empty]\n", 17, 0);
+		free(rows);
 		return;
 	}
 
@@ -180,18 +204,18 @@ void show_processing_queue(int client_fd)
 	offset += snprintf(buffer + offset, sizeof(buffer) - offset,
 			"Processing queue:\n");
 
-	for (size_t i = 0; i < job_count; i++) {
-		PendingJob *job = &pending_jobs[i];  // Adjust this to your actual variable
+	for (size_t i = 0; i < n; i++) {
+		QueueRow *row = &rows[i];
 
 		// Format client ID as hex string:
 		char client_id_str[33] = {0};
 		for (int j = 0; j < 16; j++) {
-			sprintf(client_id_str + j*2, "%02x", job->client_id[j]);
+			sprintf(client_id_str + j*2, "%02x", row->client_id[j]);
 		}
 
 		// Format last_update as string:
 		char time_str[26];  // ctime_r requires buffer of size >= 26
-		ctime_r(&job->last_update, time_str);
+		ctime_r(&row->last_update, time_str);
 		// Remove trailing newline added by ctime_r:
 		time_str[strcspn(time_str, "\n")] = '\0';
 
@@ -199,13 +223,18 @@ void show_processing_queue(int client_fd)
 				"%zu. Client %s, Job ID: %u\n"
 				"    Command: %s\n"
 				"    Files: %d received out of %d\n"
+				"    Class: %s, expected %.1f s\n"
+				"    State: %s\n"
 				"    Last update: %s\n",
 				i + 1,
 				client_id_str,
-				job->job_id,
-				job->command,
-				job->files_received,
-				job->file_count,
+				row->job_id,
+				row->command,
+				row->files_received,
+				row->file_count,
+				job_class_name(row->job_class),
+				job_cost_estimate(row->job_class, row->input_bytes),
+				row->state == JOB_RUNNING ? "running" : "waiting for files",
 				time_str);
 
 		if (offset >= sizeof(buffer) - 256) {  // Leave some margin
@@ -218,11 +247,135 @@ void show_processing_queue(int client_fd)
 	if (offset > 0) {
 		send(client_fd, buffer, offset, 0);
 	}
+	free(rows);
+}
+
+void show_upload_queue(int client_fd)
+{
+	UploadQueueEntry *entries;
+	size_t count = upload_queue_snapshot(&entries);
+
+	if (count == 0) {
+		send(client_fd, "[Upload queue is empty]\n", 24, 0);
+		free(entries);
+		return;
+	}
+
+	char buffer[4096];
+	size_t offset = 0;
+	offset += snprintf(buffer + offset, sizeof(buffer) - offset,
+			"Upload queue (next to start first):\n");
+
+	for (size_t i = 0; i < count; i++) {
+		UploadQueueEntry *e = &entries[i];
+		offset += snprintf(buffer + offset, sizeof(buffer) - offset,
+				"%zu. Client %02x%02x, Job ID: %u, %s (stripe %d/%d)\n"
+				"    Size: %lu bytes, waiting %.0f s, effective priority %.2f\n",
+				i + 1, e->client_id[0], e->client_id[1], e->job_id, e->filename,
+				e->stripe + 1, e->stripes, e->file_size, e->wait, e->priority);
+
+		if (offset >= sizeof(buffer) - 512) {
+			send(client_fd, buffer, offset, 0);
+			offset = 0;
+		}
+	}
+
+	if (offset > 0)
+		send(client_fd, buffer, offset, 0);
+	free(entries);
+}
+
+
+
+// send() that waits out a full socket buffer instead of dropping output
+static int send_blocking(int client_fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(client_fd, data, len, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { client_fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, INACTIVITY_TIMEOUT_MS) <= 0)
+				return -1;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Epoch seconds, or local time as YYYY-mm-ddTHH:MM:SS
+static int parse_log_time(const char *text, time_t *out)
+{
+	struct tm tm_arg;
+	char *end;
+
+	long secs = strtol(text, &end, 10);
+	if (end != text && *end == '\0') {
+		*out = secs;
+		return 0;
+	}
+	memset(&tm_arg, 0, sizeof(tm_arg));
+	end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm_arg);
+	if (!end || *end != '\0')
+		return -1;
+	tm_arg.tm_isdst = -1;
+	*out = mktime(&tm_arg);
+	return 0;
+}
 
-	pthread_mutex_unlock(&jobs_mutex);
+typedef struct {
+	int client_fd;
+	char buffer[8192];
+	size_t used;
+} LogRangeOutput;
+
+static int send_log_line(const char *line, size_t len, void *ctx)
+{
+	LogRangeOutput *out = ctx;
+
+	if (out->used + len + 1 > sizeof(out->buffer)) {
+		if (send_blocking(out->client_fd, out->buffer, out->used) != 0)
+			return 1;
+		out->used = 0;
+	}
+	memcpy(out->buffer + out->used, line, len);
+	out->used += len;
+	out->buffer[out->used++] = '\n';
+	return 0;
 }
 
+static void show_logs_between(int client_fd, const char *arg)
+{
+	char from_text[32], to_text[32];
+	time_t from, to;
+
+	if (!arg || sscanf(arg, "%31s %31s", from_text, to_text) != 2 ||
+	    parse_log_time(from_text, &from) != 0 || parse_log_time(to_text, &to) != 0 ||
+	    to < from) {
+		const char *usage = "Usage: SHOW_LOGS_BETWEEN <from> <to>\n"
+				    "       (epoch seconds or YYYY-mm-ddTHH:MM:SS)\n\n";
+		send(client_fd, usage, strlen(usage), 0);
+		return;
+	}
 
+	LogRangeOutput *out = malloc(sizeof(*out));
+	if (!out)
+		return;
+	out->client_fd = client_fd;
+	out->used = 0;
+
+	long matched = log_sink_query(from, to, send_log_line, out);
+	if (matched < 0)
+		out->used = snprintf(out->buffer, sizeof(out->buffer), "[Log files are off]\n\n");
+	else
+		out->used += snprintf(out->buffer + out->used, sizeof(out->buffer) - out->used,
+				      "[%ld entries]\n\n", matched);
+	send_blocking(client_fd, out->buffer, out->used);
+	free(out);
+}
 
 /* Display and thread */
 
@@ -251,8 +404,20 @@ void handle_admin_command(int client_fd, char *input, int *show_logs)
 			"      Display the processing queue.\n\n"
 			"  SET_MAX_UPLOADS <number>\n"
 			"      Set the maximum number of simultaneous uploads.\n\n"
+			"  SET_LOG_LEVEL <level>\n"
+			"      Show server messages up to error, warn, info, debug or trace.\n\n"
+			"  SET_WEIGHT <client_id> <weight>\n"
+			"      Give a client a larger share of upload slots and executors (1-100).\n\n"
+			"  SHOW_UPLOADS\n"
+			"      Show uploads waiting for a slot, their wait and effective priority.\n\n"
+			"  SHOW_STATS\n"
+			"      Show upload/download throughput, input store and result cache usage,\n"
+			"      and the per-operation job cost model.\n\n"
 			"  SHOW_LOGS\n"
 			"      Stream logs from the server in real-time (tail -f style).\n\n"
+			"  SHOW_LOGS_BETWEEN <from> <to>\n"
+			"      Print logged lines from the log files within a time window\n"
+			"      (epoch seconds or YYYY-mm-ddTHH:MM:SS, both inclusive).\n\n"
 			"  EXIT\n"
 			"      Close the admin session.\n\n";
 		send(client_fd, help, strlen(help), 0);
@@ -261,6 +426,8 @@ void handle_admin_command(int client_fd, char *input, int *show_logs)
 		*show_logs = 1;
 		send(client_fd, "[Streaming logs]\n", 17, 0);
 		// no prompt sent here, log streaming mode disables prompt
+	} else if (strcasecmp(cmd, "SHOW_LOGS_BETWEEN") == 0) {
+		show_logs_between(client_fd, arg);
 	} else if (strcasecmp(cmd, "STOP_LOGS") == 0) {
 		*show_logs = 0;
 		// send(client_fd, "[Log streaming stopped]\n", 24, 0);
@@ -287,12 +454,45 @@ void handle_admin_command(int client_fd, char *input, int *show_logs)
 		set_max_uploads(n);
 		send(client_fd, "New upload limit set.\n\n", 22, 0);
 		// send_prompt(client_fd);
+	} else if (strcasecmp(cmd, "SET_LOG_LEVEL") == 0) {
+		int level = arg ? log_level_parse(arg) : -1;
+		if (level < 0) {
+			const char *usage = "Usage: SET_LOG_LEVEL <error|warn|info|debug|trace>\n\n";
+			send(client_fd, usage, strlen(usage), 0);
+			return;
+		}
+		__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+		if (level > LOG_LEVEL_MAX)
+			send(client_fd, "Log level set; this build compiles out the most verbose.\n\n", 58, 0);
+		else
+			send(client_fd, "Log level set.\n\n", 16, 0);
+	} else if (strcasecmp(cmd, "SET_WEIGHT") == 0) {
+		char id[33];
+		int weight;
+		uint8_t carg[16];
+		if (!arg || sscanf(arg, "%32s %d", id, &weight) != 2 ||
+		    parse_client_id(id, carg) != 0 || weight < 1 || weight > FAIR_WEIGHT_MAX) {
+			const char *usage = "Usage: SET_WEIGHT <client_id> <1-100>\n\n";
+			send(client_fd, usage, strlen(usage), 0);
+			return;
+		}
+		fair_share_set_weight(carg, weight);
+		send(client_fd, "Client weight set.\n\n", 20, 0);
 	} else if (strcasecmp(cmd, "SHOW_CLIENTS") == 0) {
 		list_clients(client_fd);
 		// send_prompt(client_fd);
 	} else if (strcasecmp(cmd, "SHOW_QUEUE") == 0) {
 		show_processing_queue(client_fd);
 		// send_prompt(client_fd);
+	} else if (strcasecmp(cmd, "SHOW_UPLOADS") == 0) {
+		show_upload_queue(client_fd);
+	} else if (strcasecmp(cmd, "SHOW_STATS") == 0) {
+		char buffer[4096];
+		size_t len = transfer_stats_format(buffer, sizeof(buffer));
+		len += blob_store_format(buffer + len, sizeof(buffer) - len);
+		len += result_cache_format(buffer + len, sizeof(buffer) - len);
+		len += job_cost_format(buffer + len, sizeof(buffer) - len);
+		send(client_fd, buffer, len, 0);
 	} else if (strcasecmp(cmd, "EXIT") == 0) {
 		send(client_fd, "Goodbye.\n\n", 9, 0);
 		*show_logs = -1;  // signal disconnect
@@ -303,13 +503,6 @@ void handle_admin_command(int client_fd, char *input, int *show_logs)
 	}
 }
 
-static int make_socket_non_blocking(int fd) 
-{
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags == -1) return -1;
-	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
 static int setup_admin_socket() 
 {
 	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -338,103 +531,145 @@ static int setup_admin_socket()
 	return sockfd;
 }
 
-// --- Main admin thread ---
+// --- Admin sessions ---
+
+static WorkerPool admin_pool;
+static int sessions_connected = 0;  // Admin clients connected now
+static pthread_mutex_t admin_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void admin_session(void *arg);
+
+int init_admin_handler(void)
+{
+	// One worker per session; each may be blocked streaming logs
+	if (worker_pool_init(&admin_pool, ADMIN_SESSIONS_MAX) != 0) {
+		fprintf(stderr, "[admin] Failed to start admin worker\n");
+		exit(1);
+	}
+	return setup_admin_socket();
+}
 
-void *admin_thread(void *arg) 
+// Reactor handler for the admin listen socket
+void admin_accept(int sockfd, uint32_t events, void *ctx)
 {
-	int sockfd = setup_admin_socket();
-    int client_connected = 0;  // Flag: is an admin client connected now?
+	(void)events;
+	(void)ctx;
 
 	while (1) {
 		int client_fd = accept(sockfd, NULL, NULL);
 		if (client_fd < 0) {
-			perror("accept");
-			continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("accept");
+			return;
 		}
 
-		if (client_connected) {
+		pthread_mutex_lock(&admin_session_mutex);
+		if (sessions_connected >= ADMIN_SESSIONS_MAX) {
+			pthread_mutex_unlock(&admin_session_mutex);
 			// Reject new connection politely
-			const char *msg = "Only one admin client allowed at a time. Try again later.\n";
+			const char *msg = "Too many admin clients connected. Try again later.\n";
 			send(client_fd, msg, strlen(msg), 0);
 			close(client_fd);
 			continue;
 		}
+		sessions_connected++;
+		pthread_mutex_unlock(&admin_session_mutex);
+
+		int *arg = malloc(sizeof(int));
+		if (arg)
+			*arg = client_fd;
+		if (!arg || worker_pool_submit(&admin_pool, admin_session, arg) != 0) {
+			free(arg);
+			close(client_fd);
+			pthread_mutex_lock(&admin_session_mutex);
+			sessions_connected--;
+			pthread_mutex_unlock(&admin_session_mutex);
+			continue;
+		}
+	}
+}
 
-		client_connected = 1;  // Mark client as connected
-		make_socket_non_blocking(client_fd);
-		send(client_fd, "Welcome to Admin Console.\nType HELP to see available "
-				"commands.\n", 70, 0);
+static void admin_session(void *arg)
+{
+	int client_fd = *(int *)arg;
+	free(arg);
 
-		struct pollfd fds[] = {{client_fd, POLLIN, 0}};
-		char recv_buf[4096], logline[4096];
-		int show_logs = 0;
+	make_socket_non_blocking(client_fd);
+	send(client_fd, "Welcome to Admin Console.\nType HELP to see available "
+			"commands.\n", 70, 0);
 
-		// Setup inactivity timer
-		struct timespec last_activity;
-		clock_gettime(CLOCK_MONOTONIC, &last_activity);
+	struct pollfd fds[] = {{client_fd, POLLIN, 0}};
+	char recv_buf[4096], logline[4096];
+	int show_logs = 0;
+	LogCursor logs;     // This session's place in the log stream
 
-		while (1) {
-			int timeout_ms;
+	// Setup inactivity timer
+	struct timespec last_activity;
+	clock_gettime(CLOCK_MONOTONIC, &last_activity);
 
-			if (show_logs) {
-				// Poll every 1 second to send logs but don't disconnect due to inactivity here
-				timeout_ms = 1000;
-			} else {
-				// Calculate how much time left before inactivity timeout
-				struct timespec now;
-				clock_gettime(CLOCK_MONOTONIC, &now);
+	while (1) {
+		int timeout_ms;
 
-				int elapsed_ms = (now.tv_sec - last_activity.tv_sec) * 1000 +
-					(now.tv_nsec - last_activity.tv_nsec) / 1000000;
+		if (show_logs) {
+			// Poll every 1 second to send logs but don't disconnect due to inactivity here
+			timeout_ms = 1000;
+		} else {
+			// Calculate how much time left before inactivity timeout
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
 
-				timeout_ms = INACTIVITY_TIMEOUT_MS - elapsed_ms;
+			int elapsed_ms = (now.tv_sec - last_activity.tv_sec) * 1000 +
+				(now.tv_nsec - last_activity.tv_nsec) / 1000000;
 
-				if (timeout_ms <= 0) {
-					// Timeout expired: disconnect client
-					send(client_fd, "Disconnected due to inactivity.\n", 32, 0);
-					goto disconnect;
-				}
-			}
+			timeout_ms = INACTIVITY_TIMEOUT_MS - elapsed_ms;
 
-			int ret = poll(fds, 1, timeout_ms);
-			if (ret < 0) {
-				perror("poll");
-				break;
+			if (timeout_ms <= 0) {
+				// Timeout expired: disconnect client
+				send(client_fd, "Disconnected due to inactivity.\n", 32, 0);
+				goto disconnect;
 			}
+		}
 
-			if (show_logs) {
-				// Send available logs
-				while (log_queue_pop_timed(&global_log_queue, logline, 0) == 1) {
-					strcat(logline, "\n");
-					if (send(client_fd, logline, strlen(logline), 0) <= 0)
-						goto disconnect;
+		int ret = poll(fds, 1, timeout_ms);
+		if (ret < 0) {
+			perror("poll");
+			break;
+		}
+
+		if (show_logs) {
+			// Send available logs
+			while (log_queue_read_timed(&global_log_queue, &logs, logline, sizeof(logline) - 1, 0) == 1) {
+				strcat(logline, "\n");
+				if (send(client_fd, logline, strlen(logline), 0) <= 0)
+					goto disconnect;
 
-					// Reset inactivity timer on every log sent
-					clock_gettime(CLOCK_MONOTONIC, &last_activity);
-				}
+				// Reset inactivity timer on every log sent
+				clock_gettime(CLOCK_MONOTONIC, &last_activity);
 			}
+		}
 
-			if (fds[0].revents & POLLIN) {
-				ssize_t n = recv(client_fd, recv_buf, sizeof(recv_buf) - 1, 0);
-				if (n <= 0)
-					break;
+		if (fds[0].revents & POLLIN) {
+			ssize_t n = recv(client_fd, recv_buf, sizeof(recv_buf) - 1, 0);
+			if (n <= 0)
+				break;
 
-				recv_buf[n] = 0;
+			recv_buf[n] = 0;
 
-				handle_admin_command(client_fd, recv_buf, &show_logs);
-				if (show_logs == -1)  // EXIT command received
-					break;
+			int was_showing = show_logs;
+			handle_admin_command(client_fd, recv_buf, &show_logs);
+			if (show_logs == -1)  // EXIT command received
+				break;
+			if (show_logs && !was_showing)
+				log_cursor_init(&global_log_queue, &logs);
 
-				// Reset inactivity timer on any command received
-				clock_gettime(CLOCK_MONOTONIC, &last_activity);
-			}
+			// Reset inactivity timer on any command received
+			clock_gettime(CLOCK_MONOTONIC, &last_activity);
 		}
-
-disconnect:
-		close(client_fd);
-		client_connected = 0;  // Mark client as disconnected
 	}
 
-	return NULL;
+disconnect:
+	close(client_fd);
+	pthread_mutex_lock(&admin_session_mutex);
+	sessions_connected--;
+	pthread_mutex_unlock(&admin_session_mutex);
 }
-
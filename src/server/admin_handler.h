@@ -1,7 +1,10 @@
 #ifndef ADMIN_HANDLER_H
 #define ADMIN_HANDLER_H
 
-void *admin_thread(void *arg);
+#include <stdint.h>
+
+int init_admin_handler(void);
+void admin_accept(int sockfd, uint32_t events, void *ctx);
 void log_append(const char *category, const char *fmt, ...);
 
 #endif
@@ -0,0 +1,191 @@
+#include "blob_store.h"
+#include "digest_index.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_STORE_BUCKETS 4096  // Power of two
+
+/*
+ * Content-addressed store of recently uploaded inputs. Each blob is a
+ * hardlink named by its SHA-256 under the store directory, which lives
+ * inside processing/ so linking to and from job directories never crosses
+ * a filesystem. A DigestIndex finds blobs and orders them for eviction
+ * once the store grows past its cap.
+ */
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static DigestIndex blobs;
+static char store_dir[256];
+static BlobStoreStats stats;
+
+// Caller holds store_lock
+static void evict_to_cap(void)
+{
+	char path[512];
+
+	while (blobs.bytes > stats.cap && blobs.lru_tail) {
+		DigestEntry *victim = blobs.lru_tail;
+		digest_path(store_dir, victim->digest, path, sizeof(path));
+		// Job directories keep their own links, so this only frees the
+		// store's claim on the data
+		if (unlink(path) != 0 && errno != ENOENT)
+			LOG_ERRNO("blob eviction failed");
+		digest_index_drop(&blobs, victim);
+		stats.evictions++;
+	}
+}
+
+// Create the store directory and pick up blobs left by an earlier run
+int blob_store_init(const char *dir, uint64_t cap_bytes)
+{
+	snprintf(store_dir, sizeof(store_dir), "%s", dir);
+	stats.cap = cap_bytes;
+
+	if (digest_index_init(&blobs, BLOB_STORE_BUCKETS) != 0) {
+		LOG_ERROR("Failed to allocate blob store index");
+		return -1;
+	}
+
+	if (mkdir(store_dir, 0777) != 0 && errno != EEXIST) {
+		LOG_ERRNO("Failed to create blob store directory");
+		return -1;
+	}
+
+	DIR *d = opendir(store_dir);
+	if (!d) {
+		LOG_ERRNO("Failed to open blob store directory");
+		return -1;
+	}
+
+	struct dirent *ent;
+	char path[512];
+	pthread_mutex_lock(&store_lock);
+	while ((ent = readdir(d))) {
+		uint8_t hash[SHA256_DIGEST_LEN];
+		struct stat st;
+		if (digest_parse_hex(ent->d_name, hash) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", store_dir, ent->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		digest_index_insert(&blobs, hash, st.st_size);
+	}
+	evict_to_cap();
+	pthread_mutex_unlock(&store_lock);
+	closedir(d);
+
+	LOG_INFO("Blob store at %s: %lu blobs, %lu of %lu bytes",
+	       store_dir, blobs.count, blobs.bytes, stats.cap);
+	return 0;
+}
+
+/*
+ * Put the blob with this hash at path, replacing whatever is there. A
+ * retransmitted request finds its earlier link in place and gets
+ * BLOB_ALREADY_LINKED, so the file is only counted once.
+ */
+int blob_store_link(const uint8_t hash[SHA256_DIGEST_LEN], const char *path)
+{
+	char source[512];
+	struct stat have, want;
+	int result = BLOB_MISSING;
+
+	pthread_mutex_lock(&store_lock);
+	DigestEntry *b = digest_index_find(&blobs, hash);
+	if (!b) {
+		stats.misses++;
+		pthread_mutex_unlock(&store_lock);
+		return BLOB_MISSING;
+	}
+
+	digest_path(store_dir, hash, source, sizeof(source));
+	if (stat(source, &want) != 0) {
+		// Removed behind our back
+		digest_index_drop(&blobs, b);
+		stats.misses++;
+		pthread_mutex_unlock(&store_lock);
+		return BLOB_MISSING;
+	}
+
+	if (stat(path, &have) == 0 && have.st_dev == want.st_dev && have.st_ino == want.st_ino) {
+		result = BLOB_ALREADY_LINKED;
+	} else {
+		if (unlink(path) != 0 && errno != ENOENT)
+			LOG_ERRNO("unlink before blob link failed");
+		if (link(source, path) == 0)
+			result = BLOB_LINKED;
+		else
+			LOG_ERRNO("blob link failed");
+	}
+
+	if (result != BLOB_MISSING) {
+		digest_index_touch(&blobs, b);
+		stats.hits++;
+	} else {
+		stats.misses++;
+	}
+	pthread_mutex_unlock(&store_lock);
+	return result;
+}
+
+// Remember a verified upload; path must already hold exactly those bytes
+void blob_store_add(const uint8_t hash[SHA256_DIGEST_LEN], const char *path, uint64_t size)
+{
+	char target[512];
+
+	pthread_mutex_lock(&store_lock);
+	DigestEntry *b = digest_index_find(&blobs, hash);
+	if (b) {
+		digest_index_touch(&blobs, b);
+		pthread_mutex_unlock(&store_lock);
+		return;
+	}
+	if (stats.cap == 0 || size > stats.cap) {
+		pthread_mutex_unlock(&store_lock);
+		return;
+	}
+
+	digest_path(store_dir, hash, target, sizeof(target));
+	// A leftover file not in the index can't be trusted; replace it
+	if (link(path, target) != 0 && (errno != EEXIST || unlink(target) != 0 ||
+	                                 link(path, target) != 0)) {
+		LOG_ERRNO("Failed to add blob");
+		pthread_mutex_unlock(&store_lock);
+		return;
+	}
+	if (!digest_index_insert(&blobs, hash, size))
+		unlink(target);
+	evict_to_cap();
+	pthread_mutex_unlock(&store_lock);
+}
+
+void blob_store_snapshot(BlobStoreStats *out)
+{
+	pthread_mutex_lock(&store_lock);
+	*out = stats;
+	out->blobs = blobs.count;
+	out->bytes = blobs.bytes;
+	pthread_mutex_unlock(&store_lock);
+}
+
+size_t blob_store_format(char *buf, size_t len)
+{
+	BlobStoreStats s;
+	blob_store_snapshot(&s);
+
+	int n = snprintf(buf, len,
+			"Input store: %lu blobs, %.1f of %.1f MB, %lu hits, %lu misses, "
+			"%lu evictions\n",
+			s.blobs, s.bytes / 1048576.0, s.cap / 1048576.0,
+			s.hits, s.misses, s.evictions);
+	if (n < 0)
+		return 0;
+	return (size_t)n < len ? (size_t)n : len - 1;
+}
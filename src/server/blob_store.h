@@ -0,0 +1,32 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include "sha256.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLOB_STORE_DIR    "processing/.store"
+#define BLOB_STORE_CAP_MB 4096
+
+enum {
+	BLOB_MISSING = 0,
+	BLOB_LINKED,            // Linked into place just now
+	BLOB_ALREADY_LINKED     // Destination was already this blob
+};
+
+typedef struct {
+	uint64_t blobs;
+	uint64_t bytes;
+	uint64_t cap;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} BlobStoreStats;
+
+int blob_store_init(const char *dir, uint64_t cap_bytes);
+int blob_store_link(const uint8_t hash[SHA256_DIGEST_LEN], const char *path);
+void blob_store_add(const uint8_t hash[SHA256_DIGEST_LEN], const char *path, uint64_t size);
+void blob_store_snapshot(BlobStoreStats *out);
+size_t blob_store_format(char *buf, size_t len);
+
+#endif // BLOB_STORE_H
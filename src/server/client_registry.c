@@ -0,0 +1,183 @@
+#include "client_registry.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int shard_count = 1;
+
+static ClientShard shards[MAX_SHARDS];
+static time_t heartbeat_timeout;
+
+static uint64_t monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec;
+}
+
+void client_registry_init(int count, time_t timeout)
+{
+	uint64_t now = monotonic_seconds();
+
+	shard_count = count;
+	heartbeat_timeout = timeout;
+	for (int i = 0; i < shard_count; i++) {
+		if (client_table_init(&shards[i].table) != 0) {
+			LOG_ERROR("Failed to allocate client table");
+			exit(EXIT_FAILURE);
+		}
+		timer_wheel_init(&shards[i].expiry, now);
+		pthread_mutex_init(&shards[i].mutex, NULL);
+	}
+}
+
+// The tail of the id selects the shard
+int client_shard_of(const uint8_t client_id[16])
+{
+	uint32_t tail = ((uint32_t)client_id[12] << 24) | ((uint32_t)client_id[13] << 16) |
+		((uint32_t)client_id[14] << 8) | client_id[15];
+	return tail % shard_count;
+}
+
+int client_registry_add(const ClientInfo *client)
+{
+	ClientShard *s = &shards[client_shard_of(client->client_id)];
+	uint64_t deadline = monotonic_seconds() + heartbeat_timeout;
+	int ok = 1;
+
+	pthread_mutex_lock(&s->mutex);
+	ClientInfo *existing = client_table_find(&s->table, client->client_id);
+	if (existing) {
+		existing->addr = client->addr;
+		existing->last_heartbeat = client->last_heartbeat;
+		timer_wheel_arm(&s->expiry, &existing->timer->node, deadline);
+	} else {
+		ClientTimer *timer = malloc(sizeof(ClientTimer));
+		ClientInfo entry = *client;
+		entry.timer = timer;
+
+		if (!timer || !client_table_insert(&s->table, &entry)) {
+			free(timer);
+			ok = 0;
+		} else {
+			timer_node_init(&timer->node);
+			memcpy(timer->client_id, client->client_id, 16);
+			timer_wheel_arm(&s->expiry, &timer->node, deadline);
+		}
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return ok;
+}
+
+// Record a heartbeat. Returns 0 if the client is unknown.
+int client_registry_touch(const uint8_t client_id[16], const struct sockaddr_in *addr)
+{
+	ClientShard *s = &shards[client_shard_of(client_id)];
+	int found = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	ClientInfo *client = client_table_find(&s->table, client_id);
+	if (client) {
+		client->last_heartbeat = time(NULL);
+		client->addr = *addr;
+		timer_wheel_arm(&s->expiry, &client->timer->node,
+				monotonic_seconds() + heartbeat_timeout);
+		found = 1;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return found;
+}
+
+int client_registry_find(const uint8_t client_id[16], ClientInfo *out)
+{
+	ClientShard *s = &shards[client_shard_of(client_id)];
+	int found = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	ClientInfo *client = client_table_find(&s->table, client_id);
+	if (client) {
+		if (out)
+			*out = *client;
+		found = 1;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return found;
+}
+
+int client_registry_remove(const uint8_t client_id[16], ClientInfo *out)
+{
+	ClientShard *s = &shards[client_shard_of(client_id)];
+	ClientInfo removed;
+
+	pthread_mutex_lock(&s->mutex);
+	int found = client_table_remove(&s->table, client_id, &removed);
+	if (found) {
+		timer_wheel_cancel(&s->expiry, &removed.timer->node);
+		free(removed.timer);
+		removed.timer = NULL;
+		if (out)
+			*out = removed;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return found;
+}
+
+// Timer callback, runs with the shard lock held
+static void expire_client(TimerNode *node, void *ctx)
+{
+	ClientShard *s = ctx;
+	ClientTimer *timer = (ClientTimer *)node;
+
+	LOG_INFO("Removing client %02x%02x due to timeout",
+			timer->client_id[0], timer->client_id[1]);
+	client_table_remove(&s->table, timer->client_id, NULL);
+	free(timer);
+}
+
+// Advance every shard's wheel to now, dropping the clients that came due
+size_t client_registry_expire(void)
+{
+	uint64_t now = monotonic_seconds();
+	size_t removed = 0;
+
+	for (int k = 0; k < shard_count; k++) {
+		ClientShard *s = &shards[k];
+
+		pthread_mutex_lock(&s->mutex);
+		removed += timer_wheel_advance(&s->expiry, now, expire_client, s);
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	if (removed > 0)
+		LOG_INFO("Cleaned up %zu dead clients, %zu remain",
+				removed, client_registry_count());
+	return removed;
+}
+
+size_t client_registry_count(void)
+{
+	size_t total = 0;
+
+	for (int k = 0; k < shard_count; k++) {
+		pthread_mutex_lock(&shards[k].mutex);
+		total += shards[k].table.count;
+		pthread_mutex_unlock(&shards[k].mutex);
+	}
+	return total;
+}
+
+// Visit every client, one shard lock at a time
+void client_registry_foreach(void (*fn)(const ClientInfo *client, void *ctx), void *ctx)
+{
+	for (int k = 0; k < shard_count; k++) {
+		ClientInfo *client;
+		size_t cursor = 0;
+
+		pthread_mutex_lock(&shards[k].mutex);
+		while ((client = client_table_next(&shards[k].table, &cursor)))
+			fn(client, ctx);
+		pthread_mutex_unlock(&shards[k].mutex);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "client_table.h"
+
+#define MAX_SHARDS 64
+
+/*
+ * The client table is split into shards by client_id. Every UDP receiver
+ * hands out ids that map to its own shard, so a client's heartbeats and
+ * job requests only ever take that one shard's lock.
+ *
+ * Liveness is tracked with a timing wheel per shard: a heartbeat re-arms
+ * the client's timer and expiry only visits clients that are actually due.
+ */
+typedef struct {
+	ClientTable table;
+	TimerWheel expiry;      // One-second ticks, armed per client
+	pthread_mutex_t mutex;
+} ClientShard;
+
+extern int shard_count;
+
+void client_registry_init(int shards, time_t timeout);
+int client_shard_of(const uint8_t client_id[16]);
+int client_registry_add(const ClientInfo *client);
+int client_registry_touch(const uint8_t client_id[16], const struct sockaddr_in *addr);
+int client_registry_find(const uint8_t client_id[16], ClientInfo *out);
+int client_registry_remove(const uint8_t client_id[16], ClientInfo *out);
+size_t client_registry_expire(void);
+size_t client_registry_count(void);
+void client_registry_foreach(void (*fn)(const ClientInfo *client, void *ctx), void *ctx);
+
+#endif // CLIENT_REGISTRY_H
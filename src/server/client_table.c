@@ -0,0 +1,37 @@
+#include "client_table.h"
+
+int client_table_init(ClientTable *t)
+{
+	return open_table_init(t, 16, sizeof(ClientInfo));
+}
+
+void client_table_free(ClientTable *t)
+{
+	open_table_free(t);
+}
+
+ClientInfo *client_table_find(ClientTable *t, const uint8_t client_id[16])
+{
+	return open_table_find(t, client_id);
+}
+
+// Insert or overwrite. The returned pointer is valid until the next insert.
+ClientInfo *client_table_insert(ClientTable *t, const ClientInfo *client)
+{
+	int created;
+	ClientInfo *slot = open_table_insert(t, client->client_id, &created);
+	if (slot)
+		*slot = *client;
+	return slot;
+}
+
+int client_table_remove(ClientTable *t, const uint8_t client_id[16], ClientInfo *out)
+{
+	return open_table_remove(t, client_id, out);
+}
+
+// Cursor iteration as in open_table_next; removing the entry just returned is allowed
+ClientInfo *client_table_next(ClientTable *t, size_t *cursor)
+{
+	return open_table_next(t, cursor);
+}
@@ -0,0 +1,34 @@
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "timer_wheel.h"
+#include "open_table.h"
+
+typedef struct {
+	TimerNode node;
+	uint8_t client_id[16];
+} ClientTimer;
+
+typedef struct {
+	uint8_t client_id[16];
+	struct sockaddr_in addr;
+	time_t last_heartbeat;
+	ClientTimer *timer;     // Heap-allocated so it survives table rehashes
+} ClientInfo;
+
+// Clients by their 16-byte client_id (the key ClientInfo starts with). Not
+// thread-safe: the owning registry shard holds the lock.
+typedef OpenTable ClientTable;
+
+int client_table_init(ClientTable *t);
+void client_table_free(ClientTable *t);
+ClientInfo *client_table_find(ClientTable *t, const uint8_t client_id[16]);
+ClientInfo *client_table_insert(ClientTable *t, const ClientInfo *client);
+int client_table_remove(ClientTable *t, const uint8_t client_id[16], ClientInfo *out);
+ClientInfo *client_table_next(ClientTable *t, size_t *cursor);
+
+#endif // CLIENT_TABLE_H
@@ -0,0 +1,115 @@
+#include "digest_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// buckets must be a power of two
+int digest_index_init(DigestIndex *ix, size_t buckets)
+{
+	memset(ix, 0, sizeof(*ix));
+	ix->buckets = calloc(buckets, sizeof(DigestEntry *));
+	if (!ix->buckets)
+		return -1;
+	ix->bucket_mask = buckets - 1;
+	return 0;
+}
+
+static DigestEntry **bucket_of(DigestIndex *ix, const uint8_t *digest)
+{
+	uint64_t h;
+	// The digest is already uniform; its first bytes make a fine index
+	memcpy(&h, digest, sizeof(h));
+	return &ix->buckets[(size_t)h & ix->bucket_mask];
+}
+
+static void lru_unlink(DigestIndex *ix, DigestEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		ix->lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		ix->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(DigestIndex *ix, DigestEntry *e)
+{
+	e->prev = NULL;
+	e->next = ix->lru_head;
+	if (ix->lru_head)
+		ix->lru_head->prev = e;
+	ix->lru_head = e;
+	if (!ix->lru_tail)
+		ix->lru_tail = e;
+}
+
+DigestEntry *digest_index_find(DigestIndex *ix, const uint8_t *digest)
+{
+	for (DigestEntry *e = *bucket_of(ix, digest); e; e = e->chain)
+		if (memcmp(e->digest, digest, SHA256_DIGEST_LEN) == 0)
+			return e;
+	return NULL;
+}
+
+// Add a most recently used entry; the caller checked it isn't there yet
+DigestEntry *digest_index_insert(DigestIndex *ix, const uint8_t *digest, uint64_t size)
+{
+	DigestEntry *e = calloc(1, sizeof(DigestEntry));
+	if (!e)
+		return NULL;
+	memcpy(e->digest, digest, SHA256_DIGEST_LEN);
+	e->size = size;
+	DigestEntry **bucket = bucket_of(ix, digest);
+	e->chain = *bucket;
+	*bucket = e;
+	lru_push_front(ix, e);
+	ix->count++;
+	ix->bytes += size;
+	return e;
+}
+
+// Forget the entry; the caller decides what happens to its files
+void digest_index_drop(DigestIndex *ix, DigestEntry *e)
+{
+	DigestEntry **p = bucket_of(ix, e->digest);
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	lru_unlink(ix, e);
+	ix->count--;
+	ix->bytes -= e->size;
+	free(e);
+}
+
+// Mark the entry most recently used
+void digest_index_touch(DigestIndex *ix, DigestEntry *e)
+{
+	lru_unlink(ix, e);
+	lru_push_front(ix, e);
+}
+
+// dir/<digest in lowercase hex>
+void digest_path(const char *dir, const uint8_t *digest, char *path, size_t len)
+{
+	int n = snprintf(path, len, "%s/", dir);
+	for (int i = 0; i < SHA256_DIGEST_LEN && n + 2 < (int)len; i++, n += 2)
+		snprintf(path + n, len - n, "%02x", digest[i]);
+}
+
+// The digest a file name written by digest_path stands for; -1 if it isn't one
+int digest_parse_hex(const char *name, uint8_t *digest)
+{
+	if (strlen(name) != SHA256_DIGEST_LEN * 2)
+		return -1;
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+		unsigned int byte;
+		if (sscanf(name + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		digest[i] = (uint8_t)byte;
+	}
+	return 0;
+}
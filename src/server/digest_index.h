@@ -0,0 +1,40 @@
+#ifndef DIGEST_INDEX_H
+#define DIGEST_INDEX_H
+
+#include "sha256.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Entries named by a SHA-256 digest, found through a hash chain and kept
+ * on an LRU list so the owner can evict from the tail once its total size
+ * passes a cap. The blob store and the result cache each keep one, under
+ * their own lock; nothing here locks.
+ */
+typedef struct DigestEntry {
+	uint8_t digest[SHA256_DIGEST_LEN];
+	uint64_t size;
+	struct DigestEntry *chain;
+	struct DigestEntry *prev;       // Towards most recently used
+	struct DigestEntry *next;
+} DigestEntry;
+
+typedef struct {
+	DigestEntry **buckets;
+	size_t bucket_mask;
+	DigestEntry *lru_head;
+	DigestEntry *lru_tail;
+	uint64_t count;
+	uint64_t bytes;                 // Sum of the entries' sizes
+} DigestIndex;
+
+int digest_index_init(DigestIndex *ix, size_t buckets);
+DigestEntry *digest_index_find(DigestIndex *ix, const uint8_t *digest);
+DigestEntry *digest_index_insert(DigestIndex *ix, const uint8_t *digest, uint64_t size);
+void digest_index_drop(DigestIndex *ix, DigestEntry *e);
+void digest_index_touch(DigestIndex *ix, DigestEntry *e);
+
+void digest_path(const char *dir, const uint8_t *digest, char *path, size_t len);
+int digest_parse_hex(const char *name, uint8_t *digest);
+
+#endif // DIGEST_INDEX_H
@@ -0,0 +1,302 @@
+#include "download_handler.h"
+#include "common.h"
+#include "server.h"
+#include "worker_pool.h"
+#include "transfer_stats.h"
+#include "token_table.h"
+#include "handshake.h"
+#include "job_handler.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#define DOWNLOAD_CHUNK (8 * 1024 * 1024)   // Bytes per sendfile call
+#define DOWNLOAD_TOKEN_TTL 60              // Seconds a client has to connect
+
+typedef struct {
+    uint8_t client_id[16];
+    uint32_t job_id;
+    char filename[MAX_FILENAME_LEN];
+    uint32_t message_id;
+    struct sockaddr_in client_addr;
+    time_t arrival_time;
+    uint64_t token;
+    int fd;                     // Set once the client connected with the token
+    struct sockaddr_in peer;
+} DownloadJob;
+
+int max_downloads = MAX_DOWNLOADS;
+
+/*
+ * A DOWNLOAD_REQ parks its job in pending_downloads under a fresh token
+ * until the client connects with it. Matched connections go straight to
+ * the pool, whose FIFO is the download queue; max_downloads workers bound
+ * how many files stream at once.
+ */
+static TokenTable pending_downloads;
+static pthread_mutex_t pending_downloads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WorkerPool download_pool;
+
+static void download_session(void *arg);
+
+void init_download_handler(int workers) {
+    LOG_INFO("Initializing download handler with %d workers", workers);
+    max_downloads = workers;
+
+    if (token_table_init(&pending_downloads) != 0) {
+        LOG_ERROR("Failed to allocate download token table");
+        exit(EXIT_FAILURE);
+    }
+    if (worker_pool_init(&download_pool, workers) != 0) {
+        LOG_ERROR("Failed to start download workers");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Handshake finished: pair the connection with the download its token names
+static void download_connected(int fd, const struct sockaddr_in *addr, const TransferHeader *header,
+                               void *ctx) {
+    (void)ctx;
+
+    pthread_mutex_lock(&pending_downloads_mutex);
+    DownloadJob *job = token_table_take(&pending_downloads, header->token);
+    pthread_mutex_unlock(&pending_downloads_mutex);
+
+    if (!job) {
+        LOG_WARN("Rejecting download connection from %s:%d: unknown token",
+               inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        close(fd);
+        return;
+    }
+
+    job->fd = fd;
+    job->peer = *addr;
+    if (worker_pool_submit(&download_pool, download_session, job) != 0) {
+        close(fd);
+        free(job);
+    }
+}
+
+// Reactor handler for the download listen socket; ctx is the reactor
+void download_accept(int listen_fd, uint32_t events, void *ctx) {
+    (void)events;
+    
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &addr_len,
+                                SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERRNO("Download accept failed");
+            return;
+        }
+        
+        LOG_DEBUG("Accepted download connection from %s:%d",
+               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        
+        if (handshake_start(ctx, client_fd, &client_addr, download_connected, NULL) != 0)
+            close(client_fd);
+    }
+}
+
+// Drop downloads whose client never connected
+void download_expire_tokens(time_t now) {
+    TokenEntry *entry;
+    size_t cursor = 0;
+
+    pthread_mutex_lock(&pending_downloads_mutex);
+    while ((entry = token_table_next(&pending_downloads, &cursor))) {
+        DownloadJob *job = entry->value;
+        if (now - job->arrival_time < DOWNLOAD_TOKEN_TTL)
+            continue;
+        LOG_WARN("Download token expired: job_id=%u, filename=%s",
+               job->job_id, job->filename);
+        token_table_take(&pending_downloads, entry->token);
+        free(job);
+    }
+    pthread_mutex_unlock(&pending_downloads_mutex);
+}
+
+// Plain read/send loop for files sendfile can't handle
+static uint64_t send_file_copy(int client_fd, int file_fd) {
+    uint8_t buffer[4096];
+    ssize_t bytes_read;
+    uint64_t sent = 0;
+    while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
+        if (send(client_fd, buffer, bytes_read, 0) != bytes_read) {
+            LOG_ERRNO("send failed");
+            break;
+        }
+        sent += bytes_read;
+    }
+    return sent;
+}
+
+/*
+ * Stream the file with sendfile so the data never passes through user
+ * space. The socket stays corked for the whole transfer, so only the final
+ * partial segment goes out short. Sets *fallback when the kernel refuses
+ * sendfile for this file and the copy loop did the work instead.
+ */
+static uint64_t send_file_zero_copy(int client_fd, int file_fd, int *fallback) {
+    struct stat st;
+    int on = 1, off = 0;
+    uint64_t sent = 0;
+    
+    *fallback = 0;
+    if (fstat(file_fd, &st) != 0) {
+        LOG_ERRNO("fstat failed");
+        return 0;
+    }
+    
+    setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    while (sent < (uint64_t)st.st_size) {
+        size_t chunk = st.st_size - sent > DOWNLOAD_CHUNK ? DOWNLOAD_CHUNK : st.st_size - sent;
+        ssize_t n = sendfile(client_fd, file_fd, NULL, chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            *fallback = 1;
+            sent = send_file_copy(client_fd, file_fd);
+            break;
+        }
+        if (n <= 0) {
+            if (n < 0)
+                LOG_ERRNO("sendfile failed");
+            break;
+        }
+        sent += n;
+    }
+    setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    return sent;
+}
+
+static void download_session(void *arg) {
+    DownloadJob *job = arg;
+    int client_fd = job->fd;
+    
+    // The token proves which job this is; the registry check makes sure the
+    // client is still alive and connecting from where it registered
+    ClientInfo client;
+    int client_valid = client_registry_find(job->client_id, &client) &&
+                       client.addr.sin_addr.s_addr == job->peer.sin_addr.s_addr;
+    
+    if (!client_valid) {
+        LOG_WARN("Invalid client for download: expected client_id=%02x%02x, IP=%s, got IP=%s:%d",
+               job->client_id[0], job->client_id[1],
+               inet_ntoa(job->client_addr.sin_addr),
+               inet_ntoa(job->peer.sin_addr), ntohs(job->peer.sin_port));
+        close(client_fd);
+        free(job);
+        return;
+    }
+    
+    // Send file
+    char file_path[512];
+    job_path(file_path, sizeof(file_path), job->client_id, job->job_id, job->filename);
+    
+    LOG_DEBUG("Sending file: %s for job_id=%u", file_path, job->job_id);
+    
+    int file_fd = open(file_path, O_RDONLY);
+    if (file_fd < 0) {
+        LOG_ERRNO("open failed");
+        close(client_fd);
+        free(job);
+        return;
+    }
+    
+    int fallback;
+    uint64_t started = transfer_clock_usec();
+    uint64_t sent = send_file_zero_copy(client_fd, file_fd, &fallback);
+    transfer_stats_record(XFER_DOWNLOAD, sent, transfer_clock_usec() - started, fallback);
+    
+    close(file_fd);
+    close(client_fd);
+    LOG_DEBUG("File transfer complete for job_id=%u, filename=%s, %lu bytes",
+           job->job_id, job->filename, sent);
+    free(job);
+}
+
+void handle_download_request(UdpBatch *out, DownloadRequest *req, char *filename,
+                           struct sockaddr_in *client_addr) {
+    char file_path[512];
+    job_path(file_path, sizeof(file_path), req->client_id, req->job_id, filename);
+
+    LOG_DEBUG("handle_download_request: job_id=%u, filename=%s, file_path=%s",
+           req->job_id, filename, file_path);
+
+    struct stat st;
+    if (stat(file_path, &st) != 0) {
+        LOG_ERROR("stat failed for %s: %s", file_path, strerror(errno));
+        DownloadResponse resp;
+        resp.type = DOWNLOAD_ACK;
+        resp.message_id = req->message_id;
+        resp.status = STATUS_FILE_NOT_FOUND;
+        resp.file_size = 0;
+        resp.name_len = strlen(filename);
+        resp.token = 0;
+
+        size_t resp_size = sizeof(resp) + resp.name_len;
+        uint8_t *send_buf = malloc(resp_size);
+        memcpy(send_buf, &resp, sizeof(resp));
+        memcpy(send_buf + sizeof(resp), filename, resp.name_len);
+
+        udp_batch_reply(out, send_buf, resp_size, client_addr);
+        free(send_buf);
+        return;
+    }
+
+    // Ensure file is readable
+    if (chmod(file_path, 0666) != 0) {
+        LOG_ERROR("chmod failed for %s: %s", file_path, strerror(errno));
+    }
+
+    DownloadJob *job = malloc(sizeof(DownloadJob));
+    uint64_t token = 0;
+    if (job) {
+        memcpy(job->client_id, req->client_id, 16);
+        job->job_id = req->job_id;
+        strncpy(job->filename, filename, MAX_FILENAME_LEN - 1);
+        job->filename[MAX_FILENAME_LEN - 1] = '\0';
+        job->message_id = req->message_id;
+        job->client_addr = *client_addr;
+        job->arrival_time = time(NULL);
+        job->fd = -1;
+
+        pthread_mutex_lock(&pending_downloads_mutex);
+        token = token_table_issue(&pending_downloads, job);
+        job->token = token;
+        pthread_mutex_unlock(&pending_downloads_mutex);
+        if (token == 0)
+            free(job);
+    }
+
+    DownloadResponse resp;
+    resp.type = DOWNLOAD_ACK;
+    resp.message_id = req->message_id;
+    resp.status = token ? STATUS_OK : STATUS_ERROR;
+    resp.file_size = st.st_size;
+    resp.name_len = strlen(filename);
+    resp.token = token;
+
+    size_t resp_size = sizeof(resp) + resp.name_len;
+    uint8_t *send_buf = malloc(resp_size);
+    memcpy(send_buf, &resp, sizeof(resp));
+    memcpy(send_buf + sizeof(resp), filename, resp.name_len);
+
+    LOG_DEBUG("Sending DOWNLOAD_ACK to %s:%d for job_id=%u, filename=%s, file_size=%lu",
+           inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port),
+           req->job_id, filename, (unsigned long)st.st_size);
+
+    udp_batch_reply(out, send_buf, resp_size, client_addr);
+    free(send_buf);
+}
@@ -0,0 +1,20 @@
+#ifndef DOWNLOAD_HANDLER_H
+#define DOWNLOAD_HANDLER_H
+
+#include "protocol.h"
+#include "udp_batch.h"
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_DOWNLOADS 8
+
+extern int max_downloads;
+
+void init_download_handler(int workers);
+void download_accept(int listen_fd, uint32_t events, void *ctx);
+void download_expire_tokens(time_t now);
+void handle_download_request(UdpBatch *out, DownloadRequest *req, char *filename, struct sockaddr_in *client_addr);
+
+#endif // DOWNLOAD_HANDLER_H
@@ -0,0 +1,299 @@
+#include "fair_queue.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIR_FLOW_INITIAL_CAPACITY 8
+
+typedef struct Weight {
+	uint8_t client_id[16];
+	int weight;
+	struct Weight *chain;
+} Weight;
+
+static pthread_mutex_t weights_lock = PTHREAD_MUTEX_INITIALIZER;
+static Weight *weights[FAIR_QUEUE_BUCKETS];
+
+static size_t client_bucket(const uint8_t *client_id)
+{
+	// FNV-1a over the id
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 16; i++) {
+		h ^= client_id[i];
+		h *= 16777619u;
+	}
+	return h & (FAIR_QUEUE_BUCKETS - 1);
+}
+
+// Caller holds weights_lock
+static int lookup_weight(const uint8_t *client_id)
+{
+	for (Weight *w = weights[client_bucket(client_id)]; w; w = w->chain)
+		if (memcmp(w->client_id, client_id, 16) == 0)
+			return w->weight;
+	return 1;
+}
+
+int fair_share_weight(const uint8_t *client_id)
+{
+	pthread_mutex_lock(&weights_lock);
+	int weight = lookup_weight(client_id);
+	pthread_mutex_unlock(&weights_lock);
+	return weight;
+}
+
+void fair_share_set_weight(const uint8_t *client_id, int weight)
+{
+	Weight **p = &weights[client_bucket(client_id)];
+
+	weight = weight < 1 ? 1 : weight > FAIR_WEIGHT_MAX ? FAIR_WEIGHT_MAX : weight;
+	pthread_mutex_lock(&weights_lock);
+	while (*p && memcmp((*p)->client_id, client_id, 16) != 0)
+		p = &(*p)->chain;
+	if (*p && weight == 1) {
+		// Back to the default; no need to remember it
+		Weight *gone = *p;
+		*p = gone->chain;
+		free(gone);
+	} else if (*p) {
+		(*p)->weight = weight;
+	} else if (weight != 1) {
+		Weight *w = malloc(sizeof(Weight));
+		if (w) {
+			memcpy(w->client_id, client_id, 16);
+			w->weight = weight;
+			w->chain = NULL;
+			*p = w;
+		}
+	}
+	pthread_mutex_unlock(&weights_lock);
+}
+
+void fair_queue_init(FairQueue *q, FairBefore before, FairCost cost, double quantum)
+{
+	memset(q, 0, sizeof(*q));
+	q->before = before;
+	q->cost = cost;
+	q->quantum = quantum;
+}
+
+static FairFlow *find_flow(FairQueue *q, const uint8_t *client_id)
+{
+	for (FairFlow *f = q->buckets[client_bucket(client_id)]; f; f = f->chain)
+		if (memcmp(f->client_id, client_id, 16) == 0)
+			return f;
+	return NULL;
+}
+
+static void ring_append(FairQueue *q, FairFlow *f)
+{
+	if (!q->ring) {
+		f->next = f->prev = f;
+		q->ring = f;
+		return;
+	}
+	// Just behind the client being served, i.e. last in the round
+	f->next = q->ring;
+	f->prev = q->ring->prev;
+	q->ring->prev->next = f;
+	q->ring->prev = f;
+}
+
+static void ring_remove(FairQueue *q, FairFlow *f)
+{
+	if (f->next == f) {
+		q->ring = NULL;
+	} else {
+		f->prev->next = f->next;
+		f->next->prev = f->prev;
+		if (q->ring == f)
+			q->ring = f->next;
+	}
+}
+
+// A client with nothing queued leaves the ring and is forgotten
+static void drop_flow(FairQueue *q, FairFlow *f)
+{
+	FairFlow **p = &q->buckets[client_bucket(f->client_id)];
+	while (*p != f)
+		p = &(*p)->chain;
+	*p = f->chain;
+	ring_remove(q, f);
+	free(f->items);
+	free(f);
+}
+
+static void swap_items(FairFlow *f, int i, int j)
+{
+	void *tmp = f->items[i];
+	f->items[i] = f->items[j];
+	f->items[j] = tmp;
+}
+
+int fair_queue_push(FairQueue *q, const uint8_t *client_id, void *item)
+{
+	FairFlow *f = find_flow(q, client_id);
+
+	if (!f) {
+		f = calloc(1, sizeof(FairFlow));
+		if (!f)
+			return -1;
+		f->items = malloc(FAIR_FLOW_INITIAL_CAPACITY * sizeof(void *));
+		if (!f->items) {
+			free(f);
+			return -1;
+		}
+		f->capacity = FAIR_FLOW_INITIAL_CAPACITY;
+		memcpy(f->client_id, client_id, 16);
+		size_t b = client_bucket(client_id);
+		f->chain = q->buckets[b];
+		q->buckets[b] = f;
+		ring_append(q, f);
+	} else if (f->size == f->capacity) {
+		void **grown = realloc(f->items, 2 * f->capacity * sizeof(void *));
+		if (!grown)
+			return -1;
+		f->items = grown;
+		f->capacity *= 2;
+	}
+
+	int i = f->size++;
+	f->items[i] = item;
+	while (i > 0 && q->before(f->items[i], f->items[(i - 1) / 2])) {
+		swap_items(f, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	q->count++;
+	return 0;
+}
+
+static void *pop_top(FairQueue *q, FairFlow *f)
+{
+	void *top = f->items[0];
+	f->items[0] = f->items[--f->size];
+
+	int i = 0;
+	while (1) {
+		int first = i, left = 2 * i + 1, right = left + 1;
+		if (left < f->size && q->before(f->items[left], f->items[first]))
+			first = left;
+		if (right < f->size && q->before(f->items[right], f->items[first]))
+			first = right;
+		if (first == i)
+			break;
+		swap_items(f, i, first);
+		i = first;
+	}
+	q->count--;
+	return top;
+}
+
+static void *serve(FairQueue *q, FairFlow *f, double cost)
+{
+	f->deficit -= cost;
+	void *item = pop_top(q, f);
+	if (f->size == 0)
+		drop_flow(q, f);
+	return item;
+}
+
+/*
+ * Where plain DRR would keep going round the ring handing out quanta until
+ * some client's next item fits, which for items costing many quanta is
+ * many laps, work out the outcome in one pass: the number of laps each
+ * client needs, the first client in ring order needing the fewest wins,
+ * and everyone is credited with the quanta those laps would have given.
+ * q->ring is the client whose turn is underway.
+ */
+static void *pop_after_laps(FairQueue *q)
+{
+	FairFlow *head = q->ring;
+	FairFlow *best = NULL;
+	double best_laps = INFINITY;
+
+	// Laps before each client's head item fits. On a lap a client is
+	// visited it gets one more quantum first, except the one whose turn
+	// is already underway.
+	pthread_mutex_lock(&weights_lock);
+	FairFlow *f = head;
+	do {
+		f->credit = q->quantum * lookup_weight(f->client_id);
+		double need = q->cost(f->items[0]) - f->deficit;
+		double quanta = need > 0 ? ceil(need / f->credit) : 0;
+		double laps = f->in_turn ? quanta : quanta > 0 ? quanta - 1 : 0;
+		if (laps < best_laps) {
+			best = f;
+			best_laps = laps;
+		}
+		f = f->next;
+	} while (f != head);
+	pthread_mutex_unlock(&weights_lock);
+
+	// Clients up to the winner are visited best_laps + 1 times, the ones
+	// after it best_laps times; credit carries over as usual
+	int reached = 0;
+	f = head;
+	do {
+		double grants = f->in_turn || reached ? best_laps : best_laps + 1;
+		f->deficit += grants * f->credit;
+		f->in_turn = 0;
+		if (f == best)
+			reached = 1;
+		f = f->next;
+	} while (f != head);
+
+	best->in_turn = 1;
+	q->ring = best;
+	return serve(q, best, q->cost(best->items[0]));
+}
+
+/*
+ * One DRR step: serve the current client while its turn covers its head
+ * item, otherwise move on and grant the next one a quantum. Only when that
+ * quantum doesn't cover the next client's head item either does the pop
+ * fall back to pop_after_laps' pass over the ring.
+ */
+void *fair_queue_pop(FairQueue *q)
+{
+	FairFlow *f = q->ring;
+
+	if (!f)
+		return NULL;
+
+	// Still within the current client's turn
+	if (f->in_turn) {
+		double cost = q->cost(f->items[0]);
+		if (cost <= f->deficit)
+			return serve(q, f, cost);
+		f->in_turn = 0;
+		f = f->next;
+	}
+
+	f->credit = q->quantum * fair_share_weight(f->client_id);
+	f->deficit += f->credit;
+	f->in_turn = 1;
+	q->ring = f;
+
+	double cost = q->cost(f->items[0]);
+	if (cost <= f->deficit)
+		return serve(q, f, cost);
+	return pop_after_laps(q);
+}
+
+// Up to max queued items, client by client in ring order, unsorted within one
+size_t fair_queue_items(FairQueue *q, void **out, size_t max)
+{
+	size_t n = 0;
+	FairFlow *f = q->ring;
+
+	if (!f)
+		return 0;
+	do {
+		for (int i = 0; i < f->size && n < max; i++)
+			out[n++] = f->items[i];
+		f = f->next;
+	} while (f != q->ring && n < max);
+	return n;
+}
@@ -0,0 +1,60 @@
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FAIR_QUEUE_BUCKETS 256     // Power of two
+#define FAIR_WEIGHT_MAX    100
+
+// Nonzero if item a should be served before b from the same client
+typedef int (*FairBefore)(const void *a, const void *b);
+// Share of the client's turn an item uses up
+typedef double (*FairCost)(const void *item);
+
+// One client's backlog: a heap ordered by the queue's FairBefore
+typedef struct FairFlow {
+	uint8_t client_id[16];
+	void **items;
+	int size;
+	int capacity;
+	double deficit;
+	double credit;              // quantum * weight, as of the last full pop
+	int in_turn;                // Got this round's quantum already
+	struct FairFlow *next;      // Round-robin ring of backlogged clients
+	struct FairFlow *prev;
+	struct FairFlow *chain;     // Hash bucket
+} FairFlow;
+
+/*
+ * Deficit round robin across client ids. Every backlogged client sits on
+ * a ring; the one at the front gets quantum * weight of credit per round
+ * and is served while its next item fits the credit, then the ring moves
+ * on. Picking the next client is O(1) while one quantum covers its head
+ * item, as it always does on the upload queue; an item costing more makes
+ * that pop a pass over the ring, O(backlogged clients), in place of the
+ * laps plain DRR would take. Within a client, items come off a heap.
+ *
+ * Not thread-safe, the owner holds its own lock. Each quantum granted reads
+ * the client's weight under the global weights lock, taken from inside
+ * that owner lock, so pops on every queue briefly share it.
+ */
+typedef struct {
+	FairFlow *buckets[FAIR_QUEUE_BUCKETS];
+	FairFlow *ring;             // Client being served; ring->prev is the last
+	FairBefore before;
+	FairCost cost;
+	double quantum;
+	size_t count;
+} FairQueue;
+
+void fair_queue_init(FairQueue *q, FairBefore before, FairCost cost, double quantum);
+int fair_queue_push(FairQueue *q, const uint8_t *client_id, void *item);
+void *fair_queue_pop(FairQueue *q);
+size_t fair_queue_items(FairQueue *q, void **out, size_t max);
+
+// Per-client weights shared by every FairQueue; 1 unless set
+int fair_share_weight(const uint8_t *client_id);
+void fair_share_set_weight(const uint8_t *client_id, int weight);
+
+#endif // FAIR_QUEUE_H
@@ -0,0 +1,146 @@
+#include "handshake.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/*
+ * A freshly accepted transfer connection whose TransferHeader hasn't fully
+ * arrived yet. The reactor reads it without blocking, so a slow or silent
+ * peer never ties up a worker thread.
+ */
+typedef struct Handshake {
+	Reactor *reactor;
+	ReactorSource *src;
+	int fd;
+	struct sockaddr_in addr;
+	uint8_t buf[sizeof(TransferHeader)];
+	size_t got;
+	HandshakeDone done;
+	void *ctx;
+	time_t deadline;
+	struct Handshake *prev, *next;
+} Handshake;
+
+/*
+ * Every handshake still waiting, oldest first. All share one timeout, so
+ * that is also deadline order and handshake_expire stops at the first one
+ * not yet due.
+ */
+static Handshake *waiting_head, *waiting_tail;
+static pthread_mutex_t waiting_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void waiting_unlink(Handshake *h)
+{
+	pthread_mutex_lock(&waiting_lock);
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		waiting_head = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		waiting_tail = h->prev;
+	pthread_mutex_unlock(&waiting_lock);
+}
+
+static void handshake_finish(Handshake *h, int ok)
+{
+	int fd = h->src->fd;
+
+	waiting_unlink(h);
+	reactor_remove(h->reactor, h->src);
+	if (ok) {
+		TransferHeader header;
+		int flags = fcntl(fd, F_GETFL, 0);
+
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+		memcpy(&header, h->buf, sizeof(header));
+		h->done(fd, &h->addr, &header, h->ctx);
+	} else {
+		close(fd);
+	}
+	free(h);
+}
+
+static void handshake_readable(int fd, uint32_t events, void *ctx)
+{
+	Handshake *h = ctx;
+	(void)events;
+
+	while (h->got < sizeof(h->buf)) {
+		ssize_t n = recv(fd, h->buf + h->got, sizeof(h->buf) - h->got, 0);
+		if (n > 0) {
+			h->got += n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (n < 0)
+			LOG_ERRNO("handshake recv failed");
+		handshake_finish(h, 0);
+		return;
+	}
+	handshake_finish(h, 1);
+}
+
+// Watch a non-blocking fd until its header is in, then hand it to done
+int handshake_start(Reactor *r, int fd, const struct sockaddr_in *addr, HandshakeDone done,
+		void *ctx)
+{
+	Handshake *h = calloc(1, sizeof(Handshake));
+	if (!h)
+		return -1;
+
+	h->reactor = r;
+	h->addr = *addr;
+	h->done = done;
+	h->ctx = ctx;
+	h->fd = fd;
+	h->deadline = time(NULL) + HANDSHAKE_TIMEOUT;
+
+	// On the list before the reactor can see the fd, so finish always finds it
+	pthread_mutex_lock(&waiting_lock);
+	h->prev = waiting_tail;
+	if (waiting_tail)
+		waiting_tail->next = h;
+	else
+		waiting_head = h;
+	waiting_tail = h;
+	pthread_mutex_unlock(&waiting_lock);
+
+	h->src = reactor_add(r, fd, EPOLLIN | EPOLLRDHUP, handshake_readable, h);
+	if (!h->src) {
+		waiting_unlink(h);
+		free(h);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Give up on peers that connected but never sent their header. The fd is
+ * only shut down here; the reactor sees the hangup and frees the handshake
+ * on its own thread, so nothing it may still be looking at goes away under
+ * it.
+ */
+void handshake_expire(time_t now)
+{
+	pthread_mutex_lock(&waiting_lock);
+	for (Handshake *h = waiting_head; h && h->deadline <= now; h = h->next) {
+		if (h->deadline == 0)
+			continue;       // Already shut down, reactor hasn't reaped it yet
+		LOG_WARN("Closing transfer connection from %s:%d: no header after %d s",
+				inet_ntoa(h->addr.sin_addr), ntohs(h->addr.sin_port), HANDSHAKE_TIMEOUT);
+		shutdown(h->fd, SHUT_RDWR);
+		h->deadline = 0;
+	}
+	pthread_mutex_unlock(&waiting_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "reactor.h"
+#include "protocol.h"
+
+#define HANDSHAKE_TIMEOUT 10        // Seconds a new connection has to send its header
+
+/*
+ * Called on the reactor thread once the TransferHeader has arrived. The fd
+ * is back in blocking mode and now belongs to the callback.
+ */
+typedef void (*HandshakeDone)(int fd, const struct sockaddr_in *addr, const TransferHeader *header,
+		void *ctx);
+
+int handshake_start(Reactor *r, int fd, const struct sockaddr_in *addr, HandshakeDone done,
+		void *ctx);
+void handshake_expire(time_t now);
+
+#endif // HANDSHAKE_H
@@ -0,0 +1,124 @@
+#include "job_cost.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Commands are matched against the markers the client's builders put in
+ * them, most specific first: a GIF also scales and a trim also seeks, so
+ * palettegen has to win over scale= and -c copy over -ss.
+ */
+static const struct {
+	const char *marker;
+	JobClass cls;
+} markers[] = {
+	{ "vidstab",        JOB_CLASS_STABILIZE },
+	{ "hqdn3d",         JOB_CLASS_DENOISE },
+	{ "palettegen",     JOB_CLASS_GIF },
+	{ "areverse",       JOB_CLASS_REVERSE },
+	{ "subtitles=",     JOB_CLASS_SUBTITLES },
+	{ "overlay=",       JOB_CLASS_OVERLAY },
+	{ "concat=",        JOB_CLASS_CONCAT },
+	{ "setpts=",        JOB_CLASS_SPEED },
+	{ "crop=",          JOB_CLASS_CROP },
+	{ "transpose=",     JOB_CLASS_ROTATE },
+	{ "eq=",            JOB_CLASS_COLOR },
+	{ "scale=",         JOB_CLASS_RESIZE },
+	{ "-vframes 1",     JOB_CLASS_FRAME },
+	{ "-c copy",        JOB_CLASS_COPY },
+	{ "-c:v copy",      JOB_CLASS_COPY },
+	{ "-acodec copy",   JOB_CLASS_COPY },
+	{ "-vcodec copy",   JOB_CLASS_COPY },
+	{ "ffmpeg -i",      JOB_CLASS_CONVERT },
+};
+
+static const char *class_names[JOB_CLASSES] = {
+	"stream copy", "frame grab", "convert", "resize", "color", "rotate", "crop",
+	"speed", "overlay", "subtitles", "concat", "gif", "reverse", "denoise",
+	"stabilize", "other"
+};
+
+// Rough seconds per MB of input until real runs say otherwise
+static JobClassModel models[JOB_CLASSES] = {
+	[JOB_CLASS_COPY]      = { 0.005, 0 },
+	[JOB_CLASS_FRAME]     = { 0.01, 0 },
+	[JOB_CLASS_CONVERT]   = { 0.3, 0 },
+	[JOB_CLASS_RESIZE]    = { 0.3, 0 },
+	[JOB_CLASS_COLOR]     = { 0.3, 0 },
+	[JOB_CLASS_ROTATE]    = { 0.3, 0 },
+	[JOB_CLASS_CROP]      = { 0.3, 0 },
+	[JOB_CLASS_SPEED]     = { 0.3, 0 },
+	[JOB_CLASS_OVERLAY]   = { 0.4, 0 },
+	[JOB_CLASS_SUBTITLES] = { 0.4, 0 },
+	[JOB_CLASS_CONCAT]    = { 0.4, 0 },
+	[JOB_CLASS_GIF]       = { 0.2, 0 },
+	[JOB_CLASS_REVERSE]   = { 0.6, 0 },
+	[JOB_CLASS_DENOISE]   = { 1.0, 0 },
+	[JOB_CLASS_STABILIZE] = { 2.5, 0 },
+	[JOB_CLASS_OTHER]     = { 0.5, 0 },
+};
+static pthread_mutex_t models_lock = PTHREAD_MUTEX_INITIALIZER;
+
+JobClass job_cost_classify(const char *command)
+{
+	for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++)
+		if (strstr(command, markers[i].marker))
+			return markers[i].cls;
+	return JOB_CLASS_OTHER;
+}
+
+const char *job_class_name(JobClass cls)
+{
+	return cls < JOB_CLASSES ? class_names[cls] : "unknown";
+}
+
+// Inputs under a megabyte are charged as one, so tiny jobs don't skew the rate
+static double input_mb(uint64_t input_bytes)
+{
+	double mb = input_bytes / (1024.0 * 1024.0);
+	return mb < 1.0 ? 1.0 : mb;
+}
+
+// Expected run time in seconds
+double job_cost_estimate(JobClass cls, uint64_t input_bytes)
+{
+	pthread_mutex_lock(&models_lock);
+	double rate = models[cls].sec_per_mb;
+	pthread_mutex_unlock(&models_lock);
+	return JOB_COST_OVERHEAD + rate * input_mb(input_bytes);
+}
+
+// Fold a finished run into its class's rate
+void job_cost_observe(JobClass cls, uint64_t input_bytes, double seconds)
+{
+	double rate = (seconds > JOB_COST_OVERHEAD ? seconds - JOB_COST_OVERHEAD : 0.0) /
+		      input_mb(input_bytes);
+
+	pthread_mutex_lock(&models_lock);
+	JobClassModel *m = &models[cls];
+	// The first run replaces the guess outright
+	if (m->runs == 0)
+		m->sec_per_mb = rate;
+	else
+		m->sec_per_mb += JOB_COST_SMOOTHING * (rate - m->sec_per_mb);
+	m->runs++;
+	pthread_mutex_unlock(&models_lock);
+}
+
+size_t job_cost_format(char *buf, size_t len)
+{
+	JobClassModel snapshot[JOB_CLASSES];
+	size_t offset = 0;
+
+	pthread_mutex_lock(&models_lock);
+	memcpy(snapshot, models, sizeof(models));
+	pthread_mutex_unlock(&models_lock);
+
+	offset += snprintf(buf + offset, len - offset, "Job cost model (ms per MB of input):\n");
+	for (int i = 0; i < JOB_CLASSES && offset < len; i++) {
+		offset += snprintf(buf + offset, len - offset, "    %-12s %10.1f  (%lu runs)\n",
+				   class_names[i], snapshot[i].sec_per_mb * 1000.0, snapshot[i].runs);
+	}
+	return offset < len ? offset : len - 1;
+}
@@ -0,0 +1,42 @@
+#ifndef JOB_COST_H
+#define JOB_COST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOB_COST_OVERHEAD 0.05      // Seconds every job costs, whatever its input
+#define JOB_COST_SMOOTHING 0.2      // Weight of the newest observation
+
+// Kinds of work the client's ffmpeg command builders produce
+typedef enum {
+	JOB_CLASS_COPY,         // trim, extract audio/video, replace audio
+	JOB_CLASS_FRAME,
+	JOB_CLASS_CONVERT,
+	JOB_CLASS_RESIZE,
+	JOB_CLASS_COLOR,        // brightness, contrast, saturation
+	JOB_CLASS_ROTATE,
+	JOB_CLASS_CROP,
+	JOB_CLASS_SPEED,
+	JOB_CLASS_OVERLAY,
+	JOB_CLASS_SUBTITLES,
+	JOB_CLASS_CONCAT,
+	JOB_CLASS_GIF,
+	JOB_CLASS_REVERSE,
+	JOB_CLASS_DENOISE,
+	JOB_CLASS_STABILIZE,
+	JOB_CLASS_OTHER,
+	JOB_CLASSES
+} JobClass;
+
+typedef struct {
+	double sec_per_mb;      // Current estimate
+	uint64_t runs;          // Observations folded into it
+} JobClassModel;
+
+JobClass job_cost_classify(const char *command);
+const char *job_class_name(JobClass cls);
+double job_cost_estimate(JobClass cls, uint64_t input_bytes);
+void job_cost_observe(JobClass cls, uint64_t input_bytes, double seconds);
+size_t job_cost_format(char *buf, size_t len);
+
+#endif // JOB_COST_H
@@ -1,4 +1,5 @@
 #include "job_handler.h"
+#include "processing.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,63 +7,210 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
 
-PendingJob *pending_jobs = NULL;
-size_t job_count = 0;
-pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t jobs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static JobTable job_table;
+
+static PendingJob *slot_job(uint32_t slot) {
+    return &job_table.chunks[slot / JOB_SLAB_CHUNK][slot % JOB_SLAB_CHUNK];
+}
+
+// Add one chunk of records to the slab. Existing records stay where they are.
+static int grow_slab(void) {
+    PendingJob **chunks = realloc(job_table.chunks,
+                                  (job_table.chunk_count + 1) * sizeof(PendingJob *));
+    if (!chunks)
+        return 0;
+    job_table.chunks = chunks;
+
+    size_t slots = (job_table.chunk_count + 1) * JOB_SLAB_CHUNK;
+    uint32_t *free_slots = realloc(job_table.free_slots, slots * sizeof(uint32_t));
+    if (!free_slots)
+        return 0;
+    job_table.free_slots = free_slots;
+
+    PendingJob *chunk = calloc(JOB_SLAB_CHUNK, sizeof(PendingJob));
+    if (!chunk)
+        return 0;
+
+    uint32_t base = job_table.chunk_count * JOB_SLAB_CHUNK;
+    for (int i = JOB_SLAB_CHUNK - 1; i >= 0; i--) {
+        pthread_mutex_init(&chunk[i].lock, NULL);
+        job_table.free_slots[job_table.free_count++] = base + i;
+    }
+    job_table.chunks[job_table.chunk_count++] = chunk;
+    return 1;
+}
+
+// The index key for a job; everything up to slot
+static void job_key(JobIndexEntry *key, const uint8_t *client_id, uint32_t job_id) {
+    memcpy(key->client_id, client_id, 16);
+    key->job_id = job_id;
+}
+
+// processing/<client_id in hex>_<job_id>, or a file in it when filename is given.
+// The whole id goes in so two clients' jobs with the same job_id never share
+// a directory, and with it the partial files an upload resumes from.
+void job_path(char *path, size_t len, const uint8_t *client_id, uint32_t job_id, const char *filename) {
+    int n = snprintf(path, len, "processing/");
+    for (int i = 0; i < 16 && n + 2 < (int)len; i++, n += 2)
+        snprintf(path + n, len - n, "%02x", client_id[i]);
+    if (n < (int)len)
+        snprintf(path + n, len - n, filename ? "_%08x/%s" : "_%08x", job_id, filename);
+}
 
 void init_job_handler(void) {
-    printf("[DEBUG] Initializing job handler\n");
+    LOG_INFO("Initializing job handler");
+
+    memset(&job_table, 0, sizeof(job_table));
+    if (open_table_init(&job_table.index, offsetof(JobIndexEntry, slot),
+                        sizeof(JobIndexEntry)) != 0) {
+        LOG_ERROR("Failed to allocate job index");
+        exit(EXIT_FAILURE);
+    }
 }
 
 int create_job(const uint8_t *client_id, struct sockaddr_in *client_addr, uint32_t job_id, const char *command, int file_count) {
     char dir_path[256];
-    snprintf(dir_path, sizeof(dir_path), "processing/%02x%02x_%08x",
-             client_id[0], client_id[1], job_id);
+    job_path(dir_path, sizeof(dir_path), client_id, job_id, NULL);
     
-    printf("[DEBUG] Creating job directory: %s\n", dir_path);
+    LOG_DEBUG("Creating job directory: %s", dir_path);
     
     // Check if directory exists
     struct stat st;
     if (stat(dir_path, &st) == 0) {
         if (S_ISDIR(st.st_mode)) {
-            printf("[DEBUG] Reusing existing directory: %s\n", dir_path);
+            LOG_DEBUG("Reusing existing directory: %s", dir_path);
         } else {
-            fprintf(stderr, "[DEBUG] Path %s exists but is not a directory\n", dir_path);
+            LOG_ERROR("Path %s exists but is not a directory", dir_path);
             return 0;
         }
     } else {
         if (mkdir(dir_path, 0777) != 0) {
-            fprintf(stderr, "[DEBUG] mkdir failed for %s: %s\n", dir_path, strerror(errno));
+            LOG_ERROR("mkdir failed for %s: %s", dir_path, strerror(errno));
             return 0;
         }
-        printf("[DEBUG] Job directory created successfully: %s\n", dir_path);
+        LOG_DEBUG("Job directory created successfully: %s", dir_path);
     }
     
-    pthread_mutex_lock(&jobs_mutex);
+    pthread_rwlock_wrlock(&jobs_lock);
     
-    PendingJob *new_jobs = realloc(pending_jobs, (job_count + 1) * sizeof(PendingJob));
-    if (!new_jobs) {
-        fprintf(stderr, "[DEBUG] realloc failed for pending_jobs: %s\n", strerror(errno));
-        pthread_mutex_unlock(&jobs_mutex);
+    JobIndexEntry key;
+    job_key(&key, client_id, job_id);
+    if (open_table_find(&job_table.index, &key)) {
+        // A retransmitted JOB_REQ; the job is already queued
+        LOG_DEBUG("Job %u already exists for client_id=%02x%02x",
+               job_id, client_id[0], client_id[1]);
+        pthread_rwlock_unlock(&jobs_lock);
+        return 1;
+    }
+    
+    if (job_table.free_count == 0 && !grow_slab()) {
+        LOG_ERROR("Failed to grow job slab: %s", strerror(errno));
+        pthread_rwlock_unlock(&jobs_lock);
         return 0;
     }
-    pending_jobs = new_jobs;
     
-    memcpy(pending_jobs[job_count].client_id, client_id, 16);
-    pending_jobs[job_count].client_addr = *client_addr;
-    pending_jobs[job_count].job_id = job_id;
-    strncpy(pending_jobs[job_count].command, command, MAX_CMD_LEN - 1);
-    pending_jobs[job_count].command[MAX_CMD_LEN - 1] = '\0';
-    pending_jobs[job_count].file_count = file_count;
-    pending_jobs[job_count].files_received = 0;
-    pending_jobs[job_count].last_update = time(NULL);
+    int created;
+    JobIndexEntry *entry = open_table_insert(&job_table.index, &key, &created);
+    if (!entry) {
+        LOG_ERROR("Failed to grow job index: %s", strerror(errno));
+        pthread_rwlock_unlock(&jobs_lock);
+        return 0;
+    }
+    
+    entry->slot = job_table.free_slots[--job_table.free_count];
+    PendingJob *job = slot_job(entry->slot);
     
-    job_count++;
+    memcpy(job->client_id, client_id, 16);
+    job->client_addr = *client_addr;
+    job->job_id = job_id;
+    strncpy(job->command, command, MAX_CMD_LEN - 1);
+    job->command[MAX_CMD_LEN - 1] = '\0';
+    job->file_count = file_count;
+    job->job_class = job_cost_classify(job->command);
+    job->files_received = 0;
+    job->inputs = NULL;
+    job->input_bytes = 0;
+    job->last_update = time(NULL);
+    job->state = JOB_WAITING;
+    job->in_use = 1;
     
-    printf("[DEBUG] Job %u created: client_id=%02x%02x, command=%s, file_count=%d\n",
+    LOG_DEBUG("Job %u created: client_id=%02x%02x, command=%s, file_count=%d",
            job_id, client_id[0], client_id[1], command, file_count);
     
-    pthread_mutex_unlock(&jobs_mutex);
+    // A job without input files can start right away
+    dispatch_if_ready(job);
+    
+    pthread_rwlock_unlock(&jobs_lock);
     return 1;
-}
\ No newline at end of file
+}
+
+// Caller holds jobs_lock
+size_t job_count(void) {
+    return job_table.index.count;
+}
+
+// Caller holds jobs_lock; the record stays valid until remove_job
+PendingJob *find_job(const uint8_t *client_id, uint32_t job_id) {
+    JobIndexEntry key;
+    job_key(&key, client_id, job_id);
+    JobIndexEntry *entry = open_table_find(&job_table.index, &key);
+    return entry ? slot_job(entry->slot) : NULL;
+}
+
+// Walk live jobs in slab order, cursor starting at 0. Caller holds jobs_lock.
+PendingJob *next_job(size_t *cursor) {
+    size_t slots = job_table.chunk_count * JOB_SLAB_CHUNK;
+    while (*cursor < slots) {
+        PendingJob *job = slot_job((*cursor)++);
+        if (job->in_use)
+            return job;
+    }
+    return NULL;
+}
+
+// Caller holds jobs_lock for writing
+void remove_job(PendingJob *job) {
+    JobIndexEntry key, entry;
+    job_key(&key, job->client_id, job->job_id);
+    if (!open_table_remove(&job_table.index, &key, &entry))
+        return;
+
+    job->in_use = 0;
+    free(job->inputs);
+    job->inputs = NULL;
+    job_table.free_slots[job_table.free_count++] = entry.slot;
+}
+
+// Caller holds job->lock. Whether filename was already counted towards the job.
+int job_has_input(const PendingJob *job, const char *filename) {
+    for (int i = 0; i < job->files_received; i++)
+        if (strcmp(job->inputs[i].name, filename) == 0)
+            return 1;
+    return 0;
+}
+
+// Caller holds job->lock. Count filename as received, with its content
+// hash if known (NULL otherwise): 1 if it is new, 0 if a retried upload
+// already counted it, -1 if out of memory.
+int job_add_input(PendingJob *job, const char *filename, const uint8_t *hash) {
+    if (job_has_input(job, filename))
+        return 0;
+    if (!job->inputs) {
+        job->inputs = calloc(MAX(job->file_count, 1), sizeof(JobInput));
+        if (!job->inputs)
+            return -1;
+    }
+    if (job->files_received >= job->file_count)
+        return 0;   // More distinct names than the job asked for; ignore
+    JobInput *input = &job->inputs[job->files_received];
+    snprintf(input->name, MAX_FILENAME_LEN, "%s", filename);
+    input->hashed = hash != NULL;
+    if (hash)
+        memcpy(input->hash, hash, SHA256_DIGEST_LEN);
+    job->files_received++;
+    return 1;
+}
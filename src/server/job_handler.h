@@ -6,6 +6,23 @@
 #include <netinet/in.h>
 #include "common.h"
 #include "protocol.h"
+#include "job_cost.h"
+#include "sha256.h"
+#include "open_table.h"
+
+#define JOB_SLAB_CHUNK 64
+
+typedef enum {
+    JOB_WAITING,    // Still receiving input files
+    JOB_RUNNING     // Handed to an executor
+} JobState;
+
+// An input file counted towards its job
+typedef struct {
+    char name[MAX_FILENAME_LEN];
+    int hashed;                 // hash is known: verified on upload or from the blob store
+    uint8_t hash[SHA256_DIGEST_LEN];
+} JobInput;
 
 typedef struct {
     uint8_t client_id[16];
@@ -13,15 +30,54 @@ typedef struct {
     uint32_t job_id;
     char command[MAX_CMD_LEN];
     int file_count;
+    int in_use;
+    JobClass job_class;         // From the command, fixed at creation
+
+    // Per-job lock: guards the upload progress and state below, so an
+    // upload finishing never needs jobs_lock for writing
+    pthread_mutex_t lock;
     int files_received;
+    JobInput *inputs;           // The files_received inputs
+    uint64_t input_bytes;       // Total size of the files received so far
     time_t last_update;
+    JobState state;
 } PendingJob;
 
-extern PendingJob *pending_jobs;
-extern size_t job_count;
-extern pthread_mutex_t jobs_mutex;
+// Job index entry: the (client_id, job_id) key, then the slab slot it names
+typedef struct {
+    uint8_t client_id[16];
+    uint32_t job_id;
+    uint32_t slot;
+} JobIndexEntry;
+
+/*
+ * Job records live in a slab of fixed-size chunks and never move once
+ * created; a hash index on (client_id, job_id) points into the slab.
+ *
+ * jobs_lock protects the index and slab membership. Lookups, iteration and
+ * upload completion take it for reading; only create_job and remove_job
+ * take it for writing.
+ */
+typedef struct {
+    PendingJob **chunks;
+    size_t chunk_count;
+
+    uint32_t *free_slots;       // Stack of unused slab slots
+    size_t free_count;
+
+    OpenTable index;            // JobIndexEntry per live job
+} JobTable;
+
+extern pthread_rwlock_t jobs_lock;
 
 void init_job_handler(void);
+void job_path(char *path, size_t len, const uint8_t *client_id, uint32_t job_id, const char *filename);
 int create_job(const uint8_t *client_id, struct sockaddr_in *client_addr, uint32_t job_id, const char *command, int file_count);
+size_t job_count(void);
+PendingJob *find_job(const uint8_t *client_id, uint32_t job_id);
+PendingJob *next_job(size_t *cursor);
+void remove_job(PendingJob *job);
+int job_has_input(const PendingJob *job, const char *filename);
+int job_add_input(PendingJob *job, const char *filename, const uint8_t *hash);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,67 +1,688 @@
 #include "log_queue.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+
+/*
+ * tail packs the next byte position, in 8-byte units, with the number of
+ * records reserved so far, so one fetch_add hands a writer both. 44 bits
+ * of position last 128 TB; the count is kept mod 2^20, far more records
+ * than the ring holds at once.
+ */
+#define LOG_POS_BITS  44
+#define LOG_POS_MASK  ((1ULL << LOG_POS_BITS) - 1)
+#define LOG_COUNT_ONE (1ULL << LOG_POS_BITS)
+#define LOG_COUNT_MOD (1ULL << (64 - LOG_POS_BITS))
+
+#define LOG_SPEC_MAX  32
+
+static const char *categories[LOG_CATEGORY_MAX];
+static int category_count;
+static pthread_mutex_t categories_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every format pointer a record was pushed with, in an insert-only
+ * open-addressed set. A reader only dereferences h->fmt once it is found
+ * here, so a bogus header (resync landing on argument bytes that happen to
+ * look like a stamp) can't send it chasing a wild pointer.
+ */
+static uint64_t formats[LOG_FORMATS_MAX];
+static const char text_fmt[] = "%s";    // Stands in once formats is full
+
+static size_t format_slot(uint64_t fmt) {
+	return (size_t)((fmt * 0x9E3779B97F4A7C15ULL) >> 32) & (LOG_FORMATS_MAX - 1);
+}
+
+static int format_known(uint64_t fmt) {
+	size_t s = format_slot(fmt);
+
+	if (fmt == 0)
+		return 0;
+	for (int i = 0; i < LOG_FORMATS_MAX; i++, s = (s + 1) & (LOG_FORMATS_MAX - 1)) {
+		uint64_t v = __atomic_load_n(&formats[s], __ATOMIC_ACQUIRE);
+		if (v == fmt)
+			return 1;
+		if (v == 0)
+			return 0;
+	}
+	return 0;
+}
+
+// Add fmt to the set unless it is there already; 0 once the set is full
+static int format_register(const char *fmt) {
+	uint64_t f = (uintptr_t)fmt;
+	size_t s = format_slot(f);
+
+	for (int i = 0; i < LOG_FORMATS_MAX; i++, s = (s + 1) & (LOG_FORMATS_MAX - 1)) {
+		uint64_t v = __atomic_load_n(&formats[s], __ATOMIC_ACQUIRE);
+		if (v == f)
+			return 1;
+		if (v == 0) {
+			if (__atomic_compare_exchange_n(&formats[s], &v, f, 0, __ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE) || v == f)
+				return 1;
+		}
+	}
+	return 0;
+}
 
 void log_queue_init(LogQueue *q) {
-	q->head = 0;
+	memset(q->ring, 0, sizeof(q->ring));
 	q->tail = 0;
-	q->count = 0;
+	q->sleeping = 0;
 	pthread_mutex_init(&q->mutex, NULL);
 	pthread_cond_init(&q->cond, NULL);
+	format_register(text_fmt);
 }
 
-// Push a log entry into the queue (thread-safe)
-void log_queue_push(LogQueue *q, const char *entry) {
-	pthread_mutex_lock(&q->mutex);
-	if (q->count == LOG_QUEUE_SIZE) {
-		// Overwrite oldest if full
-		q->head = (q->head + 1) % LOG_QUEUE_SIZE;
-		q->count--;
-	}
-	strncpy(q->entries[q->tail], entry, LOG_ENTRY_MAX - 1);
-	q->entries[q->tail][LOG_ENTRY_MAX - 1] = '\0';
-	q->tail = (q->tail + 1) % LOG_QUEUE_SIZE;
-	q->count++;
-	pthread_cond_signal(&q->cond);
-	pthread_mutex_unlock(&q->mutex);
+static uint64_t word_pos(uint64_t word) {
+	return (word & LOG_POS_MASK) * 8;
+}
+
+static uint64_t word_count(uint64_t word) {
+	return word >> LOG_POS_BITS;
+}
+
+static uint64_t make_word(uint64_t pos, uint64_t count) {
+	return pos / 8 | count << LOG_POS_BITS;
+}
+
+static uint64_t *stamp_at(LogQueue *q, uint64_t pos) {
+	return (uint64_t *)(q->ring + (pos & (LOG_RING_BYTES - 1)));
+}
+
+static void ring_write(LogQueue *q, uint64_t pos, const void *src, size_t n) {
+	size_t off = pos & (LOG_RING_BYTES - 1);
+	size_t first = n < LOG_RING_BYTES - off ? n : LOG_RING_BYTES - off;
+	memcpy(q->ring + off, src, first);
+	memcpy(q->ring, (const uint8_t *)src + first, n - first);
+}
+
+static void ring_read(LogQueue *q, uint64_t pos, void *dst, size_t n) {
+	size_t off = pos & (LOG_RING_BYTES - 1);
+	size_t first = n < LOG_RING_BYTES - off ? n : LOG_RING_BYTES - off;
+	memcpy(dst, q->ring + off, first);
+	memcpy((uint8_t *)dst + first, q->ring, n - first);
+}
+
+// Small id for a category string; the first use registers it
+static uint8_t category_id(const char *category) {
+	int n = __atomic_load_n(&category_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < n; i++)
+		if (categories[i] == category || strcmp(categories[i], category) == 0)
+			return i;
+
+	pthread_mutex_lock(&categories_lock);
+	int i;
+	for (i = 0; i < category_count; i++)
+		if (strcmp(categories[i], category) == 0)
+			break;
+	if (i == category_count && i < LOG_CATEGORY_MAX) {
+		categories[i] = category;
+		__atomic_store_n(&category_count, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&categories_lock);
+	return i < LOG_CATEGORY_MAX ? i : LOG_CATEGORY_MAX - 1;
+}
+
+static const char *category_name(uint8_t id) {
+	return id < __atomic_load_n(&category_count, __ATOMIC_ACQUIRE) ? categories[id] : "[LOG]";
+}
+
+/* Format strings, parsed the same way when packing and when rendering */
+
+typedef struct {
+	const char *body;       // Flags, width and precision, after the '%'
+	size_t body_len;
+	char length[3];         // Length modifier as written
+	char conv;              // Conversion character, 0 if the format ends early
+	int star_width;
+	int star_precision;
+} FmtSpec;
+
+// p points at a '%'; returns the character after the conversion
+static const char *parse_spec(const char *p, FmtSpec *spec) {
+	const char *s = p + 1;
+	size_t l = 0;
+
+	spec->body = s;
+	spec->star_width = spec->star_precision = 0;
+	while (*s && strchr("-+ #0'", *s))
+		s++;
+	if (*s == '*') {
+		spec->star_width = 1;
+		s++;
+	}
+	while (isdigit((unsigned char)*s))
+		s++;
+	if (*s == '.') {
+		s++;
+		if (*s == '*') {
+			spec->star_precision = 1;
+			s++;
+		}
+		while (isdigit((unsigned char)*s))
+			s++;
+	}
+	spec->body_len = s - spec->body;
+	while (*s && strchr("hlLqjzt", *s) && l < 2)
+		spec->length[l++] = *s++;
+	spec->length[l] = '\0';
+	spec->conv = *s;
+	return *s ? s + 1 : s;
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t used;
+	size_t cap;
+} Packer;
+
+static int pack(Packer *pk, const void *src, size_t n) {
+	if (pk->used + n > pk->cap)
+		return 0;
+	memcpy(pk->buf + pk->used, src, n);
+	pk->used += n;
+	return 1;
+}
+
+static int64_t signed_arg(const FmtSpec *spec, va_list *args) {
+	const char *l = spec->length;
+	if (strcmp(l, "hh") == 0)
+		return (signed char)va_arg(*args, int);
+	if (strcmp(l, "h") == 0)
+		return (short)va_arg(*args, int);
+	if (strcmp(l, "l") == 0)
+		return va_arg(*args, long);
+	if (strcmp(l, "ll") == 0 || strcmp(l, "q") == 0)
+		return va_arg(*args, long long);
+	if (strcmp(l, "z") == 0 || strcmp(l, "t") == 0)
+		return va_arg(*args, ssize_t);
+	if (strcmp(l, "j") == 0)
+		return va_arg(*args, intmax_t);
+	return va_arg(*args, int);
+}
+
+static uint64_t unsigned_arg(const FmtSpec *spec, va_list *args) {
+	const char *l = spec->length;
+	if (strcmp(l, "hh") == 0)
+		return (unsigned char)va_arg(*args, unsigned int);
+	if (strcmp(l, "h") == 0)
+		return (unsigned short)va_arg(*args, unsigned int);
+	if (strcmp(l, "l") == 0)
+		return va_arg(*args, unsigned long);
+	if (strcmp(l, "ll") == 0 || strcmp(l, "q") == 0)
+		return va_arg(*args, unsigned long long);
+	if (strcmp(l, "z") == 0 || strcmp(l, "t") == 0)
+		return va_arg(*args, size_t);
+	if (strcmp(l, "j") == 0)
+		return va_arg(*args, uintmax_t);
+	return va_arg(*args, unsigned int);
+}
+
+/*
+ * Copy the arguments fmt calls for into buf: integers and pointers as 8
+ * bytes, floating point as double, strings as a 16-bit length and the
+ * bytes. Stops, leaving the rest unrendered, once buf is full.
+ */
+static size_t pack_args(const char *fmt, va_list args, uint8_t *buf, size_t cap) {
+	Packer pk = { buf, 0, cap };
+	va_list ap;
+	const char *p = fmt;
+
+	va_copy(ap, args);
+	while ((p = strchr(p, '%'))) {
+		FmtSpec spec;
+		p = parse_spec(p, &spec);
+		if (spec.conv == '%')
+			continue;
+		if (spec.conv == '\0')
+			break;
+
+		int32_t star;
+		if (spec.star_width) {
+			star = va_arg(ap, int);
+			if (!pack(&pk, &star, sizeof(star)))
+				break;
+		}
+		if (spec.star_precision) {
+			star = va_arg(ap, int);
+			if (!pack(&pk, &star, sizeof(star)))
+				break;
+		}
+
+		int ok = 1;
+		switch (spec.conv) {
+		case 'd': case 'i': case 'c': {
+			int64_t v = spec.conv == 'c' ? va_arg(ap, int) : signed_arg(&spec, &ap);
+			ok = pack(&pk, &v, sizeof(v));
+			break;
+		}
+		case 'u': case 'o': case 'x': case 'X': {
+			uint64_t v = unsigned_arg(&spec, &ap);
+			ok = pack(&pk, &v, sizeof(v));
+			break;
+		}
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+			double v = strcmp(spec.length, "L") == 0 ? (double)va_arg(ap, long double)
+								  : va_arg(ap, double);
+			ok = pack(&pk, &v, sizeof(v));
+			break;
+		}
+		case 's': {
+			const char *s = va_arg(ap, const char *);
+			if (!s)
+				s = "(null)";
+			size_t room = pk.cap - pk.used;
+			uint16_t len = strnlen(s, LOG_ENTRY_MAX);
+			if (room < sizeof(len)) {
+				ok = 0;
+				break;
+			}
+			if (len > room - sizeof(len))
+				len = room - sizeof(len);
+			ok = pack(&pk, &len, sizeof(len)) && pack(&pk, s, len);
+			break;
+		}
+		case 'p': {
+			uint64_t v = (uintptr_t)va_arg(ap, void *);
+			ok = pack(&pk, &v, sizeof(v));
+			break;
+		}
+		case 'n':
+			(void)va_arg(ap, void *);
+			break;
+		default:
+			ok = 0;     // Unknown conversion; can't know what to pull
+		}
+		if (!ok)
+			break;
+	}
+	va_end(ap);
+	return pk.used;
+}
+
+typedef struct {
+	const uint8_t *buf;
+	size_t used;
+	size_t len;
+} Unpacker;
+
+static int unpack(Unpacker *u, void *dst, size_t n) {
+	if (u->used + n > u->len)
+		return 0;
+	memcpy(dst, u->buf + u->used, n);
+	u->used += n;
+	return 1;
+}
+
+// One conversion, with its length modifier replaced by what was packed
+#define RENDER(spec, f, out, room, w, pr, v) \
+	((spec).star_width && (spec).star_precision ? snprintf(out, room, f, w, pr, v) : \
+	 (spec).star_width ? snprintf(out, room, f, w, v) : \
+	 (spec).star_precision ? snprintf(out, room, f, pr, v) : snprintf(out, room, f, v))
+
+// The reading half of pack_args: fmt with the packed values filled in
+static void render_args(const char *fmt, const uint8_t *args, size_t args_len,
+			char *out, size_t room) {
+	Unpacker u = { args, 0, args_len };
+	const char *p = fmt;
+	size_t o = 0;
+
+	while (*p && o + 1 < room) {
+		if (*p != '%') {
+			out[o++] = *p++;
+			continue;
+		}
+
+		FmtSpec spec;
+		const char *next = parse_spec(p, &spec);
+		if (spec.conv == '%') {
+			out[o++] = '%';
+			p = next;
+			continue;
+		}
+		if (spec.conv == '\0' || spec.body_len + 4 > LOG_SPEC_MAX)
+			break;
+
+		int32_t w = 0, pr = 0;
+		if ((spec.star_width && !unpack(&u, &w, sizeof(w))) ||
+		    (spec.star_precision && !unpack(&u, &pr, sizeof(pr))))
+			break;
+
+		char f[LOG_SPEC_MAX];
+		const char *mod = strchr("diouxX", spec.conv) ? "ll" : "";
+		snprintf(f, sizeof(f), "%%%.*s%s%c", (int)spec.body_len, spec.body, mod, spec.conv);
+
+		int n = 0, ok = 1;
+		switch (spec.conv) {
+		case 'd': case 'i': case 'c': {
+			int64_t v;
+			if ((ok = unpack(&u, &v, sizeof(v))))
+				n = spec.conv == 'c' ? RENDER(spec, f, out + o, room - o, w, pr, (int)v)
+						     : RENDER(spec, f, out + o, room - o, w, pr, (long long)v);
+			break;
+		}
+		case 'u': case 'o': case 'x': case 'X': {
+			uint64_t v;
+			if ((ok = unpack(&u, &v, sizeof(v))))
+				n = RENDER(spec, f, out + o, room - o, w, pr, (unsigned long long)v);
+			break;
+		}
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+			double v;
+			if ((ok = unpack(&u, &v, sizeof(v))))
+				n = RENDER(spec, f, out + o, room - o, w, pr, v);
+			break;
+		}
+		case 's': {
+			uint16_t len;
+			char s[LOG_ENTRY_MAX + 1];
+			if ((ok = unpack(&u, &len, sizeof(len)) && len <= LOG_ENTRY_MAX &&
+				  unpack(&u, s, len))) {
+				s[len] = '\0';
+				n = RENDER(spec, f, out + o, room - o, w, pr, s);
+			}
+			break;
+		}
+		case 'p': {
+			uint64_t v;
+			if ((ok = unpack(&u, &v, sizeof(v))))
+				n = RENDER(spec, f, out + o, room - o, w, pr, (void *)(uintptr_t)v);
+			break;
+		}
+		case 'n':
+			break;
+		default:
+			ok = 0;
+		}
+		if (!ok)
+			break;
+		if (n > 0)
+			o += (size_t)n < room - o ? (size_t)n : room - o - 1;
+		p = next;
+	}
+	out[o < room ? o : room - 1] = '\0';
+}
+
+// "[CATEGORY] [TIME] ", the prefix every rendered line starts with
+static int render_prefix(const char *category, time_t secs, char *out, size_t len) {
+	struct tm tm_then;
+	char time_str[32];
+
+	localtime_r(&secs, &tm_then);
+	strftime(time_str, sizeof(time_str), "[%Y-%m-%d %H:%M:%S]", &tm_then);
+	return snprintf(out, len, "%s %s ", category, time_str);
+}
+
+// FNV-1a over the record after its stamp, with check itself taken as 0
+static uint32_t record_check(const uint8_t *rec, size_t size) {
+	const size_t check_at = offsetof(LogRecordHeader, check);
+	uint32_t sum = 2166136261u;
+
+	for (size_t i = sizeof(uint64_t); i < size; i++) {
+		uint8_t b = i - check_at < sizeof(uint32_t) ? 0 : rec[i];
+		sum = (sum ^ b) * 16777619u;
+	}
+	return sum;
+}
+
+// Whether a header describes a record that was really pushed: argument
+// bytes can look like a stamp, and a writer lapped while it was still
+// copying can scribble over a newer record
+static int header_plausible(const LogRecordHeader *h) {
+	return h->size >= sizeof(*h) && h->size <= LOG_RECORD_MAX &&
+	       h->category < LOG_CATEGORY_MAX && format_known(h->fmt);
+}
+
+static int record_intact(const uint8_t *rec) {
+	const LogRecordHeader *h = (const LogRecordHeader *)rec;
+	return record_check(rec, h->size) == h->check;
+}
+
+static void render_record(const uint8_t *rec, char *out, size_t len) {
+	const LogRecordHeader *h = (const LogRecordHeader *)rec;
+
+	int n = render_prefix(category_name(h->category), h->time_usec / 1000000, out, len);
+	if (n < 0 || (size_t)n >= len)
+		return;
+	if (!format_known(h->fmt)) {
+		snprintf(out + n, len - n, "unreadable record");
+		return;
+	}
+	render_args((const char *)(uintptr_t)h->fmt, rec + sizeof(*h), h->size - sizeof(*h),
+		    out + n, len - n);
+}
+
+static void push_record(LogQueue *q, const char *category, const char *fmt, va_list args) {
+	uint64_t rec[LOG_RECORD_MAX / 8];
+	LogRecordHeader *h = (LogRecordHeader *)rec;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	h->time_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	h->fmt = (uintptr_t)fmt;
+	h->category = category_id(category);
+	h->size = sizeof(*h) + pack_args(fmt, args, (uint8_t *)rec + sizeof(*h),
+					 LOG_RECORD_MAX - sizeof(*h));
+	h->pad = 0;
+	h->check = record_check((uint8_t *)rec, h->size);
+
+	uint64_t padded = (h->size + 7) & ~7ULL;
+	uint64_t word = __atomic_fetch_add(&q->tail, padded / 8 + LOG_COUNT_ONE, __ATOMIC_ACQ_REL);
+	uint64_t pos = word_pos(word);
+
+	// A writer stalled since its reservation may have been lapped; its
+	// bytes would land in newer records, so it drops this one instead
+	if (word_pos(__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) - pos > LOG_RING_BYTES)
+		return;
+
+	// Everything but the stamp, which then publishes it
+	ring_write(q, pos + sizeof(h->stamp), (uint8_t *)rec + sizeof(h->stamp),
+		   h->size - sizeof(h->stamp));
+	__atomic_store_n(stamp_at(q, pos), word + 1, __ATOMIC_RELEASE);
+
+	// Pairs with the fence in log_queue_read_timed: either a reader sees
+	// this record before sleeping, or we see it asleep and wake it
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&q->mutex);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->mutex);
+	}
+}
+
+static void push_text(LogQueue *q, const char *category, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	push_record(q, category, fmt, args);
+	va_end(args);
+}
+
+// Append a record; lock-free, any thread. fmt must outlive the record.
+void log_queue_push(LogQueue *q, const char *category, const char *fmt, va_list args) {
+	if (!format_register(fmt)) {
+		// No room to remember fmt: store the line already rendered
+		char text[LOG_ENTRY_MAX];
+		va_list ap;
+
+		va_copy(ap, args);
+		vsnprintf(text, sizeof(text), fmt, ap);
+		va_end(ap);
+		push_text(q, category, text_fmt, text);
+		return;
+	}
+	push_record(q, category, fmt, args);
 }
 
-// Pop a log entry, blocking until available or timeout
+/*
+ * Find the oldest intact record at or after from: the reader fell a full
+ * ring behind, or the record at its cursor is damaged. Records start on
+ * 8-byte boundaries with a stamp naming their own position, so scanning for
+ * one whose header checks out is enough. Never start less than an eighth of
+ * the ring in, so the record isn't overwritten again before it can be read.
+ */
+static void resync(LogQueue *q, LogCursor *c, uint64_t tail, uint64_t from) {
+	uint64_t rec[LOG_RECORD_MAX / 8];
+	LogRecordHeader *h = (LogRecordHeader *)rec;
+	uint64_t tail_pos = word_pos(tail);
+	uint64_t x = tail_pos > LOG_RING_BYTES - LOG_RING_BYTES / 8 ?
+		     tail_pos - LOG_RING_BYTES + LOG_RING_BYTES / 8 : 0;
+
+	if (x < from)
+		x = from;
+	for (; x < tail_pos; x += 8) {
+		uint64_t stamp = __atomic_load_n(stamp_at(q, x), __ATOMIC_ACQUIRE);
+
+		if (stamp == 0 || word_pos(stamp - 1) != x)
+			continue;
+		ring_read(q, x, rec, sizeof(*h));
+		if (!header_plausible(h))
+			continue;
+		ring_read(q, x, rec, h->size);
+		if (record_intact((uint8_t *)rec)) {
+			uint64_t count = word_count(stamp - 1);
+			c->skipped += (count - c->count) & (LOG_COUNT_MOD - 1);
+			c->pos = x;
+			c->count = count;
+			return;
+		}
+	}
+	c->skipped += (word_count(tail) - c->count) & (LOG_COUNT_MOD - 1);
+	c->pos = tail_pos;
+	c->count = word_count(tail);
+}
+
+/*
+ * Copy out the record at the cursor and step past it. Returns 1 for a
+ * record, 0 if none is ready, and 2 when the cursor just had to skip
+ * records, so the caller can say so before carrying on.
+ */
+static int read_record(LogQueue *q, LogCursor *c, uint8_t *rec) {
+	LogRecordHeader *h = (LogRecordHeader *)rec;
+
+	while (1) {
+		uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (word_pos(tail) == c->pos)
+			return 0;
+		if (word_pos(tail) - c->pos > LOG_RING_BYTES) {
+			resync(q, c, tail, c->pos);
+			if (c->skipped)
+				return 2;
+			continue;
+		}
+
+		uint64_t stamp = __atomic_load_n(stamp_at(q, c->pos), __ATOMIC_ACQUIRE);
+		if (stamp != make_word(c->pos, c->count) + 1) {
+			// Not published yet, unless it was overwritten since we looked
+			tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+			if (word_pos(tail) - c->pos > LOG_RING_BYTES) {
+				resync(q, c, tail, c->pos);
+				if (c->skipped)
+					return 2;
+				continue;
+			}
+			return 0;
+		}
+
+		ring_read(q, c->pos, h, sizeof(*h));
+		int plausible = header_plausible(h);
+		size_t size = h->size;
+		if (plausible) {
+			ring_read(q, c->pos, rec, size);
+			plausible = record_intact(rec);
+		}
+
+		// Anything reserved past pos + LOG_RING_BYTES may have overwritten
+		// what we just copied. A damaged record can't be stepped over, as
+		// its size is suspect too; look for the next good one.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		if (word_pos(tail) - c->pos > LOG_RING_BYTES || !plausible) {
+			resync(q, c, tail, c->pos + 8);
+			if (c->skipped)
+				return 2;
+			continue;
+		}
+
+		c->pos += (size + 7) & ~7ULL;
+		c->count = (c->count + 1) & (LOG_COUNT_MOD - 1);
+		return 1;
+	}
+}
+
+// Start a subscriber at the oldest record still in the ring
+void log_cursor_init(LogQueue *q, LogCursor *c) {
+	uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	memset(c, 0, sizeof(*c));
+	if (word_pos(tail) > LOG_RING_BYTES) {
+		resync(q, c, tail, 0);
+		c->skipped = 0;         // Not this subscriber's loss
+	}
+}
+
+// Render what read_record returned: the record, or a note of the gap
+static void render_read(int got, const uint8_t *rec, LogCursor *c, char *out, size_t len) {
+	if (got == 2) {
+		int n = render_prefix("[LOG]", time(NULL), out, len);
+		if (n >= 0 && (size_t)n < len)
+			snprintf(out + n, len - n, "skipped %llu entries",
+				 (unsigned long long)c->skipped);
+		c->skipped = 0;
+	} else {
+		c->time_usec = ((const LogRecordHeader *)rec)->time_usec;
+		render_record(rec, out, len);
+	}
+}
+
+// Read the next entry at c, blocking until available or timeout, and render it
 // timeout_ms: -1 = wait forever, else timeout in milliseconds
 // returns 1 if got entry, 0 if timeout, -1 on error
-int log_queue_pop_timed(LogQueue *q, char *buffer, int timeout_ms) {
+int log_queue_read_timed(LogQueue *q, LogCursor *c, char *buffer, size_t len, int timeout_ms) {
+	uint64_t rec[LOG_RECORD_MAX / 8];
 	struct timespec ts;
-	int ret = 0;
+	int got, ret = 0;
+
+	if ((got = read_record(q, c, (uint8_t *)rec))) {
+		render_read(got, (uint8_t *)rec, c, buffer, len);
+		return 1;
+	}
+	if (timeout_ms == 0)
+		return 0;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
 
 	pthread_mutex_lock(&q->mutex);
-	while (q->count == 0) {
-		if (timeout_ms < 0) {
+	__atomic_add_fetch(&q->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!(got = read_record(q, c, (uint8_t *)rec))) {
+		if (timeout_ms < 0)
 			ret = pthread_cond_wait(&q->cond, &q->mutex);
-		} else {
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_sec += timeout_ms / 1000;
-			ts.tv_nsec += (timeout_ms % 1000) * 1000000;
-			if (ts.tv_nsec >= 1000000000) {
-				ts.tv_sec++;
-				ts.tv_nsec -= 1000000000;
-			}
+		else
 			ret = pthread_cond_timedwait(&q->cond, &q->mutex, &ts);
-			if (ret == ETIMEDOUT) {
-				pthread_mutex_unlock(&q->mutex);
-				return 0; // timeout
-			}
-		}
-		if (ret != 0) {
-			pthread_mutex_unlock(&q->mutex);
-			return -1; // error
-		}
+		if (ret != 0)
+			break;
 	}
-	strncpy(buffer, q->entries[q->head], LOG_ENTRY_MAX);
-	q->head = (q->head + 1) % LOG_QUEUE_SIZE;
-	q->count--;
+	__atomic_sub_fetch(&q->sleeping, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&q->mutex);
-	return 1;
+
+	if (got) {
+		render_read(got, (uint8_t *)rec, c, buffer, len);
+		return 1;
+	}
+	return ret == ETIMEDOUT ? 0 : -1;
 }
@@ -1,21 +1,62 @@
 #ifndef LOG_QUEUE
 #define LOG_QUEUE
 #include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#define LOG_QUEUE_SIZE 100
-#define LOG_ENTRY_MAX 512
+#define LOG_RING_BYTES   (4 * 1024 * 1024)   // Power of two
+#define LOG_RECORD_MAX   1024                // Largest record, header included
+#define LOG_ENTRY_MAX    512                 // Longest rendered line
+#define LOG_CATEGORY_MAX 32
+#define LOG_FORMATS_MAX  4096                // Distinct format strings; power of two
 
+/*
+ * A log record as it sits in the ring: no text, just what is needed to
+ * render it later. fmt is the address of the caller's format literal and
+ * doubles as the format id, registered at push time so readers can tell a
+ * real one; the packed arguments follow the header.
+ */
 typedef struct {
-	char entries[LOG_QUEUE_SIZE][LOG_ENTRY_MAX];
-	int head; // next read index
-	int tail; // next write index
-	int count;
+	uint64_t stamp;         // Reservation word + 1, stored last to publish
+	uint64_t time_usec;
+	uint64_t fmt;
+	uint16_t size;          // Header plus arguments, before padding
+	uint8_t category;
+	uint8_t pad;
+	uint32_t check;         // Of everything after the stamp, this field as 0
+} LogRecordHeader;
+
+// Where one subscriber is in the stream; each reader owns its own
+typedef struct {
+	uint64_t pos;           // Byte position of the next record
+	uint64_t count;         // Its record number (mod 2^20)
+	uint64_t skipped;       // Overwritten before we got to them, not yet reported
+	uint64_t time_usec;     // When the last record read was logged
+} LogCursor;
+
+/*
+ * Variable-size records in a byte ring. A writer reserves its bytes with a
+ * single fetch_add on tail, which packs the byte position with a running
+ * record count, fills them in and publishes by storing the stamp. Writers
+ * never wait for readers: old records are simply overwritten, and a reader
+ * checks tail after copying a record to know whether it was clobbered
+ * meanwhile. Reading doesn't consume anything, so any number of
+ * subscribers can follow the stream, each with its own LogCursor.
+ * Readers sleep on the condvar only after counting themselves in
+ * `sleeping`, and writers only signal when it is nonzero.
+ */
+typedef struct {
+	uint8_t ring[LOG_RING_BYTES] __attribute__((aligned(8)));
+	uint64_t tail;
+	int sleeping;
 
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 } LogQueue;
 
 void log_queue_init(LogQueue *q);
-void log_queue_push(LogQueue *q, const char *entry);
-int log_queue_pop_timed(LogQueue *q, char *buffer, int timeout_ms);
+void log_queue_push(LogQueue *q, const char *category, const char *fmt, va_list args);
+void log_cursor_init(LogQueue *q, LogCursor *c);
+int log_queue_read_timed(LogQueue *q, LogCursor *c, char *buffer, size_t len, int timeout_ms);
 #endif
@@ -0,0 +1,410 @@
+#include "log_sink.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_QUERY_CHUNK (64 * 1024)
+
+/*
+ * Persistent copy of the log stream. A writer thread follows the ring with
+ * its own cursor, gathers rendered lines into a large buffer and appends it
+ * to the current segment with one write(). Segments rotate by size and the
+ * oldest are deleted. Next to each <id>.log sits <id>.idx, its sparse time
+ * index, appended only after the data it points into so a query never
+ * follows an entry past what is on disk.
+ */
+typedef struct {
+	uint32_t id;
+	uint64_t start_usec;    // Newest line before this segment, from its first index entry
+} LogSegment;
+
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogSegment segments[LOG_SEGMENTS_KEEP];
+static int segment_count;
+static char sink_dir[256];
+static uint64_t segment_cap;    // 0: sink is off
+
+/* Owned by the writer thread */
+static LogQueue *sink_queue;
+static LogCursor cursor;
+static uint32_t next_id;
+static int seg_fd = -1;
+static int idx_fd = -1;
+static uint64_t seg_size;       // Bytes of the current segment on disk
+static char *buffer;
+static size_t used;
+static LogIndexEntry pending[LOG_SINK_BUFFER / LOG_INDEX_STRIDE + 2];
+static int pending_count;
+static uint64_t next_index;     // Offset at which the next index entry is due
+static uint64_t newest_usec;
+
+static void segment_path(uint32_t id, const char *ext, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%08u.%s", sink_dir, id, ext);
+}
+
+static void remove_segment(uint32_t id)
+{
+	char path[512];
+
+	segment_path(id, "log", path, sizeof(path));
+	unlink(path);
+	segment_path(id, "idx", path, sizeof(path));
+	unlink(path);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int open_segment(void)
+{
+	char path[512];
+	uint32_t id = next_id++;
+
+	segment_path(id, "log", path, sizeof(path));
+	seg_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	segment_path(id, "idx", path, sizeof(path));
+	idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (seg_fd < 0 || idx_fd < 0) {
+		LOG_ERRNO("Failed to open log segment");
+		if (seg_fd >= 0)
+			close(seg_fd);
+		if (idx_fd >= 0)
+			close(idx_fd);
+		seg_fd = idx_fd = -1;
+		return -1;
+	}
+	seg_size = 0;
+	next_index = 0;
+
+	pthread_mutex_lock(&sink_lock);
+	if (segment_count == LOG_SEGMENTS_KEEP) {
+		remove_segment(segments[0].id);
+		memmove(&segments[0], &segments[1], (segment_count - 1) * sizeof(segments[0]));
+		segment_count--;
+	}
+	segments[segment_count].id = id;
+	segments[segment_count].start_usec = newest_usec;
+	segment_count++;
+	pthread_mutex_unlock(&sink_lock);
+	return 0;
+}
+
+static void close_segment(void)
+{
+	close(seg_fd);
+	close(idx_fd);
+	seg_fd = idx_fd = -1;
+}
+
+static void flush_buffer(void)
+{
+	if (used == 0)
+		return;
+	if (write_all(seg_fd, buffer, used) != 0 ||
+	    write_all(idx_fd, pending, pending_count * sizeof(pending[0])) != 0)
+		LOG_ERRNO("Failed to write log segment");
+	seg_size += used;
+	used = 0;
+	pending_count = 0;
+}
+
+static void append_line(const char *line, size_t len, uint64_t time_usec)
+{
+	if (seg_fd >= 0 && seg_size + used + len > segment_cap) {
+		flush_buffer();
+		close_segment();
+	}
+	if (seg_fd < 0 && open_segment() != 0)
+		return;     // Dropped; the next line tries again
+	if (used + len > LOG_SINK_BUFFER)
+		flush_buffer();
+
+	uint64_t offset = seg_size + used;
+	if (offset >= next_index) {
+		pending[pending_count].time_usec = newest_usec;
+		pending[pending_count].offset = offset;
+		pending_count++;
+		next_index = offset + LOG_INDEX_STRIDE;
+	}
+	memcpy(buffer + used, line, len);
+	used += len;
+	if (time_usec > newest_usec)
+		newest_usec = time_usec;
+}
+
+static void *log_sink_thread(void *arg)
+{
+	char line[LOG_ENTRY_MAX + 1];
+	struct timespec last_flush, now;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &last_flush);
+	while (1) {
+		int got = log_queue_read_timed(sink_queue, &cursor, line, LOG_ENTRY_MAX,
+					       LOG_SINK_FLUSH_MS);
+		if (got == 1) {
+			size_t len = strlen(line);
+			line[len++] = '\n';
+			append_line(line, len, cursor.time_usec);
+		}
+
+		// Write when the stream goes quiet, or at least every LOG_SINK_FLUSH_MS
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed_ms = (now.tv_sec - last_flush.tv_sec) * 1000 +
+				  (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+		if (got != 1 || elapsed_ms >= LOG_SINK_FLUSH_MS) {
+			flush_buffer();
+			last_flush = now;
+		}
+	}
+	return NULL;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Pick up segments left by earlier runs so queries still reach them
+static int load_segments(void)
+{
+	DIR *d = opendir(sink_dir);
+	if (!d) {
+		LOG_ERRNO("Failed to open log directory");
+		return -1;
+	}
+
+	uint32_t *ids = NULL;
+	size_t count = 0, cap = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d))) {
+		unsigned int id;
+		int end = 0;
+		if (sscanf(ent->d_name, "%8u.log%n", &id, &end) != 1 || ent->d_name[end] != '\0')
+			continue;
+		if (count == cap) {
+			cap = cap ? cap * 2 : 16;
+			uint32_t *grown = realloc(ids, cap * sizeof(*ids));
+			if (!grown)
+				break;
+			ids = grown;
+		}
+		ids[count++] = id;
+	}
+	closedir(d);
+	qsort(ids, count, sizeof(*ids), compare_ids);
+
+	// Room for the segment this run is about to open
+	size_t keep = count < LOG_SEGMENTS_KEEP - 1 ? count : LOG_SEGMENTS_KEEP - 1;
+	for (size_t i = 0; i < count - keep; i++)
+		remove_segment(ids[i]);
+	for (size_t i = count - keep; i < count; i++) {
+		char path[512];
+		LogIndexEntry first = { 0, 0 };
+		segment_path(ids[i], "idx", path, sizeof(path));
+		int fd = open(path, O_RDONLY);
+		if (fd >= 0) {
+			if (pread(fd, &first, sizeof(first), 0) != sizeof(first))
+				first.time_usec = 0;
+			close(fd);
+		}
+		segments[segment_count].id = ids[i];
+		segments[segment_count].start_usec = first.time_usec;
+		segment_count++;
+	}
+	next_id = count ? ids[count - 1] + 1 : 0;
+	free(ids);
+	return 0;
+}
+
+int log_sink_init(LogQueue *q, const char *dir, uint64_t segment_bytes)
+{
+	struct timespec now;
+	pthread_t tid;
+
+	snprintf(sink_dir, sizeof(sink_dir), "%s", dir);
+	if (segment_bytes == 0)
+		return 0;
+
+	if (mkdir(sink_dir, 0777) != 0 && errno != EEXIST) {
+		LOG_ERRNO("Failed to create log directory");
+		return -1;
+	}
+	if (load_segments() != 0)
+		return -1;
+
+	buffer = malloc(LOG_SINK_BUFFER);
+	if (!buffer) {
+		LOG_ERRNO("Failed to allocate log sink buffer");
+		return -1;
+	}
+	// Everything already on disk is older than this
+	clock_gettime(CLOCK_REALTIME, &now);
+	newest_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	sink_queue = q;
+	log_cursor_init(q, &cursor);
+	segment_cap = segment_bytes;
+
+	if (pthread_create(&tid, NULL, log_sink_thread, NULL) != 0) {
+		LOG_ERRNO("Failed to start log sink");
+		segment_cap = 0;
+		return -1;
+	}
+	pthread_detach(tid);
+
+	LOG_INFO("Log sink at %s: %d segments on disk, rotating at %lu bytes",
+	       sink_dir, segment_count, segment_bytes);
+	return 0;
+}
+
+// Second a rendered "[CATEGORY] [YYYY-mm-dd HH:MM:SS] ..." line was logged, -1 if none
+static time_t line_time(const char *line)
+{
+	const char *p = strstr(line, "] [");
+	struct tm tm_line;
+
+	memset(&tm_line, 0, sizeof(tm_line));
+	if (!p || !strptime(p + 3, "%Y-%m-%d %H:%M:%S]", &tm_line))
+		return -1;
+	tm_line.tm_isdst = -1;
+	return mktime(&tm_line);
+}
+
+// Where in segment id lines from `from` on can start, by its index
+static uint64_t index_lookup(uint32_t id, uint64_t from_usec)
+{
+	char path[512];
+	struct stat st;
+	uint64_t offset = 0;
+
+	segment_path(id, "idx", path, sizeof(path));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(LogIndexEntry)) {
+		size_t count = st.st_size / sizeof(LogIndexEntry);
+		LogIndexEntry *index = malloc(count * sizeof(*index));
+		if (index && pread(fd, index, count * sizeof(*index), 0) ==
+			     (ssize_t)(count * sizeof(*index))) {
+			// Last entry with nothing before it at or after from
+			size_t lo = 0, hi = count;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (index[mid].time_usec < from_usec)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo > 0)
+				offset = index[lo - 1].offset;
+		}
+		free(index);
+	}
+	close(fd);
+	return offset;
+}
+
+/*
+ * Hand fn the lines of segment id logged within [from, to]. Returns 1 once
+ * past the range or when fn asks to stop, so later segments are skipped.
+ */
+static int query_segment(uint32_t id, time_t from, time_t to, LogLineFn fn, void *ctx,
+			 long *matched)
+{
+	char path[512];
+	segment_path(id, "log", path, sizeof(path));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;   // Rotated away meanwhile
+
+	char *chunk = malloc(2 * LOG_QUERY_CHUNK);
+	uint64_t offset = index_lookup(id, (uint64_t)from * 1000000);
+	size_t have = 0;
+	int done = 0, in_range = 0;
+	ssize_t n;
+
+	while (chunk && !done && (n = pread(fd, chunk + have, LOG_QUERY_CHUNK, offset)) > 0) {
+		offset += n;
+		have += n;
+
+		char *line = chunk, *end;
+		while (!done && (end = memchr(line, '\n', chunk + have - line))) {
+			*end = '\0';
+			time_t t = line_time(line);
+			if (t > to + 1) {
+				done = 1;   // Lines are close enough to time order
+			} else {
+				// Lines without a timestamp continue the one before
+				if (t >= 0)
+					in_range = t >= from && t <= to;
+				if (in_range) {
+					(*matched)++;
+					if (fn(line, end - line, ctx) != 0)
+						done = 1;
+				}
+			}
+			line = end + 1;
+		}
+		have = chunk + have - line;
+		memmove(chunk, line, have);
+		if (have >= LOG_QUERY_CHUNK)
+			have = 0;   // No newline in a whole chunk; not one of ours
+	}
+	free(chunk);
+	close(fd);
+	return done;
+}
+
+// Pass fn every logged line from second `from` to `to`, inclusive; -1 if the sink is off
+long log_sink_query(time_t from, time_t to, LogLineFn fn, void *ctx)
+{
+	LogSegment segs[LOG_SEGMENTS_KEEP];
+	int count;
+	long matched = 0;
+
+	pthread_mutex_lock(&sink_lock);
+	if (segment_cap == 0) {
+		pthread_mutex_unlock(&sink_lock);
+		return -1;
+	}
+	count = segment_count;
+	memcpy(segs, segments, count * sizeof(segs[0]));
+	pthread_mutex_unlock(&sink_lock);
+
+	uint64_t from_usec = (uint64_t)from * 1000000;
+	uint64_t to_usec = (uint64_t)(to + 2) * 1000000;
+	for (int i = 0; i < count; i++) {
+		// Everything in segment i is no newer than where i + 1 starts
+		if (i + 1 < count && segs[i + 1].start_usec < from_usec)
+			continue;
+		if (segs[i].start_usec > to_usec)
+			break;
+		if (query_segment(segs[i].id, from, to, fn, ctx, &matched))
+			break;
+	}
+	return matched;
+}
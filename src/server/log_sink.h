@@ -0,0 +1,32 @@
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include "log_queue.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_SINK_DIR      "logs"
+#define LOG_SEGMENT_MB    64                // Segments rotate at this size
+#define LOG_SEGMENTS_KEEP 16                // Older segments are deleted
+#define LOG_SINK_BUFFER   (256 * 1024)      // Bytes gathered per write()
+#define LOG_SINK_FLUSH_MS 1000              // Longest a line waits in the buffer
+#define LOG_INDEX_STRIDE  (64 * 1024)       // Segment bytes per index entry
+
+/*
+ * One entry of a segment's sparse index (<segment>.idx). Every line before
+ * offset is no newer than time_usec, so a query for lines from T on can
+ * start reading at the last entry older than T.
+ */
+typedef struct {
+	uint64_t time_usec;
+	uint64_t offset;
+} LogIndexEntry;
+
+// Called for each line of a range query, without its newline; nonzero stops
+typedef int (*LogLineFn)(const char *line, size_t len, void *ctx);
+
+int log_sink_init(LogQueue *q, const char *dir, uint64_t segment_bytes);
+long log_sink_query(time_t from, time_t to, LogLineFn fn, void *ctx);
+
+#endif // LOG_SINK_H
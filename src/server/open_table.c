@@ -0,0 +1,185 @@
+#include "open_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OPEN_TABLE_INITIAL_CAPACITY 16
+
+enum {
+	SLOT_EMPTY = 0,
+	SLOT_USED,
+	SLOT_DELETED
+};
+
+// Fold the key eight bytes at a time, then finish with the murmur3 mixer
+static size_t key_hash(const uint8_t *key, size_t len)
+{
+	uint64_t h = len;
+
+	for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+		uint64_t word = 0;
+		memcpy(&word, key + i, len - i < sizeof(word) ? len - i : sizeof(word));
+		h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+static uint8_t *slot_at(OpenTable *t, size_t i)
+{
+	return t->slots + i * t->entry_size;
+}
+
+static int alloc_slots(OpenTable *t, size_t capacity)
+{
+	t->slots = malloc(capacity * t->entry_size);
+	t->state = calloc(capacity, 1);
+	if (!t->slots || !t->state) {
+		free(t->slots);
+		free(t->state);
+		return -1;
+	}
+	t->capacity = capacity;
+	t->count = 0;
+	t->deleted = 0;
+	return 0;
+}
+
+int open_table_init(OpenTable *t, size_t key_size, size_t entry_size)
+{
+	t->key_size = key_size;
+	t->entry_size = entry_size;
+	return alloc_slots(t, OPEN_TABLE_INITIAL_CAPACITY);
+}
+
+void open_table_free(OpenTable *t)
+{
+	free(t->slots);
+	free(t->state);
+	t->slots = NULL;
+	t->state = NULL;
+	t->capacity = t->count = t->deleted = 0;
+}
+
+// Slot holding key, or -1
+static long find_slot(OpenTable *t, const void *key)
+{
+	size_t mask = t->capacity - 1;
+	size_t i = key_hash(key, t->key_size) & mask;
+
+	while (t->state[i] != SLOT_EMPTY) {
+		if (t->state[i] == SLOT_USED && memcmp(slot_at(t, i), key, t->key_size) == 0)
+			return (long)i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+// Rebuild into a fresh array, which also drops every tombstone
+static int rehash(OpenTable *t, size_t capacity)
+{
+	OpenTable old = *t;
+
+	if (alloc_slots(t, capacity) != 0) {
+		*t = old;
+		return -1;
+	}
+
+	size_t mask = capacity - 1;
+	for (size_t j = 0; j < old.capacity; j++) {
+		if (old.state[j] != SLOT_USED)
+			continue;
+		size_t i = key_hash(slot_at(&old, j), t->key_size) & mask;
+		while (t->state[i] != SLOT_EMPTY)
+			i = (i + 1) & mask;
+		memcpy(slot_at(t, i), slot_at(&old, j), t->entry_size);
+		t->state[i] = SLOT_USED;
+		t->count++;
+	}
+
+	free(old.slots);
+	free(old.state);
+	return 0;
+}
+
+void *open_table_find(OpenTable *t, const void *key)
+{
+	long i = find_slot(t, key);
+	return i >= 0 ? slot_at(t, i) : NULL;
+}
+
+/*
+ * The entry for key, adding one if it is missing. A new entry has its key
+ * filled in and the rest left for the caller; *created tells which case it
+ * was. NULL if the table could not grow. The pointer is valid until the
+ * next insert.
+ */
+void *open_table_insert(OpenTable *t, const void *key, int *created)
+{
+	long existing = find_slot(t, key);
+	if (existing >= 0) {
+		*created = 0;
+		return slot_at(t, existing);
+	}
+
+	// Keep the load (tombstones included) under 3/4; double once live
+	// entries pass half, otherwise just sweep the tombstones out
+	if ((t->count + t->deleted + 1) * 4 > t->capacity * 3) {
+		size_t capacity = t->capacity;
+		if ((t->count + 1) * 2 > capacity)
+			capacity *= 2;
+		if (rehash(t, capacity) != 0)
+			return NULL;
+	}
+
+	size_t mask = t->capacity - 1;
+	size_t i = key_hash(key, t->key_size) & mask;
+	while (t->state[i] == SLOT_USED)
+		i = (i + 1) & mask;
+
+	if (t->state[i] == SLOT_DELETED)
+		t->deleted--;
+	memcpy(slot_at(t, i), key, t->key_size);
+	t->state[i] = SLOT_USED;
+	t->count++;
+	*created = 1;
+	return slot_at(t, i);
+}
+
+// Drop the entry for key, copying it to out first if given. 1 if it was there.
+int open_table_remove(OpenTable *t, const void *key, void *out)
+{
+	long i = find_slot(t, key);
+	if (i < 0)
+		return 0;
+
+	if (out)
+		memcpy(out, slot_at(t, i), t->entry_size);
+	t->state[i] = SLOT_DELETED;
+	t->count--;
+	t->deleted++;
+	return 1;
+}
+
+/*
+ * Iterate with a cursor starting at 0:
+ *
+ *   size_t cursor = 0;
+ *   while ((e = open_table_next(t, &cursor)))
+ *
+ * Removing the entry just returned is allowed.
+ */
+void *open_table_next(OpenTable *t, size_t *cursor)
+{
+	while (*cursor < t->capacity) {
+		size_t i = (*cursor)++;
+		if (t->state[i] == SLOT_USED)
+			return slot_at(t, i);
+	}
+	return NULL;
+}
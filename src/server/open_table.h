@@ -0,0 +1,31 @@
+#ifndef OPEN_TABLE_H
+#define OPEN_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Open-addressing (linear probing) hash table of fixed-size entries whose
+ * first key_size bytes are the key. Removal leaves a tombstone, so entries
+ * only move when an insert grows the table; an iteration cursor stays valid
+ * across lookups, updates and removals. Not thread-safe: the owner holds
+ * its own lock. ClientTable, TokenTable and the job index are built on it.
+ */
+typedef struct {
+	uint8_t *slots;         // capacity entries of entry_size bytes
+	uint8_t *state;
+	size_t key_size;
+	size_t entry_size;
+	size_t capacity;        // Always a power of two
+	size_t count;
+	size_t deleted;
+} OpenTable;
+
+int open_table_init(OpenTable *t, size_t key_size, size_t entry_size);
+void open_table_free(OpenTable *t);
+void *open_table_find(OpenTable *t, const void *key);
+void *open_table_insert(OpenTable *t, const void *key, int *created);
+int open_table_remove(OpenTable *t, const void *key, void *out);
+void *open_table_next(OpenTable *t, size_t *cursor);
+
+#endif // OPEN_TABLE_H
@@ -2,6 +2,11 @@
 #include "admin_handler.h"
 #include "job_handler.h"
 #include "server.h"
+#include "worker_pool.h"
+#include "result_cache.h"
+#include "fair_queue.h"
+#include "job_cost.h"
+#include "transfer_stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,94 +15,247 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
-void init_processing() {
-    printf("[DEBUG] Initializing processing module\n");
+#define EXECUTOR_QUANTUM 30.0  // Seconds of expected run time a weight-1 client gets per round
+
+extern char **environ;
+
+int executor_workers = 1;
+
+static WorkerPool executor_pool;
+
+// Everything an executor needs, copied out so it runs without jobs_lock
+typedef struct {
+    uint8_t client_id[16];
+    uint32_t job_id;
+    struct sockaddr_in client_addr;
+    char command[MAX_CMD_LEN];
+    JobClass job_class;
+    JobInput *inputs;           // Names and known hashes, for the result cache key
+    int input_count;
+    uint64_t input_bytes;
+    double expected;            // Seconds, from the class's cost model
+    double deadline;            // Ready time plus expected; smallest runs first
+    uint64_t seq;               // Readiness order, breaks deadline ties
+} JobRun;
+
+/*
+ * Jobs whose files are all in, one heap per client. Executors take the
+ * next client in weighted round robin, charged by expected run time, so a
+ * client with a long backlog gets its share of executor time and no more.
+ * Within a client the job expected to finish soonest goes first, but as
+ * with uploads, every second waited counts against a second of expected
+ * run time, so long jobs still get their turn.
+ */
+static FairQueue ready_jobs;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_run_seq;
+
+static void execute_job(JobRun *run);
+
+static int run_before(const void *a, const void *b) {
+    const JobRun *x = a, *y = b;
+    if (x->deadline != y->deadline)
+        return x->deadline < y->deadline;
+    return x->seq < y->seq;
+}
+
+static double run_cost(const void *run) {
+    return ((const JobRun *)run)->expected;
+}
+
+void init_processing(int workers) {
+    LOG_INFO("Initializing processing module with %d executors", workers);
+    executor_workers = workers;
+    fair_queue_init(&ready_jobs, run_before, run_cost, EXECUTOR_QUANTUM);
+    if (worker_pool_init(&executor_pool, workers) != 0) {
+        LOG_ERROR("Failed to start executor pool");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Executor task. One is submitted per ready job, but each runs whatever
+ * the fair queue picks rather than the job that submitted it, and keeps
+ * going while jobs are left.
+ */
+static void execute_ready_jobs(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&ready_lock);
+        JobRun *run = fair_queue_pop(&ready_jobs);
+        pthread_mutex_unlock(&ready_lock);
+        if (!run)
+            return;
+        execute_job(run);
+    }
 }
 
-void process_pending_jobs(int sockfd) {
-    char original_dir[512];
-    if (getcwd(original_dir, sizeof(original_dir)) == NULL) {
-        perror("[DEBUG] getcwd failed");
+/*
+ * Hand the job to an executor if all of its files have arrived. Called by
+ * whoever made it ready: create_job for jobs without inputs, process_upload
+ * when the last file lands. Caller holds jobs_lock.
+ */
+void dispatch_if_ready(PendingJob *job) {
+    JobInput *inputs = NULL;
+    int input_count = 0;
+
+    pthread_mutex_lock(&job->lock);
+    int ready = job->state == JOB_WAITING && job->files_received >= job->file_count;
+    if (ready) {
+        job->state = JOB_RUNNING;
+        input_count = job->files_received;
+        inputs = malloc(MAX(input_count, 1) * sizeof(JobInput));
+        if (inputs && input_count > 0)
+            memcpy(inputs, job->inputs, input_count * sizeof(JobInput));
+    }
+    uint64_t input_bytes = job->input_bytes;
+    pthread_mutex_unlock(&job->lock);
+    if (!ready)
         return;
+
+    JobRun *run = inputs ? malloc(sizeof(JobRun)) : NULL;
+    if (run) {
+        memcpy(run->client_id, job->client_id, 16);
+        run->job_id = job->job_id;
+        run->client_addr = job->client_addr;
+        memcpy(run->command, job->command, MAX_CMD_LEN);
+        run->job_class = job->job_class;
+        run->inputs = inputs;
+        run->input_count = input_count;
+        run->input_bytes = input_bytes;
+        run->expected = job_cost_estimate(run->job_class, input_bytes);
+        run->deadline = transfer_clock_usec() / 1e6 + run->expected;
+        LOG_DEBUG("job_id=%u ready: %s, %lu input bytes, expected %.2f s",
+               run->job_id, job_class_name(run->job_class), input_bytes, run->expected);
+
+        pthread_mutex_lock(&ready_lock);
+        run->seq = next_run_seq++;
+        int queued = fair_queue_push(&ready_jobs, run->client_id, run) == 0;
+        pthread_mutex_unlock(&ready_lock);
+        if (queued) {
+            // If this fails, a running executor still drains the job later
+            worker_pool_submit(&executor_pool, execute_ready_jobs, NULL);
+            return;
+        }
+        free(run);
+    }
+    free(inputs);
+
+    LOG_ERROR("Failed to dispatch job_id=%u", job->job_id);
+    pthread_mutex_lock(&job->lock);
+    job->state = JOB_WAITING;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Run command through /bin/sh with dir as the child's working directory.
+ * The chdir happens in the child, so the server's own cwd never changes.
+ * Returns the exit status, or -1 if the child could not be run.
+ */
+static int run_in_dir(const char *dir, const char *command) {
+    posix_spawn_file_actions_t actions;
+    char *argv[] = { "sh", "-c", (char *)command, NULL };
+    pid_t pid;
+    int status;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    int err = posix_spawn_file_actions_addchdir_np(&actions, dir);
+    if (err == 0)
+        err = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        LOG_ERROR("posix_spawn failed in %s: %s", dir, strerror(err));
+        return -1;
     }
 
-    pthread_mutex_lock(&jobs_mutex);
-    for (size_t i = 0; i < job_count; i++) {
-        if (pending_jobs[i].files_received >= pending_jobs[i].file_count) {
-            printf("[DEBUG] Processing job_id=%u, command=%s\n",
-                   pending_jobs[i].job_id, pending_jobs[i].command);
-			// Log start of job
-			log_append("[PROCESSING]", "Starting job_id=%u for client_id=0x%02x0x%02x (command='%s')",
-					pending_jobs[i].job_id,
-					pending_jobs[i].client_id[0], pending_jobs[i].client_id[1],
-					pending_jobs[i].command);
-
-            
-            // Change to job directory
-            char dir_path[256];
-            snprintf(dir_path, sizeof(dir_path), "processing/%02x%02x_%08x",
-                     pending_jobs[i].client_id[0], pending_jobs[i].client_id[1],
-                     pending_jobs[i].job_id);
-            if (chdir(dir_path) != 0) {
-                fprintf(stderr, "[DEBUG] chdir failed for %s: %s\n",
-                        dir_path, strerror(errno));
-                continue;
-            }
-            
-            // Execute command
-            int ret = system(pending_jobs[i].command);
-            int status = ret == 0 ? STATUS_OK : STATUS_ERROR;
-            const char *msg = ret == 0 ? "Job completed successfully" : "Job execution failed";
-
-			// Log result
-			log_append("[PROCESSING]", "Job_id=%u for client_id=0x%02x0x%02x completed with status=%s",
-					pending_jobs[i].job_id,
-					pending_jobs[i].client_id[0], pending_jobs[i].client_id[1],
-					(status == STATUS_OK ? "OK" : "ERROR"));
-            
-            // Send JOB_RESULT
-            JobResult result;
-            result.type = JOB_RESULT;
-            result.job_id = pending_jobs[i].job_id;
-            result.status = status;
-            result.msg_len = strlen(msg);
-            
-            size_t result_size = sizeof(result) + result.msg_len;
-            uint8_t *send_buf = malloc(result_size);
-            if (!send_buf) {
-                fprintf(stderr, "[DEBUG] malloc failed for JOB_RESULT\n");
-                chdir(original_dir);
-                continue;
-            }
-            memcpy(send_buf, &result, sizeof(result));
-            memcpy(send_buf + sizeof(result), msg, result.msg_len);
-            
-            // Use client_addr from PendingJob
-            struct sockaddr_in client_addr = pending_jobs[i].client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            
-            printf("[DEBUG] Sending JOB_RESULT for job_id=%u to %s:%d, status=%d\n",
-                   pending_jobs[i].job_id, inet_ntoa(client_addr.sin_addr),
-                   ntohs(client_addr.sin_port), status);
-            if (sendto(sockfd, send_buf, result_size, 0,
-                       (struct sockaddr *)&client_addr, addr_len) < 0) {
-                perror("[DEBUG] sendto failed for JOB_RESULT");
-            }
-            free(send_buf);
-            
-            // Remove job
-            memmove(&pending_jobs[i], &pending_jobs[i + 1],
-                    (job_count - i - 1) * sizeof(PendingJob));
-            job_count--;
-            pending_jobs = realloc(pending_jobs, job_count * sizeof(PendingJob));
-            
-            // Restore directory
-            if (chdir(original_dir) != 0) {
-                fprintf(stderr, "[DEBUG] chdir back to %s failed: %s\n",
-                        original_dir, strerror(errno));
-            }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            LOG_ERRNO("waitpid failed");
+            return -1;
         }
     }
-    pthread_mutex_unlock(&jobs_mutex);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void execute_job(JobRun *run) {
+    LOG_DEBUG("Processing job_id=%u, command=%s", run->job_id, run->command);
+    // Log start of job
+    log_append("[PROCESSING]", "Starting job_id=%u for client_id=0x%02x0x%02x (command='%s')",
+               run->job_id, run->client_id[0], run->client_id[1], run->command);
+
+    char dir_path[256];
+    job_path(dir_path, sizeof(dir_path), run->client_id, run->job_id, NULL);
+
+    // Identical command over identical inputs: hand back the earlier outputs.
+    // Inputs hashed on the way in aren't read again for the key.
+    ResultInput *inputs = malloc(MAX(run->input_count, 1) * sizeof(ResultInput));
+    for (int i = 0; inputs && i < run->input_count; i++) {
+        inputs[i].name = run->inputs[i].name;
+        inputs[i].hash = run->inputs[i].hashed ? run->inputs[i].hash : NULL;
+    }
+    ResultKey key;
+    int cacheable = inputs && result_cache_key(dir_path, run->command, inputs,
+                                               run->input_count, &key) == 0;
+    free(inputs);
+    int ret;
+    const char *msg;
+    if (cacheable && result_cache_fetch(&key, dir_path)) {
+        LOG_DEBUG("job_id=%u served from the result cache", run->job_id);
+        ret = 0;
+        msg = "Job completed successfully (cached)";
+    } else {
+        uint64_t started = transfer_clock_usec();
+        ret = run_in_dir(dir_path, run->command);
+        // Only real, successful runs say anything about how long the class takes
+        if (ret == 0)
+            job_cost_observe(run->job_class, run->input_bytes,
+                             (transfer_clock_usec() - started) / 1e6);
+        msg = ret == 0 ? "Job completed successfully" : "Job execution failed";
+        if (cacheable && ret == 0)
+            result_cache_store(&key, dir_path);
+    }
+    if (cacheable)
+        result_cache_key_free(&key);
+
+    int status = ret == 0 ? STATUS_OK : STATUS_ERROR;
+
+    // Log result
+    log_append("[PROCESSING]", "Job_id=%u for client_id=0x%02x0x%02x completed with status=%s",
+               run->job_id, run->client_id[0], run->client_id[1],
+               (status == STATUS_OK ? "OK" : "ERROR"));
+
+    // Send JOB_RESULT
+    JobResult result;
+    result.type = JOB_RESULT;
+    result.job_id = run->job_id;
+    result.status = status;
+    result.msg_len = strlen(msg);
+
+    uint8_t send_buf[sizeof(result) + 64];
+    size_t result_size = sizeof(result) + result.msg_len;
+    memcpy(send_buf, &result, sizeof(result));
+    memcpy(send_buf + sizeof(result), msg, result.msg_len);
+
+    LOG_DEBUG("Sending JOB_RESULT for job_id=%u to %s:%d, status=%d",
+           run->job_id, inet_ntoa(run->client_addr.sin_addr),
+           ntohs(run->client_addr.sin_port), status);
+    if (sendto(udp_sock, send_buf, result_size, 0,
+               (struct sockaddr *)&run->client_addr, sizeof(run->client_addr)) < 0) {
+        LOG_ERRNO("sendto failed for JOB_RESULT");
+    }
+
+    // Remove job
+    pthread_rwlock_wrlock(&jobs_lock);
+    PendingJob *job = find_job(run->client_id, run->job_id);
+    if (job)
+        remove_job(job);
+    pthread_rwlock_unlock(&jobs_lock);
+
+    free(run->inputs);
+    free(run);
 }
@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 #include "protocol.h"
+#include "job_handler.h"
 
-void init_processing(void);
-void process_pending_jobs(int sockfd);
+extern int executor_workers;
 
-#endif
\ No newline at end of file
+void init_processing(int workers);
+void dispatch_if_ready(PendingJob *job);
+
+#endif
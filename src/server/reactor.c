@@ -0,0 +1,84 @@
+#include "reactor.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int reactor_init(Reactor *r)
+{
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0) {
+		LOG_ERRNO("epoll_create1 failed");
+		return -1;
+	}
+	return 0;
+}
+
+// Register fd; the returned source stays valid until reactor_remove()
+ReactorSource *reactor_add(Reactor *r, int fd, uint32_t events, ReactorHandler handler,
+		void *ctx)
+{
+	ReactorSource *src = malloc(sizeof(ReactorSource));
+	if (!src)
+		return NULL;
+
+	src->fd = fd;
+	src->handler = handler;
+	src->ctx = ctx;
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		LOG_ERRNO("epoll_ctl ADD failed");
+		free(src);
+		return NULL;
+	}
+	return src;
+}
+
+// Change the interest set, also used to re-arm EPOLLONESHOT sources
+int reactor_modify(Reactor *r, ReactorSource *src, uint32_t events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = src;
+	return epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+// Unregister and free the source. The fd itself is left open.
+void reactor_remove(Reactor *r, ReactorSource *src)
+{
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+	free(src);
+}
+
+void reactor_run(Reactor *r)
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	while (1) {
+		int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG_ERRNO("epoll_wait failed");
+			return;
+		}
+
+		for (int i = 0; i < n; i++) {
+			ReactorSource *src = events[i].data.ptr;
+			src->handler(src->fd, events[i].events, src->ctx);
+		}
+	}
+}
+
+int make_socket_non_blocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
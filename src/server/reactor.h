@@ -0,0 +1,33 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64
+
+/*
+ * Called from the reactor thread when fd becomes ready. Handlers must not
+ * block: anything slow gets handed to a worker pool.
+ */
+typedef void (*ReactorHandler)(int fd, uint32_t events, void *ctx);
+
+typedef struct {
+	int fd;
+	ReactorHandler handler;
+	void *ctx;
+} ReactorSource;
+
+typedef struct {
+	int epoll_fd;
+} Reactor;
+
+int reactor_init(Reactor *r);
+ReactorSource *reactor_add(Reactor *r, int fd, uint32_t events, ReactorHandler handler,
+		void *ctx);
+int reactor_modify(Reactor *r, ReactorSource *src, uint32_t events);
+void reactor_remove(Reactor *r, ReactorSource *src);
+void reactor_run(Reactor *r);
+int make_socket_non_blocking(int fd);
+
+#endif // REACTOR_H
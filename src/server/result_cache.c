@@ -0,0 +1,473 @@
+#include "result_cache.h"
+#include "digest_index.h"
+#include "common.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define RESULT_CACHE_BUCKETS 1024  // Power of two
+
+/*
+ * Outputs of finished jobs, one directory per ResultKey under the cache
+ * directory, holding read-only copies of the files the job produced.
+ * Copies, not hardlinks: a job directory's files get overwritten in place
+ * (ffmpeg -y, a rerun), which must not reach into the cache. Like the
+ * blob store, entries are found and evicted through a DigestIndex once the
+ * total size passes the cap.
+ *
+ * Copying can take a while, so it never happens under cache_lock. A new
+ * entry is built in a staging directory and renamed into place; a hit is
+ * linked into a staging directory under the lock, which keeps its data
+ * alive through an eviction, and copied out from there.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static DigestIndex results;
+static char cache_dir[256];
+static ResultCacheStats stats;
+static uint64_t staging_seq;
+
+#define STAGING_PREFIX ".staging."     // Not a hex name, so init never indexes one
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void free_names(char **names, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+// Sorted names of the regular, non-hidden files in dir; -1 if unreadable
+static int list_files(const char *dir, char ***names, size_t *count)
+{
+	DIR *d = opendir(dir);
+	size_t capacity = 8;
+
+	*names = NULL;
+	*count = 0;
+	if (!d)
+		return -1;
+
+	char **list = malloc(capacity * sizeof(char *));
+	struct dirent *ent;
+	while (list && (ent = readdir(d))) {
+		struct stat st;
+		if (ent->d_name[0] == '.' ||
+		    fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		if (*count == capacity) {
+			char **grown = realloc(list, capacity * 2 * sizeof(char *));
+			if (!grown)
+				break;
+			list = grown;
+			capacity *= 2;
+		}
+		list[(*count)++] = strdup(ent->d_name);
+	}
+	closedir(d);
+	if (!list)
+		return -1;
+
+	qsort(list, *count, sizeof(char *), compare_names);
+	*names = list;
+	return 0;
+}
+
+static uint64_t entry_size(const char *path)
+{
+	char **names;
+	size_t count;
+	uint64_t size = 0;
+	char file[768];
+
+	if (list_files(path, &names, &count) != 0)
+		return 0;
+	for (size_t i = 0; i < count; i++) {
+		struct stat st;
+		snprintf(file, sizeof(file), "%s/%s", path, names[i]);
+		if (stat(file, &st) == 0)
+			size += st.st_size;
+	}
+	free_names(names, count);
+	return size;
+}
+
+static void remove_entry_dir(const char *path)
+{
+	DIR *d = opendir(path);
+	struct dirent *ent;
+
+	if (d) {
+		while ((ent = readdir(d)))
+			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+				unlinkat(dirfd(d), ent->d_name, 0);
+		closedir(d);
+	}
+	if (rmdir(path) != 0 && errno != ENOENT)
+		LOG_ERRNO("Failed to remove result cache entry");
+}
+
+// A fresh directory under the cache directory for building or reading an entry
+static int make_staging_dir(char *path, size_t len)
+{
+	uint64_t seq = __atomic_fetch_add(&staging_seq, 1, __ATOMIC_RELAXED);
+	snprintf(path, len, "%s/" STAGING_PREFIX "%lu", cache_dir, seq);
+	remove_entry_dir(path);
+	return mkdir(path, 0777);
+}
+
+/*
+ * Copy source to a new file target: a reflink where the filesystem can
+ * share the blocks copy-on-write, otherwise an in-kernel copy.
+ */
+static int copy_file(const char *source, const char *target, mode_t mode)
+{
+	struct stat st;
+	int in = open(source, O_RDONLY);
+	if (in < 0)
+		return -1;
+	int out = open(target, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (out < 0 || fstat(in, &st) != 0) {
+		if (out >= 0)
+			close(out);
+		close(in);
+		return -1;
+	}
+
+	int ok = 1;
+	if (ioctl(out, FICLONE, in) != 0) {
+		off_t left = st.st_size;
+		while (left > 0) {
+			ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+			if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL))
+				n = sendfile(out, in, NULL, left);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				ok = 0;
+			if (n <= 0)
+				break;          // At 0 the source shrank; keep what is there
+			left -= n;
+		}
+	}
+	close(in);
+	if (close(out) != 0)
+		ok = 0;
+	if (!ok)
+		unlink(target);
+	return ok ? 0 : -1;
+}
+
+// Caller holds cache_lock
+static void evict_to_cap(void)
+{
+	char path[512];
+
+	while (results.bytes > stats.cap && results.lru_tail) {
+		DigestEntry *victim = results.lru_tail;
+		digest_path(cache_dir, victim->digest, path, sizeof(path));
+		remove_entry_dir(path);
+		digest_index_drop(&results, victim);
+		stats.evictions++;
+	}
+}
+
+// Create the cache directory and pick up entries left by an earlier run
+int result_cache_init(const char *dir, uint64_t cap_bytes)
+{
+	snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+	stats.cap = cap_bytes;
+
+	if (digest_index_init(&results, RESULT_CACHE_BUCKETS) != 0) {
+		LOG_ERROR("Failed to allocate result cache index");
+		return -1;
+	}
+
+	if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+		LOG_ERRNO("Failed to create result cache directory");
+		return -1;
+	}
+
+	DIR *d = opendir(cache_dir);
+	if (!d) {
+		LOG_ERRNO("Failed to open result cache directory");
+		return -1;
+	}
+
+	struct dirent *ent;
+	char path[512];
+	pthread_mutex_lock(&cache_lock);
+	while ((ent = readdir(d))) {
+		uint8_t digest[SHA256_DIGEST_LEN];
+		struct stat st;
+		if (strncmp(ent->d_name, STAGING_PREFIX, strlen(STAGING_PREFIX)) == 0) {
+			// Half-built or half-read when the server stopped
+			snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name);
+			remove_entry_dir(path);
+			continue;
+		}
+		if (digest_parse_hex(ent->d_name, digest) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name);
+		if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+			continue;
+		digest_index_insert(&results, digest, entry_size(path));
+	}
+	evict_to_cap();
+	pthread_mutex_unlock(&cache_lock);
+	closedir(d);
+
+	LOG_INFO("Result cache at %s: %lu entries, %lu of %lu bytes",
+	       cache_dir, results.count, results.bytes, stats.cap);
+	return 0;
+}
+
+// Hash the command with runs of whitespace collapsed and the ends trimmed
+static void hash_command(Sha256 *ctx, const char *command)
+{
+	const char *p = command;
+	int space = 0;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	for (; *p; p++) {
+		if (isspace((unsigned char)*p)) {
+			space = 1;
+			continue;
+		}
+		if (space)
+			sha256_update(ctx, " ", 1);
+		space = 0;
+		sha256_update(ctx, p, 1);
+	}
+	sha256_update(ctx, "", 1);
+}
+
+static int compare_inputs(const void *a, const void *b)
+{
+	return strcmp(((const ResultInput *)a)->name, ((const ResultInput *)b)->name);
+}
+
+/*
+ * Work out the key of the job about to run in job_dir: the normalized
+ * command, then each input's name and content hash in name order. Hashes
+ * the caller already has are used as they are; only the other inputs are
+ * read. Returns -1 if one of those can't be, in which case the job just
+ * isn't cached.
+ */
+int result_cache_key(const char *job_dir, const char *command, const ResultInput *inputs,
+		size_t input_count, ResultKey *key)
+{
+	Sha256 ctx;
+	char path[768];
+
+	memset(key, 0, sizeof(*key));
+	if (stats.cap == 0)
+		return -1;      // Cache off; don't pay for hashing the inputs
+
+	ResultInput *sorted = malloc((input_count ? input_count : 1) * sizeof(ResultInput));
+	key->inputs = calloc(input_count ? input_count : 1, sizeof(char *));
+	if (!sorted || !key->inputs) {
+		free(sorted);
+		free(key->inputs);
+		key->inputs = NULL;
+		return -1;
+	}
+	memcpy(sorted, inputs, input_count * sizeof(ResultInput));
+	qsort(sorted, input_count, sizeof(ResultInput), compare_inputs);
+
+	sha256_init(&ctx);
+	hash_command(&ctx, command);
+	for (size_t i = 0; i < input_count; i++) {
+		uint8_t digest[SHA256_DIGEST_LEN];
+		const uint8_t *hash = sorted[i].hash;
+		if (!hash) {
+			snprintf(path, sizeof(path), "%s/%s", job_dir, sorted[i].name);
+			int fd = open(path, O_RDONLY);
+			int ok = fd >= 0 && sha256_fd(fd, digest) == 0;
+			if (fd >= 0)
+				close(fd);
+			hash = ok ? digest : NULL;
+		}
+		key->inputs[i] = strdup(sorted[i].name);
+		key->input_count = i + 1;
+		if (!hash || !key->inputs[i]) {
+			free(sorted);
+			result_cache_key_free(key);
+			return -1;
+		}
+		sha256_update(&ctx, sorted[i].name, strlen(sorted[i].name) + 1);
+		sha256_update(&ctx, hash, SHA256_DIGEST_LEN);
+	}
+	free(sorted);
+	sha256_final(&ctx, key->digest);
+	return 0;
+}
+
+void result_cache_key_free(ResultKey *key)
+{
+	free_names(key->inputs, key->input_count);
+	key->inputs = NULL;
+	key->input_count = 0;
+}
+
+// Copy the cached outputs for key into job_dir; returns 1 on a hit
+int result_cache_fetch(const ResultKey *key, const char *job_dir)
+{
+	char entry[512], staging[512], source[768], target[768];
+	char **names = NULL;
+	size_t count = 0;
+	int staged = 0, hit = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	DigestEntry *r = digest_index_find(&results, key->digest);
+	if (r && make_staging_dir(staging, sizeof(staging)) == 0) {
+		digest_path(cache_dir, key->digest, entry, sizeof(entry));
+		staged = list_files(entry, &names, &count) == 0;
+		for (size_t i = 0; i < count && staged; i++) {
+			snprintf(source, sizeof(source), "%s/%s", entry, names[i]);
+			snprintf(target, sizeof(target), "%s/%s", staging, names[i]);
+			staged = link(source, target) == 0;
+		}
+		if (staged) {
+			digest_index_touch(&results, r);
+		} else {
+			// Damaged behind our back; let the job rebuild it
+			remove_entry_dir(staging);
+			remove_entry_dir(entry);
+			digest_index_drop(&results, r);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// Replace whatever the job directory has under the output names
+	if (staged) {
+		hit = 1;
+		for (size_t i = 0; i < count && hit; i++) {
+			snprintf(source, sizeof(source), "%s/%s", staging, names[i]);
+			snprintf(target, sizeof(target), "%s/%s", job_dir, names[i]);
+			hit = (unlink(target) == 0 || errno == ENOENT) &&
+			      copy_file(source, target, 0666) == 0;
+		}
+		remove_entry_dir(staging);
+	}
+	free_names(names, count);
+
+	pthread_mutex_lock(&cache_lock);
+	if (hit)
+		stats.hits++;
+	else
+		stats.misses++;
+	pthread_mutex_unlock(&cache_lock);
+	return hit;
+}
+
+static int is_input(const ResultKey *key, const char *name)
+{
+	return bsearch(&name, key->inputs, key->input_count, sizeof(char *), compare_names) != NULL;
+}
+
+// Keep the files the job created in job_dir under key
+void result_cache_store(const ResultKey *key, const char *job_dir)
+{
+	char entry[512], staging[512], source[768], target[768];
+	char **names;
+	size_t count;
+	uint64_t size = 0;
+	int outputs = 0;
+
+	if (list_files(job_dir, &names, &count) != 0)
+		return;
+	for (size_t i = 0; i < count; i++) {
+		struct stat st;
+		if (is_input(key, names[i]))
+			continue;
+		snprintf(source, sizeof(source), "%s/%s", job_dir, names[i]);
+		if (stat(source, &st) == 0)
+			size += st.st_size;
+		outputs++;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	int wanted = outputs > 0 && stats.cap > 0 && size <= stats.cap &&
+		     !digest_index_find(&results, key->digest);
+	pthread_mutex_unlock(&cache_lock);
+	if (!wanted) {
+		free_names(names, count);
+		return;
+	}
+
+	// Read-only copies, so nothing that gets hold of one can change the entry
+	int ok = make_staging_dir(staging, sizeof(staging)) == 0;
+	for (size_t i = 0; i < count && ok; i++) {
+		if (is_input(key, names[i]))
+			continue;
+		snprintf(source, sizeof(source), "%s/%s", job_dir, names[i]);
+		snprintf(target, sizeof(target), "%s/%s", staging, names[i]);
+		ok = copy_file(source, target, 0444) == 0;
+	}
+	free_names(names, count);
+	if (!ok) {
+		LOG_ERRNO("Failed to cache job outputs");
+		remove_entry_dir(staging);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (digest_index_find(&results, key->digest)) {
+		// Another executor ran the same job meanwhile
+		pthread_mutex_unlock(&cache_lock);
+		remove_entry_dir(staging);
+		return;
+	}
+	digest_path(cache_dir, key->digest, entry, sizeof(entry));
+	// A leftover directory not in the index can't be trusted; start over
+	remove_entry_dir(entry);
+	if (rename(staging, entry) == 0 && digest_index_insert(&results, key->digest, size)) {
+		evict_to_cap();
+	} else {
+		LOG_ERRNO("Failed to cache job outputs");
+		remove_entry_dir(entry);
+		remove_entry_dir(staging);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void result_cache_snapshot(ResultCacheStats *out)
+{
+	pthread_mutex_lock(&cache_lock);
+	*out = stats;
+	out->entries = results.count;
+	out->bytes = results.bytes;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+size_t result_cache_format(char *buf, size_t len)
+{
+	ResultCacheStats s;
+	result_cache_snapshot(&s);
+
+	int n = snprintf(buf, len,
+			"Result cache: %lu entries, %.1f of %.1f MB, %lu hits, %lu misses, "
+			"%lu evictions\n",
+			s.entries, s.bytes / 1048576.0, s.cap / 1048576.0,
+			s.hits, s.misses, s.evictions);
+	if (n < 0)
+		return 0;
+	return (size_t)n < len ? (size_t)n : len - 1;
+}
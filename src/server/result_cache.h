@@ -0,0 +1,46 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "sha256.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define RESULT_CACHE_DIR    "processing/.results"
+#define RESULT_CACHE_CAP_MB 1024
+
+/*
+ * What a job's outputs depend on: its normalized command and the content
+ * of every input file. The input names are kept so the files the command
+ * produces can be told apart from the ones it was given.
+ */
+typedef struct {
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char **inputs;          // Sorted
+	size_t input_count;
+} ResultKey;
+
+// One input file of the job, as the caller knows it
+typedef struct {
+	const char *name;
+	const uint8_t *hash;    // Content hash if already known, else NULL
+} ResultInput;
+
+typedef struct {
+	uint64_t entries;
+	uint64_t bytes;
+	uint64_t cap;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} ResultCacheStats;
+
+int result_cache_init(const char *dir, uint64_t cap_bytes);
+int result_cache_key(const char *job_dir, const char *command, const ResultInput *inputs,
+		size_t input_count, ResultKey *key);
+void result_cache_key_free(ResultKey *key);
+int result_cache_fetch(const ResultKey *key, const char *job_dir);
+void result_cache_store(const ResultKey *key, const char *job_dir);
+void result_cache_snapshot(ResultCacheStats *out);
+size_t result_cache_format(char *buf, size_t len);
+
+#endif // RESULT_CACHE_H
@@ -10,6 +10,7 @@
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/random.h>
 #include "protocol.h"
 #include "common.h"
 #include "job_handler.h"
@@ -18,49 +19,204 @@
 #include "server.h"
 #include "admin_handler.h"
 #include "log_queue.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "udp_batch.h"
+#include "download_handler.h"
+#include "handshake.h"
+#include "blob_store.h"
+#include "result_cache.h"
+#include "log_sink.h"
 
-#define MAX_EVENTS 10
-#define BUFFER_SIZE 2048
-
-ClientInfo *clients = NULL;
-size_t client_count = 0;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t max_limits_mutex = PTHREAD_MUTEX_INITIALIZER;
-DownloadQueue download_queue = {0};
 LogQueue global_log_queue;
+int log_level = LOG_LEVEL_INFO;
 
 int max_uploads = MAX_UPLOADS;
 int udp_sock = -1;
 
-void *client_thread(void *arg);
+/*
+ * One UDP receiver per shard, each with its own SO_REUSEPORT socket on
+ * SERVER_PORT and its own reactor. Shard i only hands out client ids that
+ * live in client registry shard i.
+ */
+typedef struct {
+    int index;
+    int sock;
+    Reactor reactor;
+    UdpBatch batch;
+    pthread_t tid;
+} UdpShard;
+
+static Reactor reactor;
+static UdpShard udp_shards[MAX_SHARDS];
+
+void udp_readable(int sockfd, uint32_t events, void *ctx);
+void udp_flush_timer(int timer_fd, uint32_t events, void *ctx);
+void *udp_shard_thread(void *arg);
 void *watcher_thread(void *arg);
-void *processing_thread(void *arg);
-void *download_thread(void *arg);
-void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *buffer, ssize_t n);
-void generate_client_id(uint8_t *client_id);
-void cleanup_dead_clients(time_t timeout);
+void handle_udp_message(UdpShard *shard, struct sockaddr_in *client_addr, uint8_t *buffer, ssize_t n);
+int generate_client_id(uint8_t *client_id, int shard);
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b udp_batch_size] [-f udp_flush_usec] [-s udp_shards] [-w workers]\n"
+            "          [-d max_downloads] [-i input_store_mb] [-r result_cache_mb]\n"
+            "          [-l log_segment_mb] [-v log_level]\n"
+            "  -b  datagrams drained/sent per recvmmsg/sendmmsg (1-%d, default %d)\n"
+            "  -f  longest time a queued UDP ack may wait, 0 = send at once (default %d)\n"
+            "  -s  UDP receiver threads / client table shards (1-%d, default: cores)\n"
+            "  -w  jobs executed in parallel (default: cores)\n"
+            "  -d  files streamed to clients in parallel (default %d)\n"
+            "  -i  size cap of the store of uploaded inputs, 0 = off (default %d)\n"
+            "  -r  size cap of the cache of job outputs, 0 = off (default %d)\n"
+            "  -l  size of each log file under %s/, 0 = no log files (default %d)\n"
+            "  -v  error, warn, info, debug or trace (default info; trace needs a build\n"
+            "      with LOG_LEVEL_MAX=LOG_LEVEL_TRACE)\n",
+            prog, UDP_BATCH_MAX, UDP_BATCH_SIZE, UDP_FLUSH_USEC, MAX_SHARDS, MAX_DOWNLOADS,
+            BLOB_STORE_CAP_MB, RESULT_CACHE_CAP_MB, LOG_SINK_DIR, LOG_SEGMENT_MB);
+}
 
-int main() {
-    int tcp_sock, download_sock;
+static int open_udp_shard_socket(void) {
     struct sockaddr_in server_addr;
+    int one = 1;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("UDP socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Every shard binds SERVER_PORT; the kernel spreads clients across them
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("UDP SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    
+    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("UDP bind failed");
+        exit(EXIT_FAILURE);
+    }
     
-    // Initialize download queue
-    download_queue.jobs = malloc(10 * sizeof(DownloadJob));
-    download_queue.capacity = 10;
-    download_queue.size = 0;
-    pthread_mutex_init(&download_queue.mutex, NULL);
-    pthread_cond_init(&download_queue.cond, NULL);
+    make_socket_non_blocking(sock);
+    return sock;
+}
+
+static void init_udp_shard(UdpShard *shard, int index) {
+    shard->index = index;
+    shard->sock = open_udp_shard_socket();
+    
+    if (reactor_init(&shard->reactor) != 0 ||
+        udp_batch_init(&shard->batch, shard->sock, udp_batch_size) != 0)
+        exit(EXIT_FAILURE);
+    
+    if (!reactor_add(&shard->reactor, shard->sock, EPOLLIN, udp_readable, shard) ||
+        !reactor_add(&shard->reactor, shard->batch.timer_fd, EPOLLIN, udp_flush_timer,
+                     &shard->batch)) {
+        LOG_ERROR("Failed to register UDP shard %d", index);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    int tcp_sock, download_sock, admin_sock;
+    struct sockaddr_in server_addr;
+    int opt;
+    int shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int downloads = MAX_DOWNLOADS;
+    long store_mb = BLOB_STORE_CAP_MB;
+    long results_mb = RESULT_CACHE_CAP_MB;
+    long segment_mb = LOG_SEGMENT_MB;
+    
+    while ((opt = getopt(argc, argv, "b:f:s:w:d:i:r:l:v:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                udp_batch_size = atoi(optarg);
+                if (udp_batch_size < 1 || udp_batch_size > UDP_BATCH_MAX) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                udp_flush_usec = atoi(optarg);
+                if (udp_flush_usec < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                shards = atoi(optarg);
+                if (shards < 1 || shards > MAX_SHARDS) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                downloads = atoi(optarg);
+                if (downloads < 1) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                store_mb = atol(optarg);
+                if (store_mb < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                results_mb = atol(optarg);
+                if (results_mb < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                segment_mb = atol(optarg);
+                if (segment_mb < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v': {
+                int level = log_level_parse(optarg);
+                if (level < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+                break;
+            }
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    shards = MAX(1, MIN(shards, MAX_SHARDS));
+    workers = MAX(1, workers);
     
     // Create processing directory if it doesn't exist
     if (mkdir("processing", 0777) != 0 && errno != EEXIST) {
-        perror("[DEBUG] Failed to create processing directory");
+        LOG_ERRNO("Failed to create processing directory");
         exit(EXIT_FAILURE);
     }
     
-    if ((udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("UDP socket creation failed");
+    if (blob_store_init(BLOB_STORE_DIR, (uint64_t)store_mb * 1024 * 1024) != 0 ||
+        result_cache_init(RESULT_CACHE_DIR, (uint64_t)results_mb * 1024 * 1024) != 0)
         exit(EXIT_FAILURE);
-    }
     
     if ((tcp_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("TCP socket creation failed");
@@ -72,22 +228,28 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    // Upload connections the server hangs up on linger in TIME_WAIT on
+    // these ports; without this a restart can't bind until they clear
+    int one = 1;
+    if (setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(download_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        perror("TCP SO_REUSEADDR failed");
+        exit(EXIT_FAILURE);
+    }
+
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(SERVER_PORT);
     
-    if (bind(udp_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("UDP bind failed");
-        exit(EXIT_FAILURE);
-    }
-    
     if (bind(tcp_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("TCP bind failed");
         exit(EXIT_FAILURE);
     }
     
-    if (listen(tcp_sock, max_uploads) < 0) {
+    // The reactor accepts as fast as connections arrive, so the backlog no
+    // longer needs to match the upload slot count
+    if (listen(tcp_sock, SOMAXCONN) < 0) {
         perror("TCP listen failed");
         exit(EXIT_FAILURE);
     }
@@ -99,72 +261,106 @@ int main() {
         exit(EXIT_FAILURE);
     }
     
-    if (listen(download_sock, max_uploads) < 0) {
+    if (listen(download_sock, SOMAXCONN) < 0) {
         perror("Download listen failed");
         exit(EXIT_FAILURE);
     }
     
-    printf("Server started on port %d (Uploads) and %d (downloads)\n", SERVER_PORT, SERVER_PORT + 1);
+    printf("Server started on port %d (Uploads) and %d (downloads), %d UDP shards, %d executors\n",
+           SERVER_PORT, SERVER_PORT + 1, shards, workers);
     
-    init_job_handler();
-    init_upload_handler(tcp_sock);
-    init_processing();
     log_queue_init(&global_log_queue);
+    if (log_sink_init(&global_log_queue, LOG_SINK_DIR, (uint64_t)segment_mb * 1024 * 1024) != 0)
+        exit(EXIT_FAILURE);
+    client_registry_init(shards, HEARTBEAT_TIMEOUT);
+    for (int i = 0; i < shards; i++)
+        init_udp_shard(&udp_shards[i], i);
+    // Out-of-band sends (JOB_RESULT, kicks) go out through the first shard
+    udp_sock = udp_shards[0].sock;
+    
+    init_job_handler();
+    init_upload_handler();
+    init_processing(workers);
+    init_download_handler(downloads);
+    admin_sock = init_admin_handler();
+    
+    // One reactor owns every listening socket; blocking work goes to the pools
+    if (reactor_init(&reactor) != 0)
+        exit(EXIT_FAILURE);
     
-    pthread_t client_tid, watcher_tid, processing_tid, download_tid, admin_tid;
+    make_socket_non_blocking(tcp_sock);
+    make_socket_non_blocking(download_sock);
+    make_socket_non_blocking(admin_sock);
     
-    pthread_create(&client_tid, NULL, client_thread, &udp_sock);
+    if (!reactor_add(&reactor, tcp_sock, EPOLLIN, upload_accept, &reactor) ||
+        !reactor_add(&reactor, download_sock, EPOLLIN, download_accept, &reactor) ||
+        !reactor_add(&reactor, admin_sock, EPOLLIN, admin_accept, NULL)) {
+        LOG_ERROR("Failed to register sockets with the reactor");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_t watcher_tid;
+    
+    for (int i = 0; i < shards; i++)
+        pthread_create(&udp_shards[i].tid, NULL, udp_shard_thread, &udp_shards[i]);
     pthread_create(&watcher_tid, NULL, watcher_thread, NULL);
-    pthread_create(&processing_tid, NULL, processing_thread, &udp_sock);
-    pthread_create(&download_tid, NULL, download_thread, &download_sock);
-    pthread_create(&admin_tid, NULL, admin_thread, NULL);
     
-    pthread_join(client_tid, NULL);
-    pthread_join(watcher_tid, NULL);
-    pthread_join(processing_tid, NULL);
-    pthread_join(download_tid, NULL);
-    pthread_join(admin_tid, NULL);
+    reactor_run(&reactor);
     
-    close(udp_sock);
+    for (int i = 0; i < shards; i++)
+        close(udp_shards[i].sock);
     close(tcp_sock);
     close(download_sock);
-    free(download_queue.jobs);
-    pthread_mutex_destroy(&download_queue.mutex);
-    pthread_cond_destroy(&download_queue.cond);
+    close(admin_sock);
     return 0;
 }
 
-void *client_thread(void *arg) {
-    int sockfd = *(int *)arg;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    uint8_t buffer[BUFFER_SIZE];
+void *udp_shard_thread(void *arg) {
+    UdpShard *shard = arg;
+    reactor_run(&shard->reactor);
+    return NULL;
+}
+
+// Reactor handler for a shard's UDP socket: drain in recvmmsg batches
+void udp_readable(int sockfd, uint32_t events, void *ctx) {
+    (void)sockfd;
+    (void)events;
+    UdpShard *shard = ctx;
+    UdpBatch *batch = &shard->batch;
+    int n;
     
-    while (1) {
-        ssize_t n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, 
-                            (struct sockaddr *)&client_addr, &addr_len);
-        if (n < 0) {
-            perror("[DEBUG] recvfrom failed");
-            continue;
+    do {
+        n = udp_batch_recv(batch);
+        for (int i = 0; i < n; i++) {
+            handle_udp_message(shard, &batch->rx_addrs[i], batch->rx_bufs[i],
+                               batch->rx_msgs[i].msg_len);
         }
-        
-        handle_udp_message(sockfd, &client_addr, buffer, n);
-        
-        if (rand() % 100 < 5) {
-            cleanup_dead_clients(HEARTBEAT_TIMEOUT);
-        }
-    }
-    return NULL;
+    } while (n == batch->capacity);
+    
+    udp_batch_schedule_flush(batch);
+}
+
+// Flush deadline for acks queued by udp_readable
+void udp_flush_timer(int timer_fd, uint32_t events, void *ctx) {
+    (void)events;
+    UdpBatch *batch = ctx;
+    uint64_t expirations;
+    
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        LOG_ERRNO("timerfd read failed");
+    udp_batch_flush(batch);
 }
 
-void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *buffer, ssize_t n) {
+void handle_udp_message(UdpShard *shard, struct sockaddr_in *client_addr, uint8_t *buffer, ssize_t n) {
+    UdpBatch *out = &shard->batch;
+    
     if (n < 1) {
-        fprintf(stderr, "[DEBUG] Received empty message\n");
+        LOG_WARN("Received empty message");
         return;
     }
     
     uint8_t type = buffer[0];
-    printf("[DEBUG] Received message type %d from %s:%d\n", 
+    LOG_TRACE("Received message type %d from %s:%d", 
            type, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
     
     switch (type) {
@@ -174,49 +370,42 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
             
             resp.type = CLIENT_ID_ACK;
             resp.message_id = req->message_id;
-            generate_client_id(resp.client_id);
-            
-            pthread_mutex_lock(&clients_mutex);
+            if (generate_client_id(resp.client_id, shard->index) != 0) {
+                LOG_ERROR("Failed to generate a client id");
+                break;
+            }
             
             ClientInfo new_client;
             memcpy(new_client.client_id, resp.client_id, 16);
             new_client.addr = *client_addr;
             new_client.last_heartbeat = time(NULL);
             
-            clients = realloc(clients, (client_count + 1) * sizeof(ClientInfo));
-            clients[client_count++] = new_client;
+            if (!client_registry_add(&new_client)) {
+                LOG_ERROR("Failed to register new client");
+                break;
+            }
             
-            printf("[DEBUG] Assigned client_id=%02x%02x to %s:%d\n",
+            LOG_DEBUG("Assigned client_id=%02x%02x to %s:%d",
                    resp.client_id[0], resp.client_id[1],
                    inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
 	    log_append("[CLIENT]", "Assigned client_id=%02x%02x to %s:%d", resp.client_id[0],
 	           resp.client_id[1], inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
             
-            pthread_mutex_unlock(&clients_mutex);
-            
-            printf("[DEBUG] Sending CLIENT_ID_ACK to %s:%d\n", 
+            LOG_DEBUG("Sending CLIENT_ID_ACK to %s:%d", 
                    inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
-            sendto(sockfd, &resp, sizeof(resp), 0, 
-                  (struct sockaddr *)client_addr, sizeof(*client_addr));
+            udp_batch_reply(out, &resp, sizeof(resp), client_addr);
             break;
         }
         
         case HEARTBEAT: {
             Heartbeat *hb = (Heartbeat *)buffer;
             
-            pthread_mutex_lock(&clients_mutex);
-            for (size_t i = 0; i < client_count; i++) {
-                if (memcmp(clients[i].client_id, hb->client_id, 16) == 0) {
-                    clients[i].last_heartbeat = time(NULL);
-                    clients[i].addr = *client_addr;
-                    printf("[DEBUG] Updated heartbeat for client %02x%02x\n", 
-                           hb->client_id[0], hb->client_id[1]);
-		    log_append("[CLIENT]", "Updated hearbeat for client %02x%02x",
-		           hb->client_id[0], hb->client_id[1]);
-                    break;
-                }
+            if (client_registry_touch(hb->client_id, client_addr)) {
+                LOG_TRACE("Updated heartbeat for client %02x%02x", 
+                       hb->client_id[0], hb->client_id[1]);
+		log_append("[CLIENT]", "Updated hearbeat for client %02x%02x",
+		       hb->client_id[0], hb->client_id[1]);
             }
-            pthread_mutex_unlock(&clients_mutex);
             break;
         }
         
@@ -224,13 +413,13 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
             JobRequest *req = (JobRequest *)buffer;
             char *job_cmd = (char *)(buffer + sizeof(JobRequest));
             if (n < (ssize_t)(sizeof(JobRequest) + req->cmd_len)) {
-                fprintf(stderr, "[DEBUG] Invalid JOB_REQ size: %zd, expected %zu\n",
+                LOG_WARN("Invalid JOB_REQ size: %zd, expected %zu",
                         n, sizeof(JobRequest) + req->cmd_len);
                 break;
             }
             job_cmd[req->cmd_len] = '\0'; // Ensure null-termination
             
-            printf("[DEBUG] Handling JOB_REQ for job_id=%u, cmd=%s, file_count=%d, client_id=%02x%02x\n", 
+            LOG_DEBUG("Handling JOB_REQ for job_id=%u, cmd=%s, file_count=%d, client_id=%02x%02x", 
                    req->job_id, job_cmd, req->file_count, req->client_id[0], req->client_id[1]);
             
             JobResponse resp;
@@ -247,7 +436,7 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
             size_t resp_size = sizeof(resp) + resp.msg_len;
             uint8_t *send_buf = malloc(resp_size);
             if (!send_buf) {
-                perror("[DEBUG] malloc failed for JOB_ACK");
+                LOG_ERRNO("malloc failed for JOB_ACK");
                 break;
             }
             memcpy(send_buf, &resp, sizeof(resp));
@@ -261,11 +450,10 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
 	    	log_append("[JOB]", "Job %u for client %02x%02x failed.", resp.job_id,
 		           req -> client_id[0], req -> client_id[1]);
 	    
-            printf("[DEBUG] Sending JOB_ACK to %s:%d for job_id=%u, status=%d, msg=%s\n",
+            LOG_DEBUG("Sending JOB_ACK to %s:%d for job_id=%u, status=%d, msg=%s",
                    inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port),
                    resp.job_id, resp.status, msg);
-            sendto(sockfd, send_buf, resp_size, 0,
-                  (struct sockaddr *)client_addr, sizeof(*client_addr));
+            udp_batch_reply(out, send_buf, resp_size, client_addr);
             free(send_buf);
             break;
         }
@@ -274,15 +462,15 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
             UploadRequest *req = (UploadRequest *)buffer;
             char *filename = (char *)(buffer + sizeof(UploadRequest));
             if (n < (ssize_t)(sizeof(UploadRequest) + req->name_len)) {
-                fprintf(stderr, "[DEBUG] Invalid UPLOAD_REQ size: %zd, expected %zu\n",
+                LOG_WARN("Invalid UPLOAD_REQ size: %zd, expected %zu",
                         n, sizeof(UploadRequest) + req->name_len);
                 break;
             }
             filename[req->name_len] = '\0'; // Ensure null-termination
             
-            printf("[DEBUG] Received UPLOAD_REQ for job_id=%u, filename=%s\n",
+            LOG_DEBUG("Received UPLOAD_REQ for job_id=%u, filename=%s",
                    req->job_id, filename);
-            handle_upload_request(sockfd, req, filename, client_addr);
+            handle_upload_request(out, req, filename, client_addr);
             break;
         }
         
@@ -290,147 +478,69 @@ void handle_udp_message(int sockfd, struct sockaddr_in *client_addr, uint8_t *bu
             DownloadRequest *req = (DownloadRequest *)buffer;
             char *filename = (char *)(buffer + sizeof(DownloadRequest));
             if (n < (ssize_t)(sizeof(DownloadRequest) + req->name_len)) {
-                fprintf(stderr, "[DEBUG] Invalid DOWNLOAD_REQ size: %zd, expected %zu\n",
+                LOG_WARN("Invalid DOWNLOAD_REQ size: %zd, expected %zu",
                         n, sizeof(DownloadRequest) + req->name_len);
                 break;
             }
             filename[req->name_len] = '\0'; // Ensure null-termination
             
-            printf("[DEBUG] Received DOWNLOAD_REQ for job_id=%u, filename=%s\n",
+            LOG_DEBUG("Received DOWNLOAD_REQ for job_id=%u, filename=%s",
                    req->job_id, filename);
-            handle_download_request(sockfd, req, filename, client_addr);
+            handle_download_request(out, req, filename, client_addr);
             break;
         }
         
         default:
-            fprintf(stderr, "[DEBUG] Unknown message type: %d\n", type);
+            LOG_WARN("Unknown message type: %d", type);
     }
 }
 
-void generate_client_id(uint8_t *client_id) {
-    for (int i = 0; i < 16; i++) {
-        client_id[i] = rand() % 256;
+// Fill buf from the kernel's CSPRNG; /dev/urandom for kernels without getrandom
+static int random_bytes(void *buf, size_t len) {
+    if (getrandom(buf, len, 0) == (ssize_t)len)
+        return 0;
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("open /dev/urandom");
+        return -1;
     }
+    ssize_t n = read(fd, buf, len);
+    close(fd);
+    return n == (ssize_t)len ? 0 : -1;
 }
 
-void cleanup_dead_clients(time_t timeout) {
-    time_t now = time(NULL);
-    pthread_mutex_lock(&clients_mutex);
-    
-    size_t new_count = 0;
-    for (size_t i = 0; i < client_count; i++) {
-        if (now - clients[i].last_heartbeat < timeout) {
-            clients[new_count++] = clients[i];
-        } else {
-            printf("[DEBUG] Removing client %02x%02x due to timeout\n",
-                   clients[i].client_id[0], clients[i].client_id[1]);
-        }
-    }
-    
-    if (new_count < client_count) {
-        clients = realloc(clients, new_count * sizeof(ClientInfo));
-        client_count = new_count;
-        printf("[DEBUG] Cleaned up %zu dead clients, %zu remain\n", 
-               client_count, new_count);
-    }
-    
-    pthread_mutex_unlock(&clients_mutex);
+// Unpredictable id that lands in the calling receiver's own registry shard.
+// The tail picks the shard (client_shard_of), so move it onto the nearest
+// value in this shard's residue class instead of drawing until one fits.
+int generate_client_id(uint8_t *client_id, int shard) {
+    if (random_bytes(client_id, 16) != 0)
+        return -1;
+
+    uint64_t tail = ((uint32_t)client_id[12] << 24) | ((uint32_t)client_id[13] << 16) |
+                    ((uint32_t)client_id[14] << 8) | client_id[15];
+    tail = tail - tail % shard_count + shard;
+    if (tail > UINT32_MAX)
+        tail -= shard_count;
+
+    client_id[12] = (uint8_t)(tail >> 24);
+    client_id[13] = (uint8_t)(tail >> 16);
+    client_id[14] = (uint8_t)(tail >> 8);
+    client_id[15] = (uint8_t)tail;
+    return 0;
 }
 
+// Ticks the per-shard expiry wheels (each tick only visits clients that are
+// due), drops transfer tokens nobody connected with and hangs up on
+// connections that never sent their header
 void *watcher_thread(void *arg) {
     (void)arg;
     while (1) {
-        cleanup_dead_clients(HEARTBEAT_TIMEOUT);
-        sleep(HEARTBEAT_INTERVAL);
-    }
-    return NULL;
-}
-
-void *processing_thread(void *arg) {
-    int sockfd = *(int *)arg;
-    while (1) {
-        process_pending_jobs(sockfd);
+        client_registry_expire();
+        upload_expire_tokens(time(NULL));
+        download_expire_tokens(time(NULL));
+        handshake_expire(time(NULL));
         sleep(1);
     }
     return NULL;
 }
-
-void *download_thread(void *arg) {
-    int sockfd = *(int *)arg;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    
-    while (1) {
-        int client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_fd < 0) {
-            perror("[DEBUG] Download accept failed");
-            continue;
-        }
-        
-        printf("[DEBUG] Accepted download connection from %s:%d\n",
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        // Wait for a download job
-        pthread_mutex_lock(&download_queue.mutex);
-        while (download_queue.size == 0) {
-            pthread_cond_wait(&download_queue.cond, &download_queue.mutex);
-        }
-        
-        DownloadJob job = download_queue.jobs[0];
-        memmove(&download_queue.jobs[0], &download_queue.jobs[1],
-                (download_queue.size - 1) * sizeof(DownloadJob));
-        download_queue.size--;
-        
-        pthread_mutex_unlock(&download_queue.mutex);
-        
-        // Verify client IP and client_id
-        int client_valid = 0;
-        pthread_mutex_lock(&clients_mutex);
-        for (size_t i = 0; i < client_count; i++) {
-            if (memcmp(clients[i].client_id, job.client_id, 16) == 0 &&
-                clients[i].addr.sin_addr.s_addr == client_addr.sin_addr.s_addr) {
-                client_valid = 1;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&clients_mutex);
-        
-        if (!client_valid) {
-            printf("[DEBUG] Invalid client for download: expected client_id=%02x%02x, IP=%s, got IP=%s:%d\n",
-                   job.client_id[0], job.client_id[1],
-                   inet_ntoa(job.client_addr.sin_addr),
-                   inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            close(client_fd);
-            continue;
-        }
-        
-        // Send file
-        char file_path[512];
-        snprintf(file_path, sizeof(file_path), "processing/%02x%02x_%08x/%s",
-                 job.client_id[0], job.client_id[1], job.job_id, job.filename);
-        
-        printf("[DEBUG] Sending file: %s for job_id=%u\n", file_path, job.job_id);
-        
-        int file_fd = open(file_path, O_RDONLY);
-        if (file_fd < 0) {
-            perror("[DEBUG] open failed");
-            close(client_fd);
-            continue;
-        }
-        
-        uint8_t buffer[4096];
-        ssize_t bytes_read;
-        while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
-            if (send(client_fd, buffer, bytes_read, 0) != bytes_read) {
-                perror("[DEBUG] send failed");
-                break;
-            }
-        }
-        
-        close(file_fd);
-        close(client_fd);
-        printf("[DEBUG] File transfer complete for job_id=%u, filename=%s\n",
-               job.job_id, job.filename);
-    }
-    return NULL;
-}
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# A striped upload interrupted with one stripe short leaves a hole below
+# what the later stripes wrote. The retried UPLOAD_REQ must resume at the
+# end of the complete prefix, not at the furthest byte written, and the
+# file must come out byte for byte. Run once with the short stripe gone
+# before the retry, once with it still connected when the retry arrives,
+# as a client whose stripes timed out would leave it, and once with it
+# held open until the resumed stripes are done, where the file must still
+# be counted and its job run without waiting on the stale connection.
+#
+# Usage: upload-striped-resume.py <server binary>
+
+import hashlib
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVER = ("127.0.0.1", 5555)
+STRIPES = 4
+STRIPE_MIN = 4 << 20    # UPLOAD_STRIPE_MIN in upload_handler.c
+
+# MessageType in protocol.h
+CLIENT_ID_REQ, JOB_REQ, JOB_ACK, UPLOAD_REQ, UPLOAD_ACK, JOB_RESULT = 1, 4, 5, 6, 7, 8
+JOB_TIMEOUT = 15
+
+
+def register(proc, udp):
+    # The UDP shards come up after the TCP listeners, so retry until one answers
+    for _ in range(50):
+        if proc.poll() is not None:
+            sys.exit("server exited with status %d" % proc.returncode)
+        udp.sendto(struct.pack("<BxxxI", CLIENT_ID_REQ, 1), SERVER)
+        try:
+            reply, _ = udp.recvfrom(2048)
+            return reply[8:24]
+        except socket.timeout:
+            pass
+    sys.exit("server did not answer CLIENT_ID_REQ")
+
+
+def receive(udp, kind):
+    # Skip whatever else the server has to say, a JOB_RESULT of an earlier
+    # case included
+    while True:
+        reply, _ = udp.recvfrom(2048)
+        if reply[0] == kind:
+            return reply
+
+
+def request(udp, payload, kind):
+    udp.sendto(payload, SERVER)
+    return receive(udp, kind)
+
+
+def upload_request(udp, message_id, client_id, job_id, name, data):
+    digest = hashlib.sha256(data).digest()
+    reply = request(udp, struct.pack("<BxxxI16sIxxxxQHBB32s4x", UPLOAD_REQ, message_id,
+                                     client_id, job_id, len(data), len(name), STRIPES, 1,
+                                     digest) + name, UPLOAD_ACK)
+    return struct.unpack_from("<QQB", reply, 24)
+
+
+# upload_stripe_range in protocol.h
+def stripe_range(offset, size, stripes, i):
+    per = (size - offset) // stripes
+    start = offset + per * i
+    return start, (size - start if i == stripes - 1 else per)
+
+
+def send_stripe(token, stripe, payload):
+    tcp = socket.create_connection(SERVER)
+    tcp.sendall(struct.pack("<QI4x", token, stripe) + payload)
+    return tcp
+
+
+def wait_for_file(path, data):
+    # Counted files are only written by the server's upload workers; give
+    # them a moment to drain the last stripe
+    for _ in range(50):
+        try:
+            with open(path, "rb") as f:
+                if f.read() == data:
+                    return True
+        except FileNotFoundError:
+            pass
+        time.sleep(0.1)
+    return False
+
+
+def wait_for_job(udp, job_id):
+    deadline = time.time() + JOB_TIMEOUT
+    while time.time() < deadline:
+        try:
+            reply = receive(udp, JOB_RESULT)
+        except socket.timeout:
+            continue
+        result_job, status = struct.unpack_from("<IB", reply, 24)
+        if result_job == job_id:
+            return status
+    return None
+
+
+# close_short: "before" the retry, "after-retry" request, or "after-finish"
+# of the resumed stripes
+def interrupted_upload(udp, message_id, client_id, job_id, name, data, close_short):
+    token, offset, stripes = upload_request(udp, message_id, client_id, job_id, name, data)
+    if offset != 0 or stripes != STRIPES:
+        sys.exit("fresh upload got offset %d, %d stripes" % (offset, stripes))
+
+    # Stripe 0 sends half its range and stalls; the rest finish
+    start, length = stripe_range(0, len(data), stripes, 0)
+    short = send_stripe(token, 0, data[start:start + length // 2])
+    for i in range(1, stripes):
+        start, length = stripe_range(0, len(data), stripes, i)
+        send_stripe(token, i, data[start:start + length]).close()
+    time.sleep(1)
+    if close_short == "before":
+        short.close()
+        time.sleep(1)
+
+    token, offset, stripes = upload_request(udp, message_id + 1, client_id, job_id, name, data)
+    if close_short == "after-retry":
+        short.close()
+    hole = stripe_range(0, len(data), STRIPES, 0)[1] // 2
+    if offset > hole:
+        sys.exit("FAIL: retry resumed at %d, past the hole at %d" % (offset, hole))
+    if close_short == "before" and offset != hole:
+        sys.exit("FAIL: retry resumed at %d, not at the end of the prefix %d" % (offset, hole))
+
+    for i in range(stripes):
+        start, length = stripe_range(offset, len(data), stripes, i)
+        send_stripe(token, i, data[start:start + length]).close()
+    return short
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s <server binary>" % sys.argv[0])
+    binary = os.path.abspath(sys.argv[1])
+    workdir = tempfile.mkdtemp(prefix="upload-striped-resume.")
+    proc = subprocess.Popen([binary, "-w", "1"], cwd=workdir,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        udp.settimeout(0.2)
+        client_id = register(proc, udp)
+        udp.settimeout(3)
+
+        processing = os.path.join(workdir, "processing")
+        cases = [(b"a.bin", 10, "before"), (b"b.bin", 20, "after-retry"),
+                 (b"c.bin", 30, "after-finish")]
+        for name, message_id, close_short in cases:
+            # One job per case, so each one's JOB_RESULT says its file was counted
+            job_id = (int(time.time()) + message_id) & 0xffffffff
+            command = b"test -s " + name
+            request(udp, struct.pack("<BxxxI16sIBxH", JOB_REQ, message_id - 1, client_id,
+                                     job_id, 1, len(command)) + command, JOB_ACK)
+
+            data = os.urandom(STRIPES * STRIPE_MIN)
+            short = interrupted_upload(udp, message_id, client_id, job_id, name, data,
+                                       close_short)
+            status = wait_for_job(udp, job_id)
+            short.close()
+            if status is None:
+                sys.exit("FAIL: job for %s did not run within %d s" % (name.decode(), JOB_TIMEOUT))
+            if status != 0:
+                sys.exit("FAIL: job for %s finished with status %d" % (name.decode(), status))
+
+            job_dir = [d for d in os.listdir(processing) if d.endswith("%08x" % job_id)][0]
+            if not wait_for_file(os.path.join(processing, job_dir, name.decode()), data):
+                sys.exit("FAIL: resumed %s differs from what was sent" % name.decode())
+        print("ok")
+    finally:
+        proc.terminate()
+        proc.wait()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
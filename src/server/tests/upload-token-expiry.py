@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# An UPLOAD_REQ that is answered but never used must not cost the file it
+# names: the client asks twice, uploads on the second token, and the first
+# token expiring afterwards has to leave both the job's copy and the blob
+# store's copy whole.
+#
+# Usage: upload-token-expiry.py <server binary>
+
+import hashlib
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVER = ("127.0.0.1", 5555)
+TOKEN_TTL = 60          # UPLOAD_TOKEN_TTL in upload_handler.c
+
+CLIENT_ID_REQ, JOB_REQ, UPLOAD_REQ = 1, 4, 6      # MessageType in protocol.h
+
+
+def register(proc, udp):
+    # The UDP shards come up after the TCP listeners, so retry until one answers
+    for _ in range(50):
+        if proc.poll() is not None:
+            sys.exit("server exited with status %d" % proc.returncode)
+        udp.sendto(struct.pack("<BxxxI", CLIENT_ID_REQ, 1), SERVER)
+        try:
+            reply, _ = udp.recvfrom(2048)
+            return reply[8:24]
+        except socket.timeout:
+            pass
+    sys.exit("server did not answer CLIENT_ID_REQ")
+
+
+def request(udp, payload):
+    udp.sendto(payload, SERVER)
+    reply, _ = udp.recvfrom(2048)
+    return reply
+
+
+def upload_request(udp, message_id, client_id, job_id, name, data):
+    digest = hashlib.sha256(data).digest()
+    reply = request(udp, struct.pack("<BxxxI16sIxxxxQHBB32s4x", UPLOAD_REQ, message_id,
+                                     client_id, job_id, len(data), len(name), 1, 1,
+                                     digest) + name)
+    return struct.unpack_from("<QQ", reply, 24)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s <server binary>" % sys.argv[0])
+    binary = os.path.abspath(sys.argv[1])
+    workdir = tempfile.mkdtemp(prefix="upload-token-expiry.")
+    proc = subprocess.Popen([binary, "-w", "1"], cwd=workdir,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        udp.settimeout(0.2)
+        client_id = register(proc, udp)
+        udp.settimeout(3)
+
+        job_id = int(time.time()) & 0xffffffff
+        # Two inputs, only one ever sent, so the job stays pending throughout
+        command = b"cat in.bin other.bin"
+        request(udp, struct.pack("<BxxxI16sIBxH", JOB_REQ, 2, client_id, job_id, 2,
+                                 len(command)) + command)
+
+        name = b"in.bin"
+        data = os.urandom(1 << 20)
+        upload_request(udp, 3, client_id, job_id, name, data)      # never used
+        token, offset = upload_request(udp, 4, client_id, job_id, name, data)
+        if offset != 0:
+            sys.exit("fresh upload got offset %d" % offset)
+
+        tcp = socket.create_connection(SERVER)
+        tcp.sendall(struct.pack("<QI4x", token, 0) + data)
+        tcp.close()
+
+        print("waiting %d s for the unused token to expire" % (TOKEN_TTL + 5))
+        time.sleep(TOKEN_TTL + 5)
+
+        processing = os.path.join(workdir, "processing")
+        job_dir = [d for d in os.listdir(processing) if d.endswith("%08x" % job_id)][0]
+        with open(os.path.join(processing, job_dir, "in.bin"), "rb") as f:
+            if f.read() != data:
+                sys.exit("FAIL: job input changed after the unused token expired")
+        blob = os.path.join(processing, ".store", hashlib.sha256(data).hexdigest())
+        if os.path.exists(blob) and os.path.getsize(blob) != len(data):
+            sys.exit("FAIL: stored blob changed after the unused token expired")
+        print("ok")
+    finally:
+        proc.terminate()
+        proc.wait()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
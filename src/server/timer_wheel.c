@@ -0,0 +1,137 @@
+#include "timer_wheel.h"
+
+#define LEVEL_SPAN(l) ((uint64_t)1 << (TIMER_WHEEL_BITS * (l)))
+
+static void list_init(TimerNode *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_unlink(TimerNode *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node->prev = node;
+}
+
+static void list_append(TimerNode *head, TimerNode *node)
+{
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+void timer_wheel_init(TimerWheel *w, uint64_t now)
+{
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+		for (int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+			list_init(&w->slots[l][s]);
+	w->now = now;
+	w->count = 0;
+}
+
+void timer_node_init(TimerNode *node)
+{
+	list_init(node);
+	node->expires = 0;
+	node->armed = 0;
+}
+
+// Pick the level whose span covers the distance to expiry
+static void wheel_place(TimerWheel *w, TimerNode *node)
+{
+	uint64_t delta = node->expires - w->now;
+	int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level + 1))
+		level++;
+
+	// Anything beyond the top level waits in its last slot
+	if (delta >= LEVEL_SPAN(TIMER_WHEEL_LEVELS))
+		node->expires = w->now + LEVEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+
+	int slot = (node->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	list_append(&w->slots[level][slot], node);
+}
+
+// Arm or re-arm. A deadline that already passed fires on the next tick.
+void timer_wheel_arm(TimerWheel *w, TimerNode *node, uint64_t expires)
+{
+	if (node->armed)
+		list_unlink(node);
+	else
+		w->count++;
+
+	node->expires = expires > w->now ? expires : w->now + 1;
+	node->armed = 1;
+	wheel_place(w, node);
+}
+
+void timer_wheel_cancel(TimerWheel *w, TimerNode *node)
+{
+	if (!node->armed)
+		return;
+	list_unlink(node);
+	node->armed = 0;
+	w->count--;
+}
+
+// Re-spread one slot of an upper level over the levels below it
+static int cascade(TimerWheel *w, int level)
+{
+	int slot = (w->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	TimerNode *head = &w->slots[level][slot];
+	TimerNode pending;
+
+	list_init(&pending);
+	if (head->next != head) {
+		// Move the whole list aside first; wheel_place may append to head
+		pending.next = head->next;
+		pending.prev = head->prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		list_init(head);
+	}
+
+	while (pending.next != &pending) {
+		TimerNode *node = pending.next;
+		list_unlink(node);
+		wheel_place(w, node);
+	}
+	return slot;
+}
+
+/*
+ * Process every tick up to now and call expire() for each timer that came
+ * due. The node is unlinked before the callback, which may free it.
+ */
+size_t timer_wheel_advance(TimerWheel *w, uint64_t now, TimerExpireFn expire, void *ctx)
+{
+	size_t fired = 0;
+
+	while (w->now < now) {
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+
+		w->now++;
+
+		int slot = w->now & TIMER_WHEEL_MASK;
+		for (int l = 1; slot == 0 && l < TIMER_WHEEL_LEVELS; l++)
+			slot = cascade(w, l);
+
+		TimerNode *head = &w->slots[0][w->now & TIMER_WHEEL_MASK];
+		while (head->next != head) {
+			TimerNode *node = head->next;
+			list_unlink(node);
+			node->armed = 0;
+			w->count--;
+			fired++;
+			expire(node, ctx);
+		}
+	}
+	return fired;
+}
@@ -0,0 +1,43 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+/*
+ * Intrusive timer. Embed it in (or point it at) the object that owns the
+ * deadline; the wheel only links and unlinks it.
+ */
+typedef struct timer_node {
+	struct timer_node *next;
+	struct timer_node *prev;
+	uint64_t expires;   // Absolute tick
+	int armed;
+} TimerNode;
+
+/*
+ * Hierarchical timing wheel: level l has 64 slots of 64^l ticks each, so
+ * four levels cover 2^24 ticks. Arming and cancelling are O(1); advancing
+ * only touches the slot that is due plus the occasional cascade from the
+ * level above.
+ */
+typedef struct {
+	TimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // List heads
+	uint64_t now;       // Last tick processed
+	size_t count;
+} TimerWheel;
+
+typedef void (*TimerExpireFn)(TimerNode *node, void *ctx);
+
+void timer_wheel_init(TimerWheel *w, uint64_t now);
+void timer_node_init(TimerNode *node);
+void timer_wheel_arm(TimerWheel *w, TimerNode *node, uint64_t expires);
+void timer_wheel_cancel(TimerWheel *w, TimerNode *node);
+size_t timer_wheel_advance(TimerWheel *w, uint64_t now, TimerExpireFn expire, void *ctx);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,62 @@
+#include "token_table.h"
+
+#include <stdlib.h>
+#include <sys/random.h>
+
+int token_table_init(TokenTable *t)
+{
+	return open_table_init(t, sizeof(uint64_t), sizeof(TokenEntry));
+}
+
+void token_table_free(TokenTable *t)
+{
+	open_table_free(t);
+}
+
+// Unpredictable so a peer can't claim someone else's transfer
+static uint64_t random_token(void)
+{
+	uint64_t token = 0;
+
+	while (token == 0) {
+		if (getrandom(&token, sizeof(token), 0) != sizeof(token))
+			token = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+	}
+	return token;
+}
+
+// Store value under a fresh token. Returns the token, or 0 on failure.
+uint64_t token_table_issue(TokenTable *t, void *value)
+{
+	TokenEntry *entry;
+	int created;
+
+	do {
+		uint64_t token = random_token();
+		entry = open_table_insert(t, &token, &created);
+		if (!entry)
+			return 0;
+	} while (!created);
+
+	entry->value = value;
+	return entry->token;
+}
+
+void *token_table_find(TokenTable *t, uint64_t token)
+{
+	TokenEntry *entry = open_table_find(t, &token);
+	return entry ? entry->value : NULL;
+}
+
+// Remove the token and return what it pointed to, or NULL if unknown
+void *token_table_take(TokenTable *t, uint64_t token)
+{
+	TokenEntry entry;
+	return open_table_remove(t, &token, &entry) ? entry.value : NULL;
+}
+
+// Cursor iteration as in open_table_next; taking the entry just returned is allowed
+TokenEntry *token_table_next(TokenTable *t, size_t *cursor)
+{
+	return open_table_next(t, cursor);
+}
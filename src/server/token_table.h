@@ -0,0 +1,27 @@
+#ifndef TOKEN_TABLE_H
+#define TOKEN_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "open_table.h"
+
+typedef struct {
+	uint64_t token;
+	void *value;
+} TokenEntry;
+
+/*
+ * Session tokens to the transfer waiting for each, keyed by the 64-bit
+ * token TokenEntry starts with. Tokens are random and never 0. Not
+ * thread-safe, the owner holds its queue lock.
+ */
+typedef OpenTable TokenTable;
+
+int token_table_init(TokenTable *t);
+void token_table_free(TokenTable *t);
+uint64_t token_table_issue(TokenTable *t, void *value);
+void *token_table_find(TokenTable *t, uint64_t token);
+void *token_table_take(TokenTable *t, uint64_t token);
+TokenEntry *token_table_next(TokenTable *t, size_t *cursor);
+
+#endif // TOKEN_TABLE_H
@@ -0,0 +1,72 @@
+#include "transfer_stats.h"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+static TransferCounters counters[XFER_KINDS];
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *kind_names[XFER_KINDS] = { "Uploads", "Downloads" };
+
+uint64_t transfer_clock_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t bytes_per_sec(uint64_t bytes, uint64_t usec)
+{
+	if (usec == 0)
+		usec = 1;
+	return bytes * 1000000 / usec;
+}
+
+// Account one finished transfer of bytes that took usec
+void transfer_stats_record(TransferKind kind, uint64_t bytes, uint64_t usec, int fallback)
+{
+	uint64_t rate = bytes_per_sec(bytes, usec);
+
+	pthread_mutex_lock(&stats_mutex);
+	TransferCounters *c = &counters[kind];
+	c->transfers++;
+	c->bytes += bytes;
+	c->busy_usec += usec;
+	c->last_bytes_per_sec = rate;
+	if (rate > c->peak_bytes_per_sec)
+		c->peak_bytes_per_sec = rate;
+	if (fallback)
+		c->fallbacks++;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+void transfer_stats_snapshot(TransferKind kind, TransferCounters *out)
+{
+	pthread_mutex_lock(&stats_mutex);
+	*out = counters[kind];
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+// Human-readable report for the admin SHOW_STATS command
+size_t transfer_stats_format(char *buf, size_t len)
+{
+	size_t offset = 0;
+
+	for (int k = 0; k < XFER_KINDS && offset < len; k++) {
+		TransferCounters c;
+		transfer_stats_snapshot(k, &c);
+
+		offset += snprintf(buf + offset, len - offset,
+				"%s: %llu transfers, %llu bytes, %llu fell back to copy\n"
+				"    Average: %.1f MB/s, last: %.1f MB/s, peak: %.1f MB/s\n",
+				kind_names[k],
+				(unsigned long long)c.transfers,
+				(unsigned long long)c.bytes,
+				(unsigned long long)c.fallbacks,
+				bytes_per_sec(c.bytes, c.busy_usec) / 1e6,
+				c.last_bytes_per_sec / 1e6,
+				c.peak_bytes_per_sec / 1e6);
+	}
+	return offset < len ? offset : len - 1;
+}
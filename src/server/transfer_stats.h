@@ -0,0 +1,31 @@
+#ifndef TRANSFER_STATS_H
+#define TRANSFER_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+	XFER_UPLOAD,
+	XFER_DOWNLOAD,
+	XFER_KINDS
+} TransferKind;
+
+/*
+ * Running totals per direction. Only time spent inside a transfer counts,
+ * so bytes / busy_usec is the throughput the data path actually achieves.
+ */
+typedef struct {
+	uint64_t transfers;
+	uint64_t bytes;
+	uint64_t busy_usec;
+	uint64_t last_bytes_per_sec;
+	uint64_t peak_bytes_per_sec;
+	uint64_t fallbacks;     // Transfers that had to use the copy loop
+} TransferCounters;
+
+uint64_t transfer_clock_usec(void);
+void transfer_stats_record(TransferKind kind, uint64_t bytes, uint64_t usec, int fallback);
+void transfer_stats_snapshot(TransferKind kind, TransferCounters *out);
+size_t transfer_stats_format(char *buf, size_t len);
+
+#endif // TRANSFER_STATS_H
@@ -0,0 +1,130 @@
+#include "udp_batch.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+int udp_batch_size = UDP_BATCH_SIZE;
+int udp_flush_usec = UDP_FLUSH_USEC;
+
+int udp_batch_init(UdpBatch *b, int sockfd, int capacity)
+{
+	memset(b, 0, sizeof(*b));
+	b->sockfd = sockfd;
+	b->capacity = capacity;
+
+	b->rx_msgs = calloc(capacity, sizeof(struct mmsghdr));
+	b->rx_iov = calloc(capacity, sizeof(struct iovec));
+	b->rx_addrs = calloc(capacity, sizeof(struct sockaddr_in));
+	b->rx_bufs = malloc(capacity * sizeof(*b->rx_bufs));
+	b->tx_msgs = calloc(capacity, sizeof(struct mmsghdr));
+	b->tx_iov = calloc(capacity, sizeof(struct iovec));
+	b->tx_addrs = calloc(capacity, sizeof(struct sockaddr_in));
+	b->tx_bufs = malloc(capacity * sizeof(*b->tx_bufs));
+	if (!b->rx_msgs || !b->rx_iov || !b->rx_addrs || !b->rx_bufs ||
+			!b->tx_msgs || !b->tx_iov || !b->tx_addrs || !b->tx_bufs) {
+		LOG_ERROR("UDP batch allocation failed");
+		return -1;
+	}
+
+	b->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (b->timer_fd < 0) {
+		LOG_ERRNO("timerfd_create failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Drain up to capacity datagrams in one syscall. Returns the count, 0 if none.
+int udp_batch_recv(UdpBatch *b)
+{
+	for (int i = 0; i < b->capacity; i++) {
+		// Keep one spare byte so handlers can NUL-terminate trailing strings
+		b->rx_iov[i].iov_base = b->rx_bufs[i];
+		b->rx_iov[i].iov_len = UDP_MAX_DATAGRAM - 1;
+		b->rx_msgs[i].msg_hdr.msg_iov = &b->rx_iov[i];
+		b->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		b->rx_msgs[i].msg_hdr.msg_name = &b->rx_addrs[i];
+		b->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	int n = recvmmsg(b->sockfd, b->rx_msgs, b->capacity, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			LOG_ERRNO("recvmmsg failed");
+		return 0;
+	}
+	return n;
+}
+
+// Queue a reply; the payload is copied so the caller may free it right away
+void udp_batch_reply(UdpBatch *b, const void *buf, size_t len, const struct sockaddr_in *addr)
+{
+	if (len > UDP_MAX_DATAGRAM) {
+		LOG_ERROR("UDP reply too large: %zu bytes", len);
+		return;
+	}
+
+	if (b->tx_count == b->capacity)
+		udp_batch_flush(b);
+
+	int i = b->tx_count++;
+	memcpy(b->tx_bufs[i], buf, len);
+	b->tx_addrs[i] = *addr;
+	b->tx_iov[i].iov_base = b->tx_bufs[i];
+	b->tx_iov[i].iov_len = len;
+	memset(&b->tx_msgs[i], 0, sizeof(struct mmsghdr));
+	b->tx_msgs[i].msg_hdr.msg_iov = &b->tx_iov[i];
+	b->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+	b->tx_msgs[i].msg_hdr.msg_name = &b->tx_addrs[i];
+	b->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+}
+
+void udp_batch_flush(UdpBatch *b)
+{
+	int sent = 0;
+
+	while (sent < b->tx_count) {
+		int n = sendmmsg(b->sockfd, b->tx_msgs + sent, b->tx_count - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// Acks are best effort, like the sendto() they replace
+			LOG_ERRNO("sendmmsg failed");
+			break;
+		}
+		sent += n;
+	}
+	b->tx_count = 0;
+
+	if (b->timer_armed) {
+		struct itimerspec off = {0};
+		timerfd_settime(b->timer_fd, 0, &off, NULL);
+		b->timer_armed = 0;
+	}
+}
+
+// Called after a drain: flush now, or make sure the deadline timer is running
+void udp_batch_schedule_flush(UdpBatch *b)
+{
+	if (b->tx_count == 0)
+		return;
+
+	if (udp_flush_usec <= 0) {
+		udp_batch_flush(b);
+		return;
+	}
+
+	if (!b->timer_armed) {
+		struct itimerspec its = {0};
+		its.it_value.tv_sec = udp_flush_usec / 1000000;
+		its.it_value.tv_nsec = (udp_flush_usec % 1000000) * 1000L;
+		timerfd_settime(b->timer_fd, 0, &its, NULL);
+		b->timer_armed = 1;
+	}
+}
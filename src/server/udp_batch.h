@@ -0,0 +1,46 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define UDP_MAX_DATAGRAM 2048
+#define UDP_BATCH_SIZE   32     // Default datagrams per recvmmsg/sendmmsg
+#define UDP_BATCH_MAX    1024
+#define UDP_FLUSH_USEC   200    // Default longest time a queued ack may wait
+
+extern int udp_batch_size;
+extern int udp_flush_usec;
+
+/*
+ * Receive and send side of one UDP socket. Incoming datagrams are drained
+ * with recvmmsg; replies are copied into the outbox and leave in a single
+ * sendmmsg once the outbox fills or the flush deadline (timer_fd) fires.
+ */
+typedef struct {
+	int sockfd;
+	int timer_fd;
+	int capacity;
+	int timer_armed;
+
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iov;
+	struct sockaddr_in *rx_addrs;
+	uint8_t (*rx_bufs)[UDP_MAX_DATAGRAM];
+
+	struct mmsghdr *tx_msgs;
+	struct iovec *tx_iov;
+	struct sockaddr_in *tx_addrs;
+	uint8_t (*tx_bufs)[UDP_MAX_DATAGRAM];
+	int tx_count;
+} UdpBatch;
+
+int udp_batch_init(UdpBatch *b, int sockfd, int capacity);
+int udp_batch_recv(UdpBatch *b);
+void udp_batch_reply(UdpBatch *b, const void *buf, size_t len, const struct sockaddr_in *addr);
+void udp_batch_flush(UdpBatch *b);
+void udp_batch_schedule_flush(UdpBatch *b);
+
+#endif // UDP_BATCH_H
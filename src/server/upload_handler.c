@@ -1,7 +1,15 @@
 #include "upload_handler.h"
 #include "job_handler.h"
+#include "processing.h"
 #include "common.h"
 #include "server.h"
+#include "worker_pool.h"
+#include "transfer_stats.h"
+#include "admin_handler.h"
+#include "token_table.h"
+#include "handshake.h"
+#include "blob_store.h"
+#include "fair_queue.h"
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -11,324 +19,1037 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#define INGEST_PIPE_SIZE (1024 * 1024)     // Requested pipe capacity for splice
+#define INGEST_BUFFER    (1024 * 1024)     // Copy-loop buffer, page aligned
+#define UPLOAD_TOKEN_TTL 60                 // Seconds a client has to connect
+#define UPLOAD_IDLE_TIMEOUT 30              // Seconds a stripe may go without data
+#define UPLOAD_MAX_STRIPES 8
+#define UPLOAD_STRIPE_MIN (4 * 1024 * 1024)  // Smallest range worth its own connection
+#define UPLOAD_AGING_RATE (32.0 * 1024 * 1024)  // Bytes of size one second of waiting makes up for
+#define UPLOAD_SETTLE_WORKERS 2             // Threads hashing and settling finished attempts
+#define UPLOAD_REQUEST_WORKERS 2            // Threads opening attempts for UPLOAD_REQs
 
 typedef struct {
     uint8_t client_id[16];
     uint32_t job_id;
     char filename[MAX_FILENAME_LEN];
     uint64_t file_size;
+    uint64_t offset;            // Complete prefix already on disk; the client sends the rest
     time_t arrival_time;
-    double priority;
+    double deadline;            // Heap key, see upload_deadline
+    uint64_t seq;               // Enqueue order, breaks deadline ties first come first served
+    uint64_t token;
+    int stripes;                // Granted in UPLOAD_ACK
+    struct UploadFile *file;
+    int stripe;                 // This connection's range
+    int fd;                     // Set once the client connected with the token
+    struct sockaddr_in peer;
+    int has_hash;               // Client sent content_hash; store the file once verified
+    uint8_t content_hash[SHA256_DIGEST_LEN];
 } UploadJob;
 
+/*
+ * One attempt at a file: an UPLOAD_REQ and the stripes (TCP connections)
+ * carrying its byte ranges. Whoever drops the last reference decides
+ * whether the file arrived whole. A newer UPLOAD_REQ for the same file
+ * supersedes the attempt: its connected stripes are shut down, and it
+ * settles nothing. The successor either resumes the same content, where a
+ * late write of the old attempt's puts back the bytes already there, or
+ * starts over on a fresh inode the old stripes never see.
+ */
+typedef struct UploadFile {
+    pthread_mutex_t lock;
+    int refs;                   // Running stripes, plus one while the token is pending
+    uint32_t connected;         // Bitmask of stripes that showed up
+    uint64_t received[UPLOAD_MAX_STRIPES];
+    int fds[UPLOAD_MAX_STRIPES];    // Connected stripes' sockets, -1 once closed
+    UploadJob *job;             // The request as granted; owned by the attempt
+    int superseded;
+    int retired;                // Ended short; kept only for the prefix it holds
+} UploadFile;
+
+// attempts key; zero-padded, so filename compares as fixed-size bytes
+typedef struct {
+    uint8_t client_id[16];
+    uint32_t job_id;
+    char filename[MAX_FILENAME_LEN];
+} UploadKey;
+
 typedef struct {
-    UploadJob *jobs;
-    int size;
-    int capacity;
+    UploadKey key;
+    UploadFile *file;
+    int busy;                   // Someone is working on the file outside the mutex
+} UploadEntry;
+
+// An UPLOAD_REQ on its way from the reactor to request_pool
+typedef struct {
+    UploadRequest req;
+    char filename[MAX_FILENAME_LEN];
+    struct sockaddr_in client_addr;
+} UploadRequestTask;
+
+// Connected uploads waiting for a slot, one heap on (deadline, seq) per client
+typedef struct {
+    FairQueue clients;
+    uint64_t next_seq;
     pthread_mutex_t mutex;
+    pthread_cond_t unclaimed;   // An attempts entry stopped being busy
 } UploadQueue;
 
-static void *upload_thread_func(void *arg);
-static void process_upload(UploadJob *job);
+static void upload_session(void *arg);
+static uint64_t process_upload(UploadJob *job);
+static void release_upload_file(UploadFile *file);
+static int upload_before(const void *a, const void *b);
+static double upload_cost(const void *job);
 
-extern pthread_mutex_t jobs_mutex;
-extern size_t job_count;
-extern PendingJob *pending_jobs;
 
+/*
+ * An UPLOAD_REQ parks its job in pending_uploads under a fresh token. When
+ * the client connects and sends that token, the job moves to upload_queue.
+ * Free slots go to clients in weighted round robin, each one starting its
+ * own most urgent upload, so a client with hundreds queued can't crowd
+ * out the rest. attempts holds the newest attempt at each file, live or
+ * retired. All three, plus active_uploads, are guarded by
+ * upload_queue.mutex. Work on the file itself happens outside it, with
+ * the file's attempts entry marked busy so nobody else touches the file
+ * meanwhile. An attempt whose last stripe is done goes to settle_pool, so
+ * hashing it never holds an upload slot, and UPLOAD_REQs are answered from
+ * request_pool, so the UDP reactors never wait on the filesystem.
+ */
 static UploadQueue upload_queue;
-static int tcp_listen_fd;
+static TokenTable pending_uploads;
+static OpenTable attempts;
+static WorkerPool upload_pool;
+static WorkerPool settle_pool;
+static WorkerPool request_pool;
 static int active_uploads = 0;
-static pthread_mutex_t active_uploads_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t upload_available = PTHREAD_COND_INITIALIZER;
-
-static pthread_t upload_threads[MAX_UPLOADS];
 
-void init_upload_handler(int listen_fd) {
-    tcp_listen_fd = listen_fd;
-    upload_queue.jobs = malloc(10 * sizeof(UploadJob));
-    upload_queue.capacity = 10;
-    upload_queue.size = 0;
+void init_upload_handler(void) {
+    fair_queue_init(&upload_queue.clients, upload_before, upload_cost, 1.0);
+    upload_queue.next_seq = 0;
     pthread_mutex_init(&upload_queue.mutex, NULL);
+    pthread_cond_init(&upload_queue.unclaimed, NULL);
+
+    if (token_table_init(&pending_uploads) != 0) {
+        LOG_ERROR("Failed to allocate upload token table");
+        exit(EXIT_FAILURE);
+    }
+    if (open_table_init(&attempts, sizeof(UploadKey), sizeof(UploadEntry)) != 0) {
+        LOG_ERROR("Failed to allocate upload attempt table");
+        exit(EXIT_FAILURE);
+    }
 
-    printf("[DEBUG] Initializing upload handler, listen_fd=%d\n", listen_fd);
+    LOG_INFO("Initializing upload handler with %d workers", MAX_UPLOADS);
 
-    for (int i = 0; i < max_uploads; i++) {
-        printf("[DEBUG] Creating upload thread %d\n", i);
-        pthread_create(&upload_threads[i], NULL, upload_thread_func, NULL);
+    if (worker_pool_init(&upload_pool, MAX_UPLOADS) != 0 ||
+        worker_pool_init(&settle_pool, UPLOAD_SETTLE_WORKERS) != 0 ||
+        worker_pool_init(&request_pool, UPLOAD_REQUEST_WORKERS) != 0) {
+        LOG_ERROR("Failed to start upload workers");
+        exit(EXIT_FAILURE);
     }
 }
 
-static void *upload_thread_func(void *arg) {
-    (void)arg;
+/*
+ * Small files go first, but every second spent waiting is worth
+ * UPLOAD_AGING_RATE bytes, so a big upload's effective priority
+ *
+ *     wait - file_size / UPLOAD_AGING_RATE
+ *
+ * keeps climbing until it overtakes fresh small ones. Since all jobs age at
+ * the same rate, ordering by that at any instant is the same as ordering by
+ * this fixed deadline, smallest first, which lets a plain heap hold it.
+ */
+static double upload_deadline(const UploadJob *job) {
+    return (double)job->arrival_time + (double)job->file_size / UPLOAD_AGING_RATE;
+}
 
-    printf("[DEBUG] Upload thread started (tid=%lu)\n", pthread_self());
+static double upload_effective_priority(const UploadJob *job, time_t now) {
+    return (double)now - job->deadline;
+}
 
-    while (1) {
-        pthread_mutex_lock(&upload_queue.mutex);
+static int upload_before(const void *a, const void *b) {
+    const UploadJob *x = a, *y = b;
+    if (x->deadline != y->deadline)
+        return x->deadline < y->deadline;
+    return x->seq < y->seq;
+}
 
-        while (upload_queue.size == 0 || active_uploads >= max_uploads) {
-            printf("[DEBUG] Thread %lu waiting: queue size=%d, active_uploads=%d\n",
-                   pthread_self(), upload_queue.size, active_uploads);
-            pthread_cond_wait(&upload_available, &upload_queue.mutex);
-        }
+// Every connection holds one slot, whatever its size
+static double upload_cost(const void *job) {
+    (void)job;
+    return 1.0;
+}
 
-        UploadJob job = upload_queue.jobs[0];
-        memmove(&upload_queue.jobs[0], &upload_queue.jobs[1],
-               (upload_queue.size - 1) * sizeof(UploadJob));
-        upload_queue.size--;
+// Caller holds upload_queue.mutex
+static int enqueue_upload(const UploadJob *job) {
+    UploadJob *queued = malloc(sizeof(UploadJob));
+    if (!queued)
+        return -1;
+    *queued = *job;
+    queued->seq = upload_queue.next_seq++;
+    if (fair_queue_push(&upload_queue.clients, job->client_id, queued) != 0) {
+        free(queued);
+        return -1;
+    }
+
+    LOG_DEBUG("Job enqueued: job_id=%u, filename=%s, queue size=%zu",
+           job->job_id, job->filename, upload_queue.clients.count);
+    return 0;
+}
+
+/*
+ * A stripe whose client vanished, say a connection left half-open by a
+ * network drop, must not hold its slot forever: reads give up after
+ * UPLOAD_IDLE_TIMEOUT without data, and keepalive probes or unacked
+ * sends find a dead peer within about the same time.
+ */
+static void bound_upload_socket(int fd) {
+    struct timeval tv = { .tv_sec = UPLOAD_IDLE_TIMEOUT, .tv_usec = 0 };
+    int on = 1;
+    int idle = UPLOAD_IDLE_TIMEOUT / 3, interval = UPLOAD_IDLE_TIMEOUT / 6, probes = 3;
+    unsigned int user_timeout = UPLOAD_IDLE_TIMEOUT * 1000;
 
-        pthread_mutex_lock(&active_uploads_mutex);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+}
+
+// Forget the stripe's socket before closing it, so a supersede can't shut
+// down whatever reuses the descriptor
+static void close_stripe(UploadJob *job) {
+    pthread_mutex_lock(&job->file->lock);
+    job->file->fds[job->stripe] = -1;
+    pthread_mutex_unlock(&job->file->lock);
+    close(job->fd);
+}
+
+// Start queued uploads while slots are free. Caller holds upload_queue.mutex.
+static void dispatch_uploads(void) {
+    while (upload_queue.clients.count > 0 && active_uploads < max_uploads) {
+        UploadJob *job = fair_queue_pop(&upload_queue.clients);
+        if (!job)
+            return;
+
+        // A stripe of a superseded attempt would only find the flag and
+        // leave; don't spend a slot on it
+        pthread_mutex_lock(&job->file->lock);
+        int superseded = job->file->superseded;
+        pthread_mutex_unlock(&job->file->lock);
+        if (superseded || worker_pool_submit(&upload_pool, upload_session, job) != 0) {
+            close_stripe(job);
+            release_upload_file(job->file);
+            free(job);
+            continue;
+        }
         active_uploads++;
-        printf("[DEBUG] Thread %lu picked job: job_id=%u, filename=%s, active_uploads=%d\n",
-               pthread_self(), job.job_id, job.filename, active_uploads);
-        pthread_mutex_unlock(&active_uploads_mutex);
+        LOG_DEBUG("Started upload: job_id=%u, filename=%s, active_uploads=%d",
+               job->job_id, job->filename, active_uploads);
+    }
+}
+
+// By client, then in the order that client's uploads will start
+static int compare_uploads(const void *a, const void *b) {
+    const UploadJob *x = a, *y = b;
+    int by_client = memcmp(x->client_id, y->client_id, 16);
+    if (by_client != 0)
+        return by_client;
+    return upload_before(x, y) ? -1 : upload_before(y, x) ? 1 : 0;
+}
+
+// Copy of the waiting uploads for SHOW_UPLOADS
+size_t upload_queue_snapshot(UploadQueueEntry **entries) {
+    time_t now = time(NULL);
 
+    pthread_mutex_lock(&upload_queue.mutex);
+    size_t count = upload_queue.clients.count;
+    UploadJob *jobs = malloc((count ? count : 1) * sizeof(UploadJob));
+    void **queued = malloc((count ? count : 1) * sizeof(void *));
+    if (jobs && queued) {
+        count = fair_queue_items(&upload_queue.clients, queued, count);
+        for (size_t i = 0; i < count; i++)
+            jobs[i] = *(UploadJob *)queued[i];
+    }
+    pthread_mutex_unlock(&upload_queue.mutex);
+    free(queued);
+
+    *entries = malloc((count ? count : 1) * sizeof(UploadQueueEntry));
+    if (!jobs || !*entries) {
+        free(jobs);
+        free(*entries);
+        *entries = NULL;
+        return 0;
+    }
+
+    qsort(jobs, count, sizeof(UploadJob), compare_uploads);
+    for (size_t i = 0; i < count; i++) {
+        UploadQueueEntry *e = &(*entries)[i];
+        memcpy(e->client_id, jobs[i].client_id, 16);
+        e->job_id = jobs[i].job_id;
+        memcpy(e->filename, jobs[i].filename, sizeof(e->filename));
+        e->file_size = jobs[i].file_size;
+        e->stripe = jobs[i].stripe;
+        e->stripes = jobs[i].stripes;
+        e->wait = (double)(now - jobs[i].arrival_time);
+        e->priority = upload_effective_priority(&jobs[i], now);
+    }
+    free(jobs);
+    return count;
+}
+
+// Called after SET_MAX_UPLOADS so a raised limit takes effect right away
+void upload_limit_changed(void) {
+    pthread_mutex_lock(&upload_queue.mutex);
+    dispatch_uploads();
+    pthread_mutex_unlock(&upload_queue.mutex);
+}
+
+// Handshake finished: pair the connection with the upload its token names
+static void upload_connected(int fd, const struct sockaddr_in *addr, const TransferHeader *header,
+                             void *ctx) {
+    (void)ctx;
+
+    pthread_mutex_lock(&upload_queue.mutex);
+    UploadJob *pending = token_table_find(&pending_uploads, header->token);
+    // Range-check the stripe before it is used as a shift count
+    if (!pending || header->stripe >= (uint32_t)pending->stripes ||
+        (pending->file->connected & (1u << header->stripe))) {
         pthread_mutex_unlock(&upload_queue.mutex);
+        LOG_WARN("Rejecting upload connection from %s:%d: unknown token or stripe",
+               inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        close(fd);
+        return;
+    }
 
-        process_upload(&job);
+    UploadJob job = *pending;
+    job.stripe = header->stripe;
+    job.fd = fd;
+    job.peer = *addr;
+    bound_upload_socket(fd);
 
-        pthread_mutex_lock(&active_uploads_mutex);
-        active_uploads--;
-        printf("[DEBUG] Thread %lu finished job: job_id=%u, filename=%s, active_uploads=%d\n",
-               pthread_self(), job.job_id, job.filename, active_uploads);
-        pthread_cond_signal(&upload_available);
-        pthread_mutex_unlock(&active_uploads_mutex);
+    pthread_mutex_lock(&job.file->lock);
+    job.file->connected |= 1u << job.stripe;
+    job.file->fds[job.stripe] = fd;
+    job.file->refs++;
+    if (job.file->connected == (1u << job.stripes) - 1) {
+        // Every stripe is here; the token has done its job
+        token_table_take(&pending_uploads, header->token);
+        pending->token = 0;
+        job.file->refs--;
+    }
+    pthread_mutex_unlock(&job.file->lock);
+
+    if (enqueue_upload(&job) != 0) {
+        pthread_mutex_unlock(&upload_queue.mutex);
+        close_stripe(&job);
+        release_upload_file(job.file);
+        return;
     }
-    return NULL;
+    dispatch_uploads();
+    pthread_mutex_unlock(&upload_queue.mutex);
 }
 
-static void process_upload(UploadJob *job) {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    
-    // Find client address from PendingJob
-    pthread_mutex_lock(&jobs_mutex);
-    int found = 0;
-    for (size_t i = 0; i < job_count; i++) {
-        if (memcmp(pending_jobs[i].client_id, job->client_id, 16) == 0 &&
-            pending_jobs[i].job_id == job->job_id) {
-            client_addr = pending_jobs[i].client_addr;
-            found = 1;
-            break;
+// Reactor handler for the upload listen socket; ctx is the reactor
+void upload_accept(int listen_fd, uint32_t events, void *ctx) {
+    (void)events;
+
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &addr_len,
+                                SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERRNO("accept failed");
+            return;
         }
+
+        if (handshake_start(ctx, client_fd, &client_addr, upload_connected, NULL) != 0)
+            close(client_fd);
     }
-    pthread_mutex_unlock(&jobs_mutex);
-    
-    if (!found) {
-        fprintf(stderr, "[DEBUG] No job found for upload: job_id=%u\n", job->job_id);
-        return;
+}
+
+// One more input file is in place for the job; a retried upload of one
+// already counted changes nothing. hash is its content hash, if known.
+static void count_received_file(const uint8_t *client_id, uint32_t job_id, const char *filename,
+                                uint64_t size, const uint8_t *hash) {
+    // Shared lock on the table, the job's own lock for the counter
+    pthread_rwlock_rdlock(&jobs_lock);
+    PendingJob *pending = find_job(client_id, job_id);
+    if (pending) {
+        pthread_mutex_lock(&pending->lock);
+        int added = job_add_input(pending, filename, hash);
+        if (added > 0) {
+            pending->input_bytes += size;
+            pending->last_update = time(NULL);
+            LOG_DEBUG("Updated pending job: job_id=%u, files_received=%d",
+                   job_id, pending->files_received);
+        }
+        pthread_mutex_unlock(&pending->lock);
+        
+        // The last file wakes an executor immediately
+        if (added > 0)
+            dispatch_if_ready(pending);
     }
-    
-    printf("[DEBUG] process_upload: Waiting for client connection for job_id=%u, filename=%s from %s:%d\n",
-           job->job_id, job->filename, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-    
-    int client_fd = accept(tcp_listen_fd, (struct sockaddr *)&client_addr, &addr_len);
-    if (client_fd < 0) {
-        perror("[DEBUG] accept failed");
-        return;
+    pthread_rwlock_unlock(&jobs_lock);
+}
+
+// Whether filename already counts towards the job; -1 if there is no such job
+static int upload_file_counted(const uint8_t *client_id, uint32_t job_id, const char *filename) {
+    int counted = -1;
+
+    pthread_rwlock_rdlock(&jobs_lock);
+    PendingJob *pending = find_job(client_id, job_id);
+    if (pending) {
+        pthread_mutex_lock(&pending->lock);
+        counted = job_has_input(pending, filename);
+        pthread_mutex_unlock(&pending->lock);
     }
-    printf("[DEBUG] Accepted TCP connection from %s:%d for job_id=%u, filename=%s\n",
-           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), job->job_id, job->filename);
+    pthread_rwlock_unlock(&jobs_lock);
+    return counted;
+}
 
-    char dir_path[256];
-    snprintf(dir_path, sizeof(dir_path), "processing/%02x%02x_%08x",
-             job->client_id[0], job->client_id[1], job->job_id);
+// Whether the job's copy of filename is final: counted towards the job
+// (or the job is gone), or shared with the blob store. Such a file must
+// never be truncated or written into again.
+static int upload_file_settled(const uint8_t *client_id, uint32_t job_id, const char *filename,
+                               const char *file_path) {
+    struct stat st;
+
+    if (upload_file_counted(client_id, job_id, filename) != 0)
+        return 1;
+    return stat(file_path, &st) == 0 && st.st_nlink > 1;
+}
+
+// SHA-256 of a finished upload; -1 if the file couldn't be read
+static int hash_upload(const char *file_path, uint8_t *digest) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ok = sha256_fd(fd, digest) == 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void upload_key(UploadKey *key, const uint8_t *client_id, uint32_t job_id,
+                       const char *filename) {
+    memset(key, 0, sizeof(*key));
+    memcpy(key->client_id, client_id, 16);
+    key->job_id = job_id;
+    strncpy(key->filename, filename, sizeof(key->filename) - 1);
+}
+
+// Longest prefix of the file the attempt holds: everything before its
+// offset, then its stripes in order up to the first one that came up
+// short. A stripe still running counts for nothing yet. Caller holds
+// file->lock, or the last reference.
+static uint64_t upload_file_prefix(const UploadFile *file) {
+    const UploadJob *job = file->job;
+
+    for (int i = 0; i < job->stripes; i++) {
+        uint64_t start, len;
+        upload_stripe_range(job->offset, job->file_size, job->stripes, i, &start, &len);
+        if (file->received[i] < len)
+            return start + file->received[i];
+    }
+    return job->file_size;
+}
+
+static void free_upload_file(UploadFile *file) {
+    pthread_mutex_destroy(&file->lock);
+    free(file->job);
+    free(file);
+}
+
+// Caller holds upload_queue.mutex
+static void forget_upload_file(UploadFile *file) {
+    UploadKey key;
+    UploadEntry entry;
+
+    upload_key(&key, file->job->client_id, file->job->job_id, file->job->filename);
+    open_table_remove(&attempts, &key, &entry);
+}
+
+/*
+ * A newer attempt takes the file over from old: old's connected stripes
+ * are shut down (one still mid-splice may flush what its pipe holds,
+ * nothing more), queued ones find the flag when they start, and its token
+ * stops working. Caller holds upload_queue.mutex.
+ */
+static void supersede_upload_file(UploadFile *old) {
+    pthread_mutex_lock(&old->lock);
+    old->superseded = 1;
+    for (int i = 0; i < UPLOAD_MAX_STRIPES; i++)
+        if (old->fds[i] >= 0)
+            shutdown(old->fds[i], SHUT_RDWR);
+    int last = 0;
+    if (old->job->token) {
+        token_table_take(&pending_uploads, old->job->token);
+        old->job->token = 0;
+        last = --old->refs == 0;
+    }
+    // refs already at 0 means old is queued on settle_pool; it will see
+    // the flag and leave the file alone
+    pthread_mutex_unlock(&old->lock);
+
+    if (last)
+        free_upload_file(old);
+}
+
+/*
+ * Wait out whoever is working on key's file, then return its attempts
+ * entry, NULL if there is none. Caller holds upload_queue.mutex; waiting
+ * drops it, and entries move when the table grows, so the pointer is only
+ * good until the caller unlocks.
+ */
+static UploadEntry *wait_for_upload_key(const UploadKey *key) {
+    UploadEntry *entry;
+
+    while ((entry = open_table_find(&attempts, key)) && entry->busy)
+        pthread_cond_wait(&upload_queue.unclaimed, &upload_queue.mutex);
+    return entry;
+}
+
+/*
+ * The attempt's last reference is gone: count the file towards its job, or
+ * cut it back to the longest prefix that did arrive and keep the attempt
+ * as a record of that prefix, so the next UPLOAD_REQ resumes from there.
+ * An attempt superseded in the meantime leaves the file to its successor.
+ * Runs on settle_pool.
+ */
+static void finish_upload_file(void *arg) {
+    UploadFile *file = arg;
+    UploadJob *job = file->job;
+    uint64_t have = upload_file_prefix(file);
+    int retired = 0;
 
     char file_path[512];
-    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, job->filename);
-    int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file_fd < 0) {
-        perror("[DEBUG] open failed");
-        close(client_fd);
+    job_path(file_path, sizeof(file_path), job->client_id, job->job_id, job->filename);
+
+    // Hashed before counting, so the job can key the result cache on it
+    // without reading the file again
+    uint8_t digest[SHA256_DIGEST_LEN];
+    int hashed = have == job->file_size && job->has_hash &&
+                 hash_upload(file_path, digest) == 0;
+
+    UploadKey key;
+    upload_key(&key, job->client_id, job->job_id, job->filename);
+    pthread_mutex_lock(&upload_queue.mutex);
+    UploadEntry *entry = wait_for_upload_key(&key);
+    if (file->superseded) {
+        pthread_mutex_unlock(&upload_queue.mutex);
+        LOG_DEBUG("Upload attempt for job_id=%u, %s superseded; file left to its successor",
+               job->job_id, job->filename);
+        free_upload_file(file);
         return;
     }
-    printf("[DEBUG] Receiving file: %s (size=%lu bytes)\n", file_path, job->file_size);
+    // Not superseded, so the entry is still this attempt's
+    entry->busy = 1;
+    pthread_mutex_unlock(&upload_queue.mutex);
 
-    uint8_t buffer[4096];
-    ssize_t bytes_received;
-    uint64_t bytes_remaining = job->file_size;
-    uint64_t total_received = 0;
+    if (upload_file_settled(job->client_id, job->job_id, job->filename, file_path)) {
+        // Another path finished it; not this attempt's to cut back
+        LOG_DEBUG("Upload attempt for job_id=%u, %s ended with the file settled; left as is",
+               job->job_id, job->filename);
+    } else if (have < job->file_size) {
+        if (truncate(file_path, have) == 0) {
+            retired = 1;
+        } else {
+            // Without the cut the prefix on record would be a lie; start over
+            if (errno != ENOENT)
+                LOG_ERRNO("truncate of partial upload failed");
+            unlink(file_path);
+        }
+        LOG_WARN("Upload cut short for job_id=%u, %s: have %lu of %lu bytes",
+               job->job_id, job->filename, retired ? have : 0, job->file_size);
+    } else if (hashed && memcmp(digest, job->content_hash, SHA256_DIGEST_LEN) != 0) {
+        // Not the bytes the client hashed (a hole left by a lost stripe, or
+        // the file changed under it). The job must not run on them, and the
+        // blob store must not take them under someone else's hash; with the
+        // file gone the next UPLOAD_REQ starts again from 0.
+        LOG_WARN("Content hash mismatch for job_id=%u, %s; discarded",
+               job->job_id, job->filename);
+        if (unlink(file_path) != 0 && errno != ENOENT)
+            LOG_ERRNO("unlink of mismatched upload failed");
+    } else {
+        if (hashed)
+            blob_store_add(digest, file_path, job->file_size);
+        count_received_file(job->client_id, job->job_id, job->filename, job->file_size,
+                            hashed ? digest : NULL);
+    }
 
-    while (bytes_remaining > 0) {
-        size_t to_read = bytes_remaining > sizeof(buffer) ? sizeof(buffer) : (size_t)bytes_remaining;
-        bytes_received = recv(client_fd, buffer, to_read, 0);
+    pthread_mutex_lock(&upload_queue.mutex);
+    entry = open_table_find(&attempts, &key);
+    entry->busy = 0;
+    file->retired = retired;
+    if (!retired)
+        forget_upload_file(file);
+    pthread_cond_broadcast(&upload_queue.unclaimed);
+    pthread_mutex_unlock(&upload_queue.mutex);
+    if (!retired)
+        free_upload_file(file);
+}
 
-        if (bytes_received <= 0) {
-            if (bytes_received < 0) {
-                perror("[DEBUG] recv failed");
-            }
-            printf("[DEBUG] Connection closed or error during recv for job_id=%u\n", job->job_id);
-            break;
-        }
+// Drop a reference to the attempt; the last one hands it to settle_pool
+static void release_upload_file(UploadFile *file) {
+    pthread_mutex_lock(&file->lock);
+    int last = --file->refs == 0;
+    pthread_mutex_unlock(&file->lock);
+    // Left unsettled in attempts, the next UPLOAD_REQ still supersedes it
+    if (last && worker_pool_submit(&settle_pool, finish_upload_file, file) != 0)
+        LOG_ERROR("Failed to queue settling of %s for job_id=%u",
+               file->job->filename, file->job->job_id);
+}
+
+// Drop uploads whose client never (fully) connected, and the records of
+// retired attempts whose job is gone or already has the file
+void upload_expire_tokens(time_t now) {
+    TokenEntry *token;
+    UploadEntry *attempt;
+    size_t cursor = 0;
+
+    pthread_mutex_lock(&upload_queue.mutex);
+    while ((token = token_table_next(&pending_uploads, &cursor))) {
+        UploadJob *job = token->value;
+        if (now - job->arrival_time < UPLOAD_TOKEN_TTL)
+            continue;
+        LOG_WARN("Upload token expired: job_id=%u, filename=%s",
+               job->job_id, job->filename);
+        token_table_take(&pending_uploads, token->token);
+        job->token = 0;
+        release_upload_file(job->file);
+    }
+
+    cursor = 0;
+    while ((attempt = open_table_next(&attempts, &cursor))) {
+        UploadFile *file = attempt->file;
+        if (attempt->busy || !file->retired ||
+            upload_file_counted(file->job->client_id, file->job->job_id, file->job->filename) == 0)
+            continue;
+        forget_upload_file(file);
+        free_upload_file(file);
+    }
+    pthread_mutex_unlock(&upload_queue.mutex);
+}
 
-        if (write(file_fd, buffer, bytes_received) != bytes_received) {
-            perror("[DEBUG] write failed");
+static void upload_session(void *arg) {
+    UploadJob *job = arg;
+
+    uint64_t received = process_upload(job);
+
+    pthread_mutex_lock(&job->file->lock);
+    job->file->received[job->stripe] = received;
+    pthread_mutex_unlock(&job->file->lock);
+    release_upload_file(job->file);
+
+    pthread_mutex_lock(&upload_queue.mutex);
+    active_uploads--;
+    LOG_DEBUG("Thread %lu finished job: job_id=%u, filename=%s, active_uploads=%d",
+           pthread_self(), job->job_id, job->filename, active_uploads);
+    dispatch_uploads();
+    pthread_mutex_unlock(&upload_queue.mutex);
+    free(job);
+}
+
+// Copy loop for sockets splice can't read from
+static uint64_t ingest_copy(int client_fd, int file_fd, off_t offset, uint64_t size) {
+    uint8_t *buffer;
+    uint64_t total = 0;
+
+    if (posix_memalign((void **)&buffer, 4096, INGEST_BUFFER) != 0) {
+        LOG_ERRNO("posix_memalign failed");
+        return 0;
+    }
+
+    while (total < size) {
+        size_t want = size - total > INGEST_BUFFER ? INGEST_BUFFER : (size_t)(size - total);
+        ssize_t n = recv(client_fd, buffer, want, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                LOG_ERRNO("recv failed");
             break;
         }
 
-        bytes_remaining -= bytes_received;
-        total_received += bytes_received;
-        printf("[DEBUG] Received %zd bytes, %lu bytes remaining for job_id=%u\n",
-               bytes_received, bytes_remaining, job->job_id);
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = pwrite(file_fd, buffer + written, n - written,
+                               offset + total + written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                LOG_ERRNO("write failed");
+                free(buffer);
+                return total + written;
+            }
+            written += w;
+        }
+        total += n;
     }
 
-    printf("[DEBUG] File transfer complete for job_id=%u, total_received=%lu\n",
-           job->job_id, total_received);
+    free(buffer);
+    return total;
+}
 
-    close(file_fd);
-    close(client_fd);
-
-    pthread_mutex_lock(&jobs_mutex);
-    for (size_t i = 0; i < job_count; i++) {
-        if (memcmp(pending_jobs[i].client_id, job->client_id, 16) == 0 &&
-            pending_jobs[i].job_id == job->job_id) {
-            pending_jobs[i].files_received++;
-            pending_jobs[i].last_update = time(NULL);
-            printf("[DEBUG] Updated pending job: job_id=%u, files_received=%d\n",
-                   job->job_id, pending_jobs[i].files_received);
+/*
+ * Move size bytes from the socket into the file at offset through a pipe,
+ * so the payload never crosses into user space. Writes are positional, so
+ * stripes of one file can land concurrently. Falls back to ingest_copy (and
+ * sets *fallback) if the kernel can't splice this socket.
+ */
+static uint64_t ingest_splice(int client_fd, int file_fd, off_t offset, uint64_t size,
+                              int *fallback) {
+    int pipefd[2];
+    uint64_t total = 0;
+    loff_t file_off = offset;
+
+    *fallback = 0;
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        *fallback = 1;
+        return ingest_copy(client_fd, file_fd, offset, size);
+    }
+    // A bigger pipe means fewer round trips; the default is 64 KB
+    fcntl(pipefd[1], F_SETPIPE_SZ, INGEST_PIPE_SIZE);
+
+    while (total < size) {
+        size_t want = size - total > INGEST_PIPE_SIZE ? INGEST_PIPE_SIZE : (size_t)(size - total);
+        ssize_t n = splice(client_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            *fallback = 1;
+            total = ingest_copy(client_fd, file_fd, offset, size);
             break;
         }
+        if (n <= 0) {
+            if (n < 0)
+                LOG_ERRNO("splice from socket failed");
+            break;
+        }
+
+        // Drain the pipe completely before reading more
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t w = splice(pipefd[0], NULL, file_fd, &file_off, left, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                LOG_ERRNO("splice to file failed");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return total + (n - left);
+            }
+            left -= w;
+        }
+        total += n;
     }
-    pthread_mutex_unlock(&jobs_mutex);
-}
 
-void handle_upload_request(int udp_sock, UploadRequest *req, char *filename,
-                         struct sockaddr_in *client_addr) {
-    UploadJob job;
-    memcpy(job.client_id, req->client_id, 16);
-    job.job_id = req->job_id;
-    strncpy(job.filename, filename, sizeof(job.filename));
-    job.filename[sizeof(job.filename)-1] = '\0';
-    job.file_size = req->file_size;
-    job.arrival_time = time(NULL);
-    job.priority = 1.0 / (double)req->file_size;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
 
-    printf("[DEBUG] handle_upload_request: job_id=%u, filename=%s, file_size=%lu, priority=%f\n",
-           job.job_id, job.filename, job.file_size, job.priority);
+// Receive this connection's range; returns the bytes that landed
+static uint64_t process_upload(UploadJob *job) {
+    struct sockaddr_in client_addr;
+    int client_fd = job->fd;
+    
+    // Find client address from PendingJob
+    pthread_rwlock_rdlock(&jobs_lock);
+    int found = 0;
+    PendingJob *pending = find_job(job->client_id, job->job_id);
+    if (pending) {
+        client_addr = pending->client_addr;
+        found = 1;
+    }
+    pthread_rwlock_unlock(&jobs_lock);
+    
+    if (!found) {
+        LOG_ERROR("No job found for upload: job_id=%u", job->job_id);
+        close_stripe(job);
+        return 0;
+    }
+    
+    LOG_DEBUG("process_upload: job_id=%u, filename=%s for client %s:%d",
+           job->job_id, job->filename, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    LOG_DEBUG("Accepted TCP connection from %s:%d for job_id=%u, filename=%s",
+           inet_ntoa(job->peer.sin_addr), ntohs(job->peer.sin_port), job->job_id, job->filename);
 
-    pthread_mutex_lock(&upload_queue.mutex);
+    char dir_path[256];
+    job_path(dir_path, sizeof(dir_path), job->client_id, job->job_id, NULL);
 
-    if (upload_queue.size == upload_queue.capacity) {
-        upload_queue.capacity *= 2;
-        upload_queue.jobs = realloc(upload_queue.jobs,
-                                  upload_queue.capacity * sizeof(UploadJob));
-        printf("[DEBUG] upload_queue resized: new capacity=%d\n", upload_queue.capacity);
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, job->filename);
+    // No O_TRUNC: a resumed upload keeps what an earlier attempt left
+    int file_fd = open(file_path, O_WRONLY | O_CREAT, 0666);
+    if (file_fd < 0) {
+        LOG_ERRNO("open failed");
+        close_stripe(job);
+        return 0;
+    }
+    // A newer UPLOAD_REQ took the file over; bytes written now could land
+    // on top of its own
+    pthread_mutex_lock(&job->file->lock);
+    int superseded = job->file->superseded;
+    pthread_mutex_unlock(&job->file->lock);
+    if (superseded) {
+        LOG_DEBUG("Upload attempt for job_id=%u, %s superseded; stripe %d dropped",
+               job->job_id, job->filename, job->stripe + 1);
+        close(file_fd);
+        close_stripe(job);
+        return 0;
     }
+    uint64_t start, expected;
+    upload_stripe_range(job->offset, job->file_size, job->stripes, job->stripe, &start, &expected);
+    LOG_DEBUG("Receiving file: %s (size=%lu bytes, stripe %d/%d at %lu)",
+           file_path, job->file_size, job->stripe + 1, job->stripes, start);
 
-    int i;
-    for (i = upload_queue.size - 1; i >= 0; i--) {
-        if (job.priority > upload_queue.jobs[i].priority) {
-            upload_queue.jobs[i+1] = upload_queue.jobs[i];
-        } else {
-            break;
-        }
+    // Reserve the blocks up front; KEEP_SIZE leaves st_size alone, so a
+    // file cut short isn't padded out to its full length
+    if (expected > 0 &&
+        fallocate(file_fd, FALLOC_FL_KEEP_SIZE, start, expected) != 0 &&
+        errno != EOPNOTSUPP) {
+        LOG_ERRNO("fallocate failed");
     }
-    upload_queue.jobs[i+1] = job;
-    upload_queue.size++;
 
-    printf("[DEBUG] Job enqueued: job_id=%u, filename=%s, queue size=%d\n",
-           job.job_id, job.filename, upload_queue.size);
+    int fallback;
+    uint64_t started = transfer_clock_usec();
+    uint64_t total_received = ingest_splice(client_fd, file_fd, start, expected, &fallback);
+    uint64_t elapsed = transfer_clock_usec() - started;
 
-    pthread_cond_signal(&upload_available);
-    pthread_mutex_unlock(&upload_queue.mutex);
+    transfer_stats_record(XFER_UPLOAD, total_received, elapsed, fallback);
+    log_append("[UPLOAD]", "job_id=%u %s stripe %d/%d: %lu bytes in %lu ms (%.1f MB/s%s)",
+               job->job_id, job->filename, job->stripe + 1, job->stripes,
+               total_received, elapsed / 1000,
+               elapsed ? total_received / (double)elapsed : 0.0,
+               fallback ? ", copy loop" : "");
+    LOG_DEBUG("File transfer complete for job_id=%u, total_received=%lu",
+           job->job_id, total_received);
 
+    close(file_fd);
+    close_stripe(job);
+    return total_received;
+}
+
+// Through the reactor's batch if there is one, else straight from udp_sock
+static void send_upload_ack(UdpBatch *out, const UploadRequest *req, const char *filename,
+                            const struct sockaddr_in *client_addr, uint8_t status,
+                            const UploadJob *job) {
     UploadResponse resp;
     resp.type = UPLOAD_ACK;
     resp.message_id = req->message_id;
     resp.name_len = strlen(filename);
-    resp.status = STATUS_OK;
+    resp.status = status;
     resp.ip_address = client_addr->sin_addr.s_addr;
     resp.tcp_port = htons(SERVER_PORT);
+    resp.token = job->token;
+    resp.offset = job->offset;
+    resp.stripes = job->stripes;
 
     size_t resp_size = sizeof(resp) + resp.name_len;
     uint8_t *send_buf = malloc(resp_size);
+    if (!send_buf)
+        return;
     memcpy(send_buf, &resp, sizeof(resp));
     memcpy(send_buf + sizeof(resp), filename, resp.name_len);
 
-    printf("[DEBUG] Sending UPLOAD_ACK to %s:%d for job_id=%u\n",
-           inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), job.job_id);
+    LOG_DEBUG("Sending UPLOAD_ACK to %s:%d for job_id=%u",
+           inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), job->job_id);
 
-    sendto(udp_sock, send_buf, resp_size, 0,
-          (struct sockaddr *)client_addr, sizeof(*client_addr));
+    if (out)
+        udp_batch_reply(out, send_buf, resp_size, client_addr);
+    else if (sendto(udp_sock, send_buf, resp_size, 0, (const struct sockaddr *)client_addr,
+                    sizeof(*client_addr)) < 0)
+        LOG_ERRNO("sendto failed for UPLOAD_ACK");
     free(send_buf);
 }
 
-void handle_download_request(int udp_sock, DownloadRequest *req, char *filename,
-                           struct sockaddr_in *client_addr) {
+/*
+ * Open a new attempt at the file an UPLOAD_REQ names and answer it. Runs
+ * on request_pool, holding the file's attempts entry busy while it links
+ * the file in from the blob store or clears the way for a fresh one.
+ */
+static void open_upload_attempt(void *arg) {
+    UploadRequestTask *task = arg;
+    const UploadRequest *req = &task->req;
+    const char *filename = task->filename;
+    const struct sockaddr_in *client_addr = &task->client_addr;
+
+    UploadJob job;
+    memcpy(job.client_id, req->client_id, 16);
+    job.job_id = req->job_id;
+    strncpy(job.filename, filename, sizeof(job.filename));
+    job.filename[sizeof(job.filename)-1] = '\0';
+    job.file_size = req->file_size;
+    job.arrival_time = time(NULL);
+    job.deadline = upload_deadline(&job);
+    job.seq = 0;
+    job.token = 0;
+    job.stripes = 0;
+    job.fd = -1;
+    job.has_hash = req->has_hash != 0;
+    memcpy(job.content_hash, req->content_hash, SHA256_DIGEST_LEN);
+
     char file_path[512];
-    snprintf(file_path, sizeof(file_path), "processing/%02x%02x_%08x/%s",
-             req->client_id[0], req->client_id[1], req->job_id, filename);
+    job_path(file_path, sizeof(file_path), job.client_id, job.job_id, job.filename);
+    job.offset = 0;
 
-    printf("[DEBUG] handle_download_request: job_id=%u, filename=%s, file_path=%s\n",
-           req->job_id, filename, file_path);
+    UploadJob *pending = malloc(sizeof(UploadJob));
+    UploadFile *file = calloc(1, sizeof(UploadFile));
+    if (!pending || !file) {
+        free(pending);
+        free(file);
+        send_upload_ack(NULL, req, filename, client_addr, STATUS_ERROR, &job);
+        free(task);
+        return;
+    }
+    pthread_mutex_init(&file->lock, NULL);
+    file->refs = 1;
+    for (int i = 0; i < UPLOAD_MAX_STRIPES; i++)
+        file->fds[i] = -1;
+    file->job = pending;
 
-    struct stat st;
-    if (stat(file_path, &st) != 0) {
-        fprintf(stderr, "[DEBUG] stat failed for %s: %s\n", file_path, strerror(errno));
-        DownloadResponse resp;
-        resp.type = DOWNLOAD_ACK;
-        resp.message_id = req->message_id;
-        resp.status = STATUS_FILE_NOT_FOUND;
-        resp.file_size = 0;
-        resp.name_len = strlen(filename);
-
-        size_t resp_size = sizeof(resp) + resp.name_len;
-        uint8_t *send_buf = malloc(resp_size);
-        memcpy(send_buf, &resp, sizeof(resp));
-        memcpy(send_buf + sizeof(resp), filename, resp.name_len);
-
-        sendto(udp_sock, send_buf, resp_size, 0,
-              (struct sockaddr *)client_addr, sizeof(*client_addr));
-        free(send_buf);
+    UploadKey key;
+    upload_key(&key, job.client_id, job.job_id, job.filename);
+    pthread_mutex_lock(&upload_queue.mutex);
+    UploadEntry *entry = wait_for_upload_key(&key);
+    if (upload_file_counted(job.client_id, job.job_id, job.filename) == 1) {
+        // A repeated request for an input the job already has; the file
+        // stays exactly as it was counted
+        pthread_mutex_unlock(&upload_queue.mutex);
+        free_upload_file(file);
+        LOG_DEBUG("Upload of %s for job_id=%u already complete", job.filename, job.job_id);
+        send_upload_ack(NULL, req, filename, client_addr, STATUS_ALREADY_PRESENT, &job);
+        free(task);
         return;
     }
+    UploadFile *prev = entry ? entry->file : NULL;
 
-    // Ensure file is readable
-    if (chmod(file_path, 0666) != 0) {
-        fprintf(stderr, "[DEBUG] chmod failed for %s: %s\n", file_path, strerror(errno));
+    // The resume offset is the longest complete prefix the last attempt
+    // at the same content recorded in received[], never the file's size:
+    // stripes write at their own offsets, so st_size only says how far
+    // the furthest one got and a stalled stripe can leave a hole below it.
+    // An attempt still running counts its unfinished stripes as nothing,
+    // and is only resumed from when the hashes show it is the same
+    // content, so a late write of its can only put back the same bytes.
+    if (prev && prev->job->file_size == job.file_size && prev->job->has_hash == job.has_hash &&
+        (prev->retired || job.has_hash) &&
+        (!job.has_hash ||
+         memcmp(prev->job->content_hash, job.content_hash, SHA256_DIGEST_LEN) == 0)) {
+        pthread_mutex_lock(&prev->lock);
+        job.offset = upload_file_prefix(prev);
+        pthread_mutex_unlock(&prev->lock);
     }
 
-    DownloadResponse resp;
-    resp.type = DOWNLOAD_ACK;
-    resp.message_id = req->message_id;
-    resp.status = STATUS_OK;
-    resp.file_size = st.st_size;
-    resp.name_len = strlen(filename);
+    int created;
+    if (!entry && !(entry = open_table_insert(&attempts, &key, &created))) {
+        pthread_mutex_unlock(&upload_queue.mutex);
+        free_upload_file(file);
+        job.offset = 0;
+        send_upload_ack(NULL, req, filename, client_addr, STATUS_ERROR, &job);
+        free(task);
+        return;
+    }
+    entry->file = NULL;
+    entry->busy = 1;
 
-    size_t resp_size = sizeof(resp) + resp.name_len;
-    uint8_t *send_buf = malloc(resp_size);
-    memcpy(send_buf, &resp, sizeof(resp));
-    memcpy(send_buf + sizeof(resp), filename, resp.name_len);
+    // Whatever was there is done with the file from here on. Superseding
+    // comes before the file is touched, so a stripe of prev's that opens it
+    // afterwards finds the flag and writes nothing.
+    if (prev && prev->retired)
+        free_upload_file(prev);
+    else if (prev)
+        supersede_upload_file(prev);
+    pthread_mutex_unlock(&upload_queue.mutex);
 
-    printf("[DEBUG] Sending DOWNLOAD_ACK to %s:%d for job_id=%u, filename=%s, file_size=%lu\n",
-           inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port),
-           req->job_id, filename, (unsigned long)st.st_size);
+    uint8_t status = STATUS_OK;
+    if (job.has_hash) {
+        int linked = blob_store_link(job.content_hash, file_path);
+        if (linked != BLOB_MISSING) {
+            // A retransmitted request finds the link already there and
+            // must not count the file twice
+            if (linked == BLOB_LINKED)
+                count_received_file(job.client_id, job.job_id, job.filename, job.file_size,
+                                    job.content_hash);
+            LOG_DEBUG("Upload of %s for job_id=%u served from the blob store",
+                   job.filename, job.job_id);
+            job.offset = 0;
+            status = STATUS_ALREADY_PRESENT;
+        }
+    }
 
-    sendto(udp_sock, send_buf, resp_size, 0,
-          (struct sockaddr *)client_addr, sizeof(*client_addr));
-    free(send_buf);
+    if (status == STATUS_OK) {
+        struct stat st;
+        if (job.offset > 0 &&
+            (stat(file_path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1 ||
+             (uint64_t)st.st_size < job.offset))
+            job.offset = 0;
+        // Starting over gets a fresh inode rather than cutting this one back:
+        // a stripe of prev's still flushing writes into the old one, and a
+        // blob shared with the store stays whole
+        if (job.offset == 0 && unlink(file_path) != 0 && errno != ENOENT)
+            LOG_ERRNO("unlink of stale upload %s failed", file_path);
 
-    // Enqueue download job
-    DownloadJob job;
-    memcpy(job.client_id, req->client_id, 16);
+        // Stripes each take an upload slot, so never grant more than the slot
+        // budget, and don't split ranges too small to be worth a connection
+        int stripes = req->stripes > 1 ? req->stripes : 1;
+        pthread_mutex_lock(&max_limits_mutex);
+        stripes = MIN(stripes, MAX(max_uploads, 1));
+        pthread_mutex_unlock(&max_limits_mutex);
+        stripes = MIN(stripes, UPLOAD_MAX_STRIPES);
+        stripes = MIN((uint64_t)stripes, MAX((job.file_size - job.offset) / UPLOAD_STRIPE_MIN, 1));
+        job.stripes = stripes;
+        job.stripe = 0;
+
+        LOG_DEBUG("open_upload_attempt: job_id=%u, filename=%s, file_size=%lu, offset=%lu, stripes=%d, deadline=%f",
+               job.job_id, job.filename, job.file_size, job.offset, job.stripes, job.deadline);
+    }
+
+    pthread_mutex_lock(&upload_queue.mutex);
+    entry = open_table_find(&attempts, &key);
+    if (status == STATUS_OK) {
+        job.file = file;
+        job.token = token_table_issue(&pending_uploads, pending);
+        if (job.token) {
+            *pending = job;
+            entry->file = file;
+            entry->busy = 0;
+        } else {
+            status = STATUS_ERROR;
+        }
+    }
+    if (status != STATUS_OK)
+        open_table_remove(&attempts, &key, NULL);
+    pthread_cond_broadcast(&upload_queue.unclaimed);
+    pthread_mutex_unlock(&upload_queue.mutex);
+    if (status != STATUS_OK)
+        free_upload_file(file);
+
+    send_upload_ack(NULL, req, filename, client_addr, status, &job);
+    free(task);
+}
+
+// Reactor side of an UPLOAD_REQ; request_pool does the work and answers
+void handle_upload_request(UdpBatch *out, UploadRequest *req, char *filename,
+                         struct sockaddr_in *client_addr) {
+    UploadRequestTask *task = malloc(sizeof(UploadRequestTask));
+    if (task) {
+        task->req = *req;
+        strncpy(task->filename, filename, sizeof(task->filename));
+        task->filename[sizeof(task->filename)-1] = '\0';
+        task->client_addr = *client_addr;
+        if (worker_pool_submit(&request_pool, open_upload_attempt, task) == 0)
+            return;
+        free(task);
+    }
+
+    UploadJob job;
+    memset(&job, 0, sizeof(job));
     job.job_id = req->job_id;
-    strncpy(job.filename, filename, MAX_FILENAME_LEN - 1);
-    job.filename[MAX_FILENAME_LEN - 1] = '\0';
-    job.message_id = req->message_id;
-    job.client_addr = *client_addr;
-
-    pthread_mutex_lock(&download_queue.mutex);
-    if (download_queue.size == download_queue.capacity) {
-        download_queue.capacity *= 2;
-        download_queue.jobs = realloc(download_queue.jobs, 
-                                   download_queue.capacity * sizeof(DownloadJob));
-        printf("[DEBUG] Download queue resized: new capacity=%d\n", 
-                   download_queue.capacity);
-    }
-    download_queue.jobs[download_queue.size++] = job;
-    pthread_cond_signal(&download_queue.cond);
-    pthread_mutex_unlock(&download_queue.mutex);
-
-    printf("[DEBUG] Enqueued download job for job_id=%u, filename=%s\n",
-           job.job_id, job.filename);
+    send_upload_ack(out, req, filename, client_addr, STATUS_ERROR, &job);
 }
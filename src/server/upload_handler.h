@@ -2,11 +2,30 @@
 #define UPLOAD_HANDLER_H
 
 #include "protocol.h"
+#include "udp_batch.h"
+#include <stdint.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <time.h>
+#include <stddef.h>
 
-void init_upload_handler(int listen_fd);
-void handle_upload_request(int udp_sock, UploadRequest *req, char *filename, struct sockaddr_in *client_addr);
-void handle_download_request(int udp_sock, DownloadRequest *req, char *filename, struct sockaddr_in *client_addr);
+// One queued upload as SHOW_UPLOADS reports it
+typedef struct {
+    uint8_t client_id[16];
+    uint32_t job_id;
+    char filename[MAX_FILENAME_LEN];
+    uint64_t file_size;
+    int stripe;
+    int stripes;
+    double wait;            // Seconds since the UPLOAD_REQ
+    double priority;        // Effective priority now; the client's highest starts next
+} UploadQueueEntry;
+
+void init_upload_handler(void);
+void upload_accept(int listen_fd, uint32_t events, void *ctx);
+void upload_limit_changed(void);
+size_t upload_queue_snapshot(UploadQueueEntry **entries);
+void upload_expire_tokens(time_t now);
+void handle_upload_request(UdpBatch *out, UploadRequest *req, char *filename, struct sockaddr_in *client_addr);
 
 #endif // UPLOAD_HANDLER_H
\ No newline at end of file
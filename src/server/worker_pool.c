@@ -0,0 +1,80 @@
+#include "worker_pool.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WORKER_POOL_INITIAL_CAPACITY 16
+
+static void *worker_main(void *arg)
+{
+	WorkerPool *pool = arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->size == 0)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+
+		WorkItem item = pool->items[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->size--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		item.task(item.arg);
+	}
+	return NULL;
+}
+
+int worker_pool_init(WorkerPool *pool, int thread_count)
+{
+	pool->items = malloc(WORKER_POOL_INITIAL_CAPACITY * sizeof(WorkItem));
+	pool->threads = malloc(thread_count * sizeof(pthread_t));
+	if (!pool->items || !pool->threads) {
+		free(pool->items);
+		free(pool->threads);
+		return -1;
+	}
+	pool->capacity = WORKER_POOL_INITIAL_CAPACITY;
+	pool->head = 0;
+	pool->size = 0;
+	pool->thread_count = thread_count;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (int i = 0; i < thread_count; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+			LOG_ERRNO("pthread_create failed for worker");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int worker_pool_submit(WorkerPool *pool, WorkerTask task, void *arg)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->size == pool->capacity) {
+		WorkItem *items = malloc(2 * pool->capacity * sizeof(WorkItem));
+		if (!items) {
+			pthread_mutex_unlock(&pool->mutex);
+			return -1;
+		}
+		// Unwrap the ring into the new buffer
+		for (int i = 0; i < pool->size; i++)
+			items[i] = pool->items[(pool->head + i) % pool->capacity];
+		free(pool->items);
+		pool->items = items;
+		pool->head = 0;
+		pool->capacity *= 2;
+	}
+
+	int tail = (pool->head + pool->size) % pool->capacity;
+	pool->items[tail].task = task;
+	pool->items[tail].arg = arg;
+	pool->size++;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
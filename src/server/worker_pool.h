@@ -0,0 +1,33 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+typedef void (*WorkerTask)(void *arg);
+
+typedef struct {
+	WorkerTask task;
+	void *arg;
+} WorkItem;
+
+/*
+ * Fixed set of threads draining a FIFO of tasks. The FIFO is a ring that
+ * doubles when full, so submit never blocks the reactor.
+ */
+typedef struct {
+	pthread_t *threads;
+	int thread_count;
+
+	WorkItem *items;
+	int head;
+	int size;
+	int capacity;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} WorkerPool;
+
+int worker_pool_init(WorkerPool *pool, int thread_count);
+int worker_pool_submit(WorkerPool *pool, WorkerTask task, void *arg);
+
+#endif // WORKER_POOL_H
@@ -10,13 +10,90 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <strings.h>
 
 // Utility macros
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-// Error handling
-#define LOG_ERROR(fmt, ...) fprintf(stderr, "[ERROR] " fmt "\n", ##__VA_ARGS__)
-#define LOG_INFO(fmt, ...) fprintf(stdout, "[INFO] " fmt "\n", ##__VA_ARGS__)
+// Log levels, most severe first
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4   // Per datagram / per chunk
+
+/*
+ * Levels above LOG_LEVEL_MAX are compiled out: the condition below is a
+ * constant 0 for them, so the call and its arguments vanish (but are still
+ * type-checked). Build with e.g. make LOG_LEVEL_MAX=LOG_LEVEL_INFO.
+ * log_level filters the rest at runtime; each binary defines it. The admin
+ * console changes it while other threads log, so it is only touched through
+ * relaxed atomics: a logger may see the old level for a moment, nothing more.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+extern int log_level;
+
+#define LOG_ENABLED(level) \
+    ((level) <= LOG_LEVEL_MAX && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define LOG_AT(level, stream, tag, ...) \
+    do { if (LOG_ENABLED(level)) log_print(stream, tag, __VA_ARGS__); } while (0)
+
+// Each takes a printf format and arguments; the newline is added
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, stderr, "[ERROR] ", __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, stderr, "[WARN] ", __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, stdout, "[INFO] ", __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, stdout, "[DEBUG] ", __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, stdout, "[TRACE] ", __VA_ARGS__)
+
+// perror() at error level: the message, then what errno says
+#define LOG_ERRNO(...) \
+    do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) log_print_errno(__VA_ARGS__); } while (0)
+
+static inline void log_vprint(FILE *stream, const char *tag, const char *suffix,
+                              const char *fmt, va_list args) {
+    flockfile(stream);
+    fputs(tag, stream);
+    vfprintf(stream, fmt, args);
+    fputs(suffix, stream);
+    fputc('\n', stream);
+    funlockfile(stream);
+}
+
+static inline void log_print(FILE *stream, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+static inline void log_print(FILE *stream, const char *tag, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_vprint(stream, tag, "", fmt, args);
+    va_end(args);
+}
+
+static inline void log_print_errno(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void log_print_errno(const char *fmt, ...) {
+    const char *reason = strerror(errno);
+    char suffix[128];
+    va_list args;
+
+    snprintf(suffix, sizeof(suffix), ": %s", reason);
+    va_start(args, fmt);
+    log_vprint(stderr, "[ERROR] ", suffix, fmt, args);
+    va_end(args);
+}
+
+// "error", "warn", "info", "debug" or "trace"; -1 if it is none of them
+static inline int log_level_parse(const char *name) {
+    static const char *const names[] = { "error", "warn", "info", "debug", "trace" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if (strcasecmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
 
 #endif // COMMON_H
\ No newline at end of file
@@ -30,7 +30,8 @@ typedef enum {
     STATUS_INVALID_REQUEST,
     STATUS_JOB_EXISTS,
     STATUS_UPLOAD_LIMIT,
-    STATUS_FILE_NOT_FOUND
+    STATUS_FILE_NOT_FOUND,
+    STATUS_ALREADY_PRESENT  // UPLOAD_ACK: the server had the content, nothing to send
 } StatusCode;
 
 // Client ID request (C->S)
@@ -81,6 +82,9 @@ typedef struct {
     uint32_t job_id;
     uint64_t file_size;
     uint16_t name_len;
+    uint8_t stripes;    // Parallel connections wanted, 0 or 1 = one stream
+    uint8_t has_hash;   // Nonzero if content_hash is set
+    uint8_t content_hash[32];   // SHA-256 of the whole file
     // Followed by filename string (variable length)
 } UploadRequest;
 
@@ -93,6 +97,9 @@ typedef struct {
     uint8_t status;
     uint32_t ip_address;
     uint16_t tcp_port;
+    uint64_t token;     // Sent back as the TransferHeader on tcp_port
+    uint64_t offset;    // Bytes the server already has; send the rest
+    uint8_t stripes;    // Connections granted, each carrying one range
 } UploadResponse;
 
 // Job result (S->C)
@@ -123,7 +130,23 @@ typedef struct {
     uint8_t status;
     uint64_t file_size;
     uint16_t name_len;
+    uint64_t token;     // Sent back as the TransferHeader on SERVER_PORT + 1
     // Followed by filename string (variable length)
 } DownloadResponse;
 
+// First bytes on an upload or download TCP connection (C->S)
+typedef struct {
+    uint64_t token;     // From UPLOAD_ACK / DOWNLOAD_ACK
+    uint32_t stripe;    // Range index of a striped upload, otherwise 0
+} TransferHeader;
+
+// Range carried by stripe i of k over [offset, size): equal parts, the
+// remainder going to the last stripe
+static inline void upload_stripe_range(uint64_t offset, uint64_t size, int k, int i,
+                                       uint64_t *start, uint64_t *len) {
+    uint64_t per = (size - offset) / k;
+    *start = offset + per * i;
+    *len = i == k - 1 ? size - *start : per;
+}
+
 #endif // PROTOCOL_H
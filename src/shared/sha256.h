@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // Bytes hashed so far
+    uint8_t block[64];
+    size_t used;            // Bytes waiting in block
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// Hash everything readable from fd, from offset 0; returns 0 or -1 on a read error
+int sha256_fd(int fd, uint8_t digest[SHA256_DIGEST_LEN]);
+
+#endif // SHA256_H